@@ -0,0 +1,176 @@
+#ifndef TEST_ALGO_CACHE_HPP
+#define TEST_ALGO_CACHE_HPP
+
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include "test_tuning_db.hpp"
+
+// How to pick among the conv algorithms whose workspace fits the budget:
+// the fastest, the one with the smallest workspace, or the smallest
+// workspace among those at most tolerance percent slower than the
+// fastest. HandleDefault defers to the handle, see WorkspaceArena.
+struct ConvAlgoPolicy {
+    enum Kind {
+        HandleDefault,
+        Fastest,
+        SmallestWorkspace,
+        WithinTolerance
+    };
+    Kind kind = HandleDefault;
+    float tolerance = 0;
+
+    ConvAlgoPolicy() {}
+    ConvAlgoPolicy(Kind k, float percent = 0) : kind(k), tolerance(percent) {}
+
+    // "fastest", "smallest" or "within:<percent>", Fastest otherwise
+    static ConvAlgoPolicy parse(const char* text) {
+        std::string name = text == nullptr ? "" : text;
+        if (name == "smallest")
+            return ConvAlgoPolicy(SmallestWorkspace);
+        if (name.compare(0, 7, "within:") == 0)
+            return ConvAlgoPolicy(WithinTolerance,
+                    static_cast<float>(atof(name.c_str() + 7)));
+        return ConvAlgoPolicy(Fastest);
+    }
+
+    // Tag of the search results made under the policy, empty for Fastest
+    std::string tag() const {
+        if (kind == SmallestWorkspace)
+            return "small";
+        if (kind == WithinTolerance)
+            return "within" + std::to_string(tolerance);
+        return "";
+    }
+};
+
+// Index of the candidate the policy picks among those that fit in
+// budget bytes, -1 if none does
+inline int selectConvAlgo(const std::vector<ConvAlgoEntry>& candidates,
+        size_t budget, const ConvAlgoPolicy& policy) {
+    int fastest = -1, smallest = -1;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        const ConvAlgoEntry& c = candidates[i];
+        if (c.workSpaceSize > budget) continue;
+        if (fastest < 0 || c.time < candidates[fastest].time)
+            fastest = i;
+        if (smallest < 0 || c.workSpaceSize <
+                candidates[smallest].workSpaceSize ||
+                (c.workSpaceSize == candidates[smallest].workSpaceSize &&
+                c.time < candidates[smallest].time))
+            smallest = i;
+    }
+    if (policy.kind == ConvAlgoPolicy::SmallestWorkspace || fastest < 0)
+        return smallest;
+    if (policy.kind != ConvAlgoPolicy::WithinTolerance)
+        return fastest;
+    float limit = candidates[fastest].time * (1 + policy.tolerance / 100);
+    int picked = fastest;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        const ConvAlgoEntry& c = candidates[i];
+        if (c.workSpaceSize <= budget && c.time <= limit &&
+                c.workSpaceSize < candidates[picked].workSpaceSize)
+            picked = i;
+    }
+    return picked;
+}
+
+// Process-wide cache of the algorithm searches, so the expensive Find
+// only runs the first time a problem shows up on a device. Handles attach
+// their device at creation, which preloads the results the tuning db
+// holds for its arch; new results are appended to the db.
+class ConvAlgoCache final{
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, ConvAlgoEntry> entries_;
+    std::unordered_map<int, std::string> deviceArch_;
+    std::string dbPath_;
+    std::atomic<size_t> hits_{0};
+    std::atomic<size_t> misses_{0};
+
+    ConvAlgoCache() : dbPath_(TuningDb::defaultPath()) {}
+
+    static std::string entryKey(int deviceId, const std::string& key) {
+        return std::to_string(deviceId) + ":" + key;
+    }
+
+    void loadDevice(int deviceId, const std::string& arch) {
+        // Drop the results later appends replaced, the file stays small
+        TuningDb::compact(dbPath_);
+        TuningDb::load(dbPath_, [&](const std::string& recordArch,
+                const std::string& key, const ConvAlgoEntry& entry) {
+            if (recordArch == arch)
+                entries_[entryKey(deviceId, key)] = entry;
+        });
+    }
+
+public:
+    ConvAlgoCache(const ConvAlgoCache&) = delete;
+    ConvAlgoCache& operator=(const ConvAlgoCache&) = delete;
+
+    static ConvAlgoCache& instance() {
+        static ConvAlgoCache cache;
+        return cache;
+    }
+
+    void attachDevice(int deviceId, const std::string& arch) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (deviceArch_.count(deviceId)) return;
+        deviceArch_[deviceId] = arch;
+        loadDevice(deviceId, arch);
+    }
+
+    bool find(int deviceId, const std::string& key, ConvAlgoEntry& entry) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(entryKey(deviceId, key));
+        if (it == entries_.end()) {
+            misses_++;
+            return false;
+        }
+        hits_++;
+        entry = it->second;
+        return true;
+    }
+
+    void insert(int deviceId, const std::string& key,
+            const ConvAlgoEntry& entry) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_[entryKey(deviceId, key)] = entry;
+        auto arch = deviceArch_.find(deviceId);
+        if (arch != deviceArch_.end())
+            TuningDb::append(dbPath_, arch->second, key, entry);
+    }
+
+    // Point at another tuning db and reload every attached device from it
+    void setTuningDbPath(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        dbPath_ = path;
+        entries_.clear();
+        for (const auto& device : deviceArch_)
+            loadDevice(device.first, device.second);
+    }
+
+    std::string tuningDbPath() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dbPath_;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        hits_ = 0;
+        misses_ = 0;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+};
+
+#endif
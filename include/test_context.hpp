@@ -0,0 +1,246 @@
+#ifndef TEST_CONTEXT_HPP
+#define TEST_CONTEXT_HPP
+
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+enum class Backend {
+    Hip,
+    Host
+};
+
+inline const char* backendName(Backend backend) {
+    return backend == Backend::Hip ? "hip" : "host";
+}
+
+class WorkspaceArena;
+class ExecContext;
+struct PlanState;
+
+// Point in the work queued on a handle, complete once everything queued
+// before it has run
+class Event {
+private:
+    const ExecContext* owner_;
+
+public:
+    explicit Event(const ExecContext* owner) : owner_(owner) {}
+    virtual ~Event() {}
+    const ExecContext* owner() const { return owner_; }
+    virtual bool query() = 0;
+    virtual void synchronize() = 0;
+};
+
+// TEST_ASYNC=1 starts handles in async mode
+inline bool defaultAsync() {
+    const char* env = getenv("TEST_ASYNC");
+    return env != nullptr && std::string(env) == "1";
+}
+
+// Execution context every operator runs on: a HIP stream with its MIOpen
+// and hipBLAS handles, or the host thread pool.
+class ExecContext {
+protected:
+    bool async_ = defaultAsync();
+    std::map<std::string, std::shared_ptr<PlanState>> planCache_;
+
+public:
+    virtual ~ExecContext() {}
+    virtual Backend backend() const = 0;
+    virtual int deviceId() = 0;
+    // Device architecture tuning results are shared across, e.g. gfx906
+    virtual const std::string& arch() = 0;
+    // Scratch memory operators borrow during a call
+    virtual WorkspaceArena& workspace() = 0;
+    // Wait until all work queued on the handle has run
+    virtual void streamSynchronize() = 0;
+    // States of the plans one-shot operator calls prepared on the
+    // handle, by problem
+    std::map<std::string, std::shared_ptr<PlanState>>& planCache() {
+        return planCache_;
+    }
+
+    // In async mode operators only queue their work and every tensor they
+    // touch carries an event until it has run. Sync mode waits at the end
+    // of each operator.
+    bool async() const { return async_; }
+    void setAsync(bool async) {
+        streamSynchronize();
+        async_ = async;
+    }
+    // Run the body of an operator: it is queued on the host task queue in
+    // async mode, HIP runs it right away since it only launches kernels
+    virtual void submit(const std::function<void()>& body) = 0;
+    virtual std::shared_ptr<Event> recordEvent() = 0;
+    // Work queued on this handle from now on starts after event
+    virtual void waitEvent(const std::shared_ptr<Event>& event) = 0;
+};
+
+inline bool hipAvailable() {
+#ifdef USE_HOST_ONLY
+    return false;
+#else
+    int count = 0;
+    return hipGetDeviceCount(&count) == hipSuccess && count > 0;
+#endif
+}
+
+// Backend of the process, chosen once: TEST_BACKEND=hip|host if set,
+// otherwise HIP whenever a device is visible.
+inline Backend processDefaultBackend() {
+    static const Backend backend = [] {
+        const char* env = getenv("TEST_BACKEND");
+        std::string name = env == nullptr ? "" : env;
+        CHECK_ARGS(name == "" || name == "hip" || name == "host",
+                "TEST_BACKEND must be hip or host!");
+        if (name == "hip")
+            CHECK_ARGS(hipAvailable(), "No HIP device is available!");
+        if (name == "host" || !hipAvailable())
+            return Backend::Host;
+        return Backend::Hip;
+    }();
+    return backend;
+}
+
+// Backend of tensors created on this thread without naming one
+inline Backend& currentBackend() {
+    static thread_local Backend backend = processDefaultBackend();
+    return backend;
+}
+
+class BackendGuard final{
+private:
+    Backend saved_;
+
+public:
+    BackendGuard(const BackendGuard&) = delete;
+    BackendGuard& operator=(const BackendGuard&) = delete;
+
+    explicit BackendGuard(Backend backend) : saved_(currentBackend()) {
+        currentBackend() = backend;
+    }
+    ~BackendGuard() { currentBackend() = saved_; }
+};
+
+// Raw memory of each backend, host memory is aligned for SIMD loads
+class BackendMemory {
+public:
+    // nullptr when the backend is out of memory
+    static void* tryAllocate(Backend backend, size_t bytes) {
+        void* ptr = nullptr;
+        if (backend == Backend::Host)
+            return posix_memalign(&ptr, 64, bytes) == 0 ? ptr : nullptr;
+#ifndef USE_HOST_ONLY
+        if (hipMalloc(&ptr, bytes) != hipSuccess)
+            return nullptr;
+#endif
+        return ptr;
+    }
+
+    static void* allocate(Backend backend, size_t bytes) {
+#ifdef USE_HOST_ONLY
+        CHECK_ARGS(backend == Backend::Host, "HIP backend is not available!");
+#endif
+        void* ptr = tryAllocate(backend, bytes);
+        CHECK_ARGS(ptr != nullptr || bytes == 0, "Allocation failed!");
+        return ptr;
+    }
+
+    // Page-locked host memory HIP copies can run from without blocking,
+    // plain host memory when no device is available
+    static void* tryAllocatePinned(size_t bytes) {
+#ifndef USE_HOST_ONLY
+        if (hipAvailable()) {
+            void* ptr = nullptr;
+            if (hipHostMalloc(&ptr, bytes, hipHostMallocDefault) !=
+                    hipSuccess)
+                return nullptr;
+            return ptr;
+        }
+#endif
+        return tryAllocate(Backend::Host, bytes);
+    }
+
+    static void releasePinned(void* ptr) {
+#ifndef USE_HOST_ONLY
+        if (hipAvailable()) {
+            hipHostFree(ptr);
+            return;
+        }
+#endif
+        free(ptr);
+    }
+
+    // Device of the calling thread, -1 for the host
+    static int currentDevice(Backend backend) {
+        int device = -1;
+#ifndef USE_HOST_ONLY
+        if (backend == Backend::Hip)
+            CHECK_CALL_HIP(hipGetDevice(&device));
+#else
+        (void)backend;
+#endif
+        return device;
+    }
+
+    static void release(Backend backend, void* ptr) {
+        if (backend == Backend::Host) {
+            free(ptr);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        hipFree(ptr);
+#endif
+    }
+
+    static void memset(Backend backend, void* ptr, int value, size_t bytes) {
+        if (bytes == 0) return;
+        if (backend == Backend::Host) {
+            ::memset(ptr, value, bytes);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        CHECK_CALL_HIP(hipMemset(ptr, value, bytes));
+#endif
+    }
+
+    static void copyFromHost(Backend backend,
+            void* dst, const void* src, size_t bytes) {
+        if (bytes == 0) return;
+        if (backend == Backend::Host) {
+            memcpy(dst, src, bytes);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        CHECK_CALL_HIP(hipMemcpy(dst, src, bytes, hipMemcpyHostToDevice));
+#endif
+    }
+
+    // Waits for the work of the null stream
+    static void synchronize(Backend backend) {
+#ifndef USE_HOST_ONLY
+        if (backend == Backend::Hip)
+            CHECK_CALL_HIP(hipStreamSynchronize(0));
+#else
+        (void)backend;
+#endif
+    }
+
+    static void copyToHost(Backend backend,
+            void* dst, const void* src, size_t bytes) {
+        if (bytes == 0) return;
+        if (backend == Backend::Host) {
+            memcpy(dst, src, bytes);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        CHECK_CALL_HIP(hipMemcpy(dst, src, bytes, hipMemcpyDeviceToHost));
+#endif
+    }
+};
+
+#endif
@@ -9,6 +9,10 @@ struct ConvDescriptor {
     std::vector<int> padding;
     std::vector<int> stride;
     std::vector<int> dilation;
+    // Tighter workspace budget and another algorithm policy for this
+    // call than the handle's, see WorkspaceArena
+    size_t workspaceLimit = std::numeric_limits<size_t>::max();
+    ConvAlgoPolicy algoPolicy;
     ConvDescriptor(const std::string mode_in,
             const int padding_h, const int padding_w,
             const int stride_h, const int stride_w) {
@@ -30,6 +34,7 @@ struct ConvDescriptor {
         dilation.push_back(dilation_h);
         dilation.push_back(dilation_w);
     }
+#ifndef USE_HOST_ONLY
     miopenConvolutionMode_t getMode(){
         if(mode == "conv") {
             return miopenConvolution;
@@ -40,6 +45,7 @@ struct ConvDescriptor {
             exit(1);
         }
     }
+#endif
 };
 
 // Pooling
@@ -61,6 +67,7 @@ struct PoolingDescriptor {
         stride.push_back(stride_h);
         stride.push_back(stride_w);
     }
+#ifndef USE_HOST_ONLY
     miopenPoolingMode_t getMode(){
         if(mode == "avg") {
             return miopenPoolingAverage;
@@ -71,6 +78,97 @@ struct PoolingDescriptor {
             exit(1);
         }
     }
+#endif
 };
 
+// Activation
+struct ActivationDescriptor {
+    std::string mode;
+    // Slope below zero for "leakyrelu", ceiling for "clippedrelu"
+    float alpha = 0;
+    ActivationDescriptor(std::string mode_in, float alpha_in = 0) {
+        mode = mode_in;
+        alpha = alpha_in;
+    }
+#ifndef USE_HOST_ONLY
+    miopenActivationMode_t getMode() const {
+        if(mode == "relu") {
+            return miopenActivationRELU;
+        } else if(mode == "leakyrelu") {
+            return miopenActivationLEAKYRELU;
+        } else if(mode == "clippedrelu") {
+            return miopenActivationCLIPPEDRELU;
+        } else {
+            std::cerr << "Error: Unknown activation mode!" << std::endl;
+            exit(1);
+        }
+    }
+#endif
+};
+
+enum class ConvDirection {
+    Forward,
+    BackwardData,
+    BackwardWeight
+};
+
+inline const char* convDirectionName(ConvDirection direction) {
+    switch (direction) {
+    case ConvDirection::Forward: return "fwd";
+    case ConvDirection::BackwardData: return "bwd";
+    default: return "wrw";
+    }
+}
+
+template<typename T>
+inline const char* dataTypeName() {
+    if (std::is_same<T, float>::value) return "f32";
+    if (std::is_same<T, double>::value) return "f64";
+    if (std::is_same<T, int>::value) return "i32";
+    return "unknown";
+}
+
+// Everything about a problem the choice of algorithm depends on, apart
+// from the device, flattened to a string such as
+// "fwd-conv-f32-x32x3x224x224-w64x3x3x3-y32x64x224x224-g1-p1x1-s1x1-l1x1".
+template<typename T>
+inline std::string makeConvProblemKey(ConvDirection direction,
+        const ConvDescriptor& convSpec,
+        const std::vector<int>& xDims, const std::vector<int>& wDims,
+        const std::vector<int>& yDims) {
+    auto join = [](std::ostringstream& os, const char* tag,
+            const std::vector<int>& values, int fill) {
+        os << "-" << tag;
+        for (size_t i = 0; i < std::max<size_t>(values.size(), 2); i++)
+            os << (i ? "x" : "") << (i < values.size() ? values[i] : fill);
+    };
+    std::ostringstream os;
+    os << convDirectionName(direction) << "-" << convSpec.mode << "-"
+        << dataTypeName<T>();
+    join(os, "x", xDims, 0);
+    join(os, "w", wDims, 0);
+    join(os, "y", yDims, 0);
+    os << "-g" << convSpec.group;
+    join(os, "p", convSpec.padding, 0);
+    join(os, "s", convSpec.stride, 1);
+    std::vector<int> dilation(convSpec.dilation.begin(),
+            convSpec.dilation.begin() +
+            std::min<size_t>(convSpec.dilation.size(), 2));
+    join(os, "l", dilation, 1);
+    return os.str();
+}
+
+// A search under a workspace budget only sees the algorithms that fit
+// and another policy may pick another one, so their results are kept
+// apart from the unconstrained fastest one
+inline std::string makeConvSearchKey(const std::string& problemKey,
+        size_t budget, const ConvAlgoPolicy& policy) {
+    std::string key = problemKey;
+    if (budget != std::numeric_limits<size_t>::max())
+        key += "-ws" + std::to_string(budget);
+    if (!policy.tag().empty())
+        key += "-" + policy.tag();
+    return key;
+}
+
 #endif
@@ -1,15 +1,54 @@
 #ifndef TEST_HANDLE_HPP
 #define TEST_HANDLE_HPP
 
+#ifndef USE_HOST_ONLY
 #include <hipblas.h>
 #include <miopen/miopen.h>
+#endif
+#include "test_context.hpp"
+#include "test_thread_pool.hpp"
+#include "test_algo_cache.hpp"
+#include "test_workspace.hpp"
+
+#ifndef USE_HOST_ONLY
+class HipEvent final : public Event{
+private:
+    hipEvent_t event_;
+
+public:
+    HipEvent(const HipEvent&) = delete;
+    HipEvent& operator=(const HipEvent&) = delete;
+
+    HipEvent(const ExecContext* owner, hipStream_t stream) : Event(owner) {
+        CHECK_CALL_HIP(hipEventCreateWithFlags(&event_,
+                hipEventDisableTiming));
+        CHECK_CALL_HIP(hipEventRecord(event_, stream));
+    }
+
+    ~HipEvent() { hipEventDestroy(event_); }
+
+    hipEvent_t event() { return event_; }
+
+    bool query() override {
+        hipError_t status = hipEventQuery(event_);
+        if (status == hipErrorNotReady) return false;
+        CHECK_CALL_HIP(status);
+        return true;
+    }
+
+    void synchronize() override {
+        CHECK_CALL_HIP(hipEventSynchronize(event_));
+    }
+};
 
-class HipHandle final{
+class HipHandle final : public ExecContext{
 private:
     miopenHandle_t miopenHandle_;
     hipblasHandle_t hipblasHandle_;
     hipStream_t stream_;
     int deviceId_;
+    std::string arch_;
+    std::unique_ptr<WorkspaceArena> workspace_;
 
 public:
     using key_t = size_t;
@@ -20,9 +59,7 @@ public:
     HipHandle& operator=(const HipHandle&) = delete;
     HipHandle& operator=(HipHandle&&) = delete;
 
-    HipHandle() {
-        new (this) HipHandle(0);
-    }
+    HipHandle() : HipHandle(0) {}
 
     explicit HipHandle(int deviceId) : deviceId_(deviceId) {
         CHECK_CALL_HIP(hipSetDevice(deviceId));
@@ -30,9 +67,16 @@ public:
         CHECK_CALL_MIOPEN(miopenCreateWithStream(&miopenHandle_, stream_));
         CHECK_CALL_HIPBLAS(hipblasCreate(&hipblasHandle_));
         CHECK_CALL_HIPBLAS(hipblasSetStream(hipblasHandle_, stream_));
+        workspace_.reset(new WorkspaceArena(Backend::Hip, deviceId, stream_));
+
+        hipDeviceProp_t prop;
+        CHECK_CALL_HIP(hipGetDeviceProperties(&prop, deviceId));
+        arch_ = "gfx" + std::to_string(prop.gcnArch);
+        ConvAlgoCache::instance().attachDevice(deviceId_, arch_);
     }
 
     ~HipHandle() {
+        workspace_.reset();
         if (miopenHandle_)
             CHECK_CALL_MIOPEN(miopenDestroy(miopenHandle_));
         if (hipblasHandle_)
@@ -41,11 +85,128 @@ public:
             CHECK_CALL_HIP(hipStreamDestroy(stream_));
     }
 
-    int deviceId() {return deviceId_;}
+    Backend backend() const override {return Backend::Hip;}
+    int deviceId() override {return deviceId_;}
+    const std::string& arch() override {return arch_;}
+    WorkspaceArena& workspace() override {return *workspace_;}
     hipStream_t stream() {return stream_;}
     miopenHandle_t miopenHandle() {return miopenHandle_;}
     hipblasHandle_t hipblasHandle() {return hipblasHandle_;}
-    void streamSynchronize() { CHECK_CALL_HIP(hipStreamSynchronize(stream_)); }
+    void streamSynchronize() override {
+        CHECK_CALL_HIP(hipStreamSynchronize(stream_));
+    }
+
+    void submit(const std::function<void()>& body) override { body(); }
+
+    std::shared_ptr<Event> recordEvent() override {
+        return std::make_shared<HipEvent>(this, stream_);
+    }
+
+    void waitEvent(const std::shared_ptr<Event>& event) override {
+        if (event->owner() == this) return;
+        HipEvent* hipEvent = dynamic_cast<HipEvent*>(event.get());
+        if (hipEvent == nullptr) {
+            event->synchronize();
+            return;
+        }
+        CHECK_CALL_HIP(hipStreamWaitEvent(stream_, hipEvent->event(), 0));
+    }
 };
+#endif
+
+class HostEvent final : public Event{
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool done_ = false;
+
+public:
+    explicit HostEvent(const ExecContext* owner) : Event(owner) {}
+
+    void complete() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        cond_.notify_all();
+    }
+
+    bool query() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return done_;
+    }
+
+    void synchronize() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [&] { return done_; });
+    }
+};
+
+class HostHandle final : public ExecContext{
+private:
+    ThreadPool threadPool_;
+    TaskQueue queue_;
+    std::string arch_ = "host";
+    WorkspaceArena workspace_{Backend::Host, -1};
+
+public:
+    HostHandle(const HostHandle&) = delete;
+    HostHandle(HostHandle&&) = delete;
+    HostHandle& operator=(const HostHandle&) = delete;
+    HostHandle& operator=(HostHandle&&) = delete;
+
+    HostHandle() : HostHandle(ThreadPool::defaultSize()) {}
+
+    explicit HostHandle(int numThreads) : threadPool_(numThreads) {
+        ConvAlgoCache::instance().attachDevice(deviceId(), arch_);
+    }
+
+    ~HostHandle() { queue_.drain(); }
+
+    Backend backend() const override {return Backend::Host;}
+    int deviceId() override {return -1;}
+    const std::string& arch() override {return arch_;}
+    WorkspaceArena& workspace() override {return workspace_;}
+    int numThreads() {return threadPool_.size();}
+    ThreadPool& threadPool() {return threadPool_;}
+    void streamSynchronize() override { queue_.drain(); }
+
+    void submit(const std::function<void()>& body) override {
+        if (!async_ || queue_.onWorker()) {
+            body();
+            return;
+        }
+        queue_.push([body] {
+            BackendGuard guard(Backend::Host);
+            body();
+        });
+    }
+
+    std::shared_ptr<Event> recordEvent() override {
+        std::shared_ptr<HostEvent> event = std::make_shared<HostEvent>(this);
+        if (async_)
+            queue_.push([event] { event->complete(); });
+        else
+            event->complete();
+        return event;
+    }
+
+    void waitEvent(const std::shared_ptr<Event>& event) override {
+        if (event->owner() == this) return;
+        if (async_)
+            queue_.push([event] { event->synchronize(); });
+        else
+            event->synchronize();
+    }
+};
+
+// Context on the process default backend, deviceId is ignored on the host
+inline std::unique_ptr<ExecContext> createExecContext(int deviceId = 0) {
+    if (processDefaultBackend() == Backend::Hip) {
+#ifndef USE_HOST_ONLY
+        return std::unique_ptr<ExecContext>(new HipHandle(deviceId));
+#endif
+    }
+    (void)deviceId;
+    return std::unique_ptr<ExecContext>(new HostHandle());
+}
 
 #endif
@@ -1,17 +1,21 @@
 #ifndef TEST_HELPER_HPP
 #define TEST_HELPER_HPP
 
+#ifndef USE_HOST_ONLY
 #ifndef __HIP_PLATFORM_HCC__
 #define __HIP_PLATFORM_HCC__
 #endif
+#endif
 
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 
+#ifndef USE_HOST_ONLY
 #include <hip/hip_runtime.h>
 #include <hip/hip_runtime_api.h>
+#endif
 
 #include <vector>
 #include <numeric>
@@ -67,6 +71,8 @@
 
 #include "test_handle.hpp"
 #include "test_tensor.hpp"
+#include "test_run_op.hpp"
+#include "test_memory_planner.hpp"
 #include "test_time_logger.hpp"
 
 #endif
@@ -0,0 +1,152 @@
+#ifndef TEST_HOST_FUNCTIONS_HPP
+#define TEST_HOST_FUNCTIONS_HPP
+
+#include "test_thread_pool.hpp"
+
+// Geometry of a 2d convolution seen from its forward direction: "im" is
+// the convolution input and "out" its output, weights are laid out as
+// {outChannels, imChannels / group, kernelH, kernelW}. Deconvolution uses
+// the same shape with im/out swapped.
+struct HostConvShape {
+    int batch = 1;
+    int group = 1;
+    int imChannels = 0, imH = 0, imW = 0;
+    int outChannels = 0, outH = 0, outW = 0;
+    int kernelH = 1, kernelW = 1;
+    int padH = 0, padW = 0;
+    int strideH = 1, strideW = 1;
+    int dilationH = 1, dilationW = 1;
+
+    int imSize() const { return imChannels * imH * imW; }
+    int outSize() const { return outChannels * outH * outW; }
+    int colRows() const { return imChannels / group * kernelH * kernelW; }
+    int colCols() const { return outH * outW; }
+    bool isPointwise() const {
+        return kernelH == 1 && kernelW == 1 && padH == 0 && padW == 0 &&
+            strideH == 1 && strideW == 1;
+    }
+};
+
+enum class HostActivation {
+    None,
+    Relu,
+    LeakyRelu,
+    ClippedRelu
+};
+
+// Bias and activation folded into the store of a GEMM: every element
+// becomes act(c + bias), with bias indexed by the row or the column of C.
+// Operators apply it to tiles that are still in cache instead of making
+// extra passes over the output.
+template<typename T>
+struct GemmEpilogue {
+    const T* bias = nullptr;
+    bool biasPerRow = false;
+    HostActivation activation = HostActivation::None;
+    // Slope of LeakyRelu, ceiling of ClippedRelu
+    T alpha = T(0);
+
+    T apply(T value, size_t row, size_t col) const {
+        if (bias != nullptr)
+            value += bias[biasPerRow ? row : col];
+        switch (activation) {
+        case HostActivation::Relu:
+            return value > T(0) ? value : T(0);
+        case HostActivation::LeakyRelu:
+            return value > T(0) ? value : alpha * value;
+        case HostActivation::ClippedRelu:
+            return value < T(0) ? T(0) : value > alpha ? alpha : value;
+        default:
+            return value;
+        }
+    }
+
+    // The same epilogue for the block of C starting at (row, col)
+    GemmEpilogue offset(size_t row, size_t col) const {
+        GemmEpilogue shifted = *this;
+        if (bias != nullptr)
+            shifted.bias += biasPerRow ? row : col;
+        return shifted;
+    }
+};
+
+// Forward convolution variants of the host, the algo ids of their
+// ConvAlgoCache entries
+enum class HostConvAlgo {
+    Im2col,
+    Direct,
+    Winograd
+};
+
+// Host implementations of the compute primitives behind the operators.
+// Matrices follow the BLAS column-major convention of OperatorsFunc.
+template<typename T>
+class HostFunc {
+public:
+    // pool may be nullptr to run on the calling thread only
+    static void gemm(ThreadPool* pool,
+            char transa, char transb, size_t m, size_t n, size_t k,
+            T alpha, const T* A, size_t lda, const T* B, size_t ldb,
+            T beta, T* C, size_t ldc,
+            const GemmEpilogue<T>* epilogue = nullptr);
+
+    // nbatch independent gemms, matrix i starts at A + i * strideA etc.
+    static void gemmBatched(ThreadPool* pool,
+            char transa, char transb, size_t m, size_t n, size_t k,
+            T alpha, const T* A, size_t lda, size_t strideA,
+            const T* B, size_t ldb, size_t strideB,
+            T beta, T* C, size_t ldc, size_t strideC, size_t nbatch);
+
+    // Micro-kernel picked for this CPU: "avx512", "avx2" or "generic".
+    // TEST_HOST_GEMM=<name> forces one of them.
+    static const char* gemmKernelName();
+
+    // col is {colRows, colCols} row-major for one image and one group
+    static void im2col(const HostConvShape& shape, const T* im, T* col);
+    static void col2im(const HostConvShape& shape, const T* col, T* im);
+
+    // Elements of scratch the conv functions below need. Running the
+    // images in parallel takes one column buffer per thread (and partial
+    // weight gradients), serially a single buffer is enough.
+    static size_t convWorkspaceSize(ThreadPool& pool,
+            const HostConvShape& shape, bool backwardWeight, bool parallel);
+
+    // workspace holds workspaceSize elements, the images only run in
+    // parallel when it is large enough for that. The forward epilogue
+    // indexes its bias by output channel.
+    static void convForward(ThreadPool& pool, const HostConvShape& shape,
+            const T* im, const T* w, T* out,
+            T* workspace, size_t workspaceSize,
+            const GemmEpilogue<T>* epilogue = nullptr);
+    static void convBackwardData(ThreadPool& pool,
+            const HostConvShape& shape,
+            const T* out, const T* w, T* im,
+            T* workspace, size_t workspaceSize);
+    static void convBackwardWeight(ThreadPool& pool,
+            const HostConvShape& shape,
+            const T* out, const T* im, T* dw,
+            T* workspace, size_t workspaceSize);
+
+    // Forward without scratch, one output plane per task
+    static void convForwardDirect(ThreadPool& pool,
+            const HostConvShape& shape, const T* im, const T* w, T* out,
+            const GemmEpilogue<T>* epilogue = nullptr);
+
+    // Winograd F(2x2, 3x3) for ungrouped 3x3 stride 1 convolutions. The
+    // workspace holds the transformed weights and one transformed image.
+    static bool winogradApplies(const HostConvShape& shape);
+    static size_t winogradWorkspaceSize(const HostConvShape& shape);
+    static void convForwardWinograd(ThreadPool& pool,
+            const HostConvShape& shape, const T* im, const T* w, T* out,
+            T* workspace, const GemmEpilogue<T>* epilogue = nullptr);
+
+    // Separate pass of an epilogue indexed by channel, for the outputs
+    // no GEMM stores
+    static void channelEpilogue(ThreadPool& pool,
+            int batch, int channels, int spatial,
+            const GemmEpilogue<T>& epilogue, T* y);
+    static void reduceChannelBias(ThreadPool& pool,
+            int batch, int channels, int spatial, const T* dy, T* dbias);
+};
+
+#endif
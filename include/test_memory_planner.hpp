@@ -0,0 +1,154 @@
+#ifndef TEST_MEMORY_PLANNER_HPP
+#define TEST_MEMORY_PLANNER_HPP
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include "test_memory_pool.hpp"
+
+// Static memory plan of one model step. The step is described as its
+// layer sequence and the buffers each layer reads or writes; a buffer
+// lives from its first to its last layer, or to the end of the step when
+// kept. Buffers whose lifetimes do not overlap share memory and the step
+// gets a single block of peak() bytes.
+//
+// Offsets are assigned greedy by size: the largest buffer first, each at
+// the lowest aligned offset clear of every placed buffer alive at the
+// same time.
+//
+// Aliased tensors are only ordered by the stream of the handle running
+// the step, so their contents must come from operators of that handle.
+// Parameters and inputs filled from the host belong outside the plan.
+class MemoryPlanner final{
+public:
+    static constexpr size_t ALIGNMENT = 256;
+
+private:
+    struct Buffer {
+        std::string name;
+        size_t bytes;
+        int first = -1;
+        int last = -1;
+        bool kept = false;
+        size_t offset = 0;
+    };
+
+    std::vector<Buffer> buffers_;
+    int layers_ = 0;
+    size_t peak_ = 0;
+    bool planned_ = false;
+
+    static size_t align(size_t bytes) {
+        return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    bool overlaps(const Buffer& a, const Buffer& b) const {
+        return a.first <= b.last && b.first <= a.last;
+    }
+
+public:
+    int buffer(const std::string& name, size_t bytes) {
+        Buffer buffer;
+        buffer.name = name;
+        buffer.bytes = align(bytes);
+        buffers_.push_back(buffer);
+        planned_ = false;
+        return static_cast<int>(buffers_.size()) - 1;
+    }
+
+    // Alive until the end of the step, for outputs read after it
+    void keep(int id) {
+        buffers_.at(id).kept = true;
+        planned_ = false;
+    }
+
+    // Next layer of the step and the buffers it reads or writes
+    void layer(const std::vector<int>& uses) {
+        for (int id : uses) {
+            Buffer& buffer = buffers_.at(id);
+            if (buffer.first < 0)
+                buffer.first = layers_;
+            buffer.last = layers_;
+        }
+        layers_++;
+        planned_ = false;
+    }
+
+    void plan() {
+        std::vector<int> order;
+        for (size_t i = 0; i < buffers_.size(); i++) {
+            Buffer& buffer = buffers_[i];
+            CHECK_ARGS(buffer.first >= 0,
+                    "Planned buffer is not used by any layer!");
+            if (buffer.kept)
+                buffer.last = layers_ - 1;
+            order.push_back(static_cast<int>(i));
+        }
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+            return buffers_[a].bytes > buffers_[b].bytes;
+        });
+
+        std::vector<int> placed;
+        peak_ = 0;
+        for (int id : order) {
+            Buffer& buffer = buffers_[id];
+            // Placed buffers alive at the same time, by offset
+            std::vector<int> live;
+            for (int other : placed) {
+                if (overlaps(buffer, buffers_[other]))
+                    live.push_back(other);
+            }
+            std::sort(live.begin(), live.end(), [this](int a, int b) {
+                return buffers_[a].offset < buffers_[b].offset;
+            });
+            size_t offset = 0;
+            for (int other : live) {
+                const Buffer& used = buffers_[other];
+                if (offset + buffer.bytes <= used.offset)
+                    break;
+                offset = std::max(offset, used.offset + used.bytes);
+            }
+            buffer.offset = offset;
+            peak_ = std::max(peak_, offset + buffer.bytes);
+            placed.push_back(id);
+        }
+        planned_ = true;
+    }
+
+    size_t offset(int id) const {
+        CHECK_ARGS(planned_, "Memory plan is out of date!");
+        return buffers_.at(id).offset;
+    }
+
+    size_t peak() const {
+        CHECK_ARGS(planned_, "Memory plan is out of date!");
+        return peak_;
+    }
+
+    // What separate allocations of every buffer would take
+    size_t naive() const {
+        size_t total = 0;
+        for (const Buffer& buffer : buffers_)
+            total += buffer.bytes;
+        return total;
+    }
+
+    size_t buffers() const { return buffers_.size(); }
+
+    // One block of the backend's pool for the whole plan
+    std::shared_ptr<void> allocate(Backend backend) const {
+        MemoryPool& pool = MemoryPool::current(backend);
+        return std::shared_ptr<void>(pool.allocate(peak()),
+                [&pool](void* p) { pool.release(p); });
+    }
+
+    std::string report() const {
+        std::ostringstream os;
+        os << buffers_.size() << " buffers over " << layers_
+            << " layers, planned peak " << peak() << " B vs naive "
+            << naive() << " B";
+        return os.str();
+    }
+};
+
+#endif
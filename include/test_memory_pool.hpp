@@ -0,0 +1,410 @@
+#ifndef TEST_MEMORY_POOL_HPP
+#define TEST_MEMORY_POOL_HPP
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "test_context.hpp"
+
+struct MemoryPoolStats {
+    size_t inUse = 0;
+    size_t reserved = 0;
+    size_t peakInUse = 0;
+    size_t peakReserved = 0;
+    size_t largestFree = 0;
+    size_t allocations = 0;
+    size_t backendAllocations = 0;
+    size_t backendFrees = 0;
+
+    // Bytes held from the backend but not handed out
+    size_t cached() const { return reserved - inUse; }
+
+    // Share of the cached bytes a single request could not get at once
+    double fragmentation() const {
+        return cached() == 0 ? 0.0 :
+            1.0 - static_cast<double>(largestFree) / cached();
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& os,
+        const MemoryPoolStats& stats) {
+    os << "in use " << stats.inUse << " B, cached " << stats.cached()
+        << " B, peak " << stats.peakInUse << " B, reserved "
+        << stats.reserved << " B (peak " << stats.peakReserved
+        << " B), fragmentation " << stats.fragmentation() << ", "
+        << stats.allocations << " allocations served by "
+        << stats.backendAllocations << " backend allocations";
+    return os;
+}
+
+// Caching allocator of one backend and device. Requests are rounded to
+// size classes and carved out of segments obtained from BackendMemory:
+// small ones (<= 1 MB) share 2 MB segments, mid-sized ones 20 MB segments
+// and the rest get a segment of their own rounded to 2 MB. Freed blocks
+// merge with free neighbours and are only returned to the backend when
+// the cached bytes exceed the release threshold or an allocation fails.
+// No stream gets a block while another one may still use it: blocks of a
+// handle's WorkspaceArena are only reused on its stream, and tensor
+// blocks are released after the event of the last work queued on them,
+// staying out of the free lists until it has completed.
+//
+// TEST_MEMORY_POOL=0 turns caching off, TEST_POOL_MAX_CACHED_MB sets the
+// default release threshold. The pinned() pool hands out page-locked host
+// memory for staging copies.
+class MemoryPool final{
+public:
+    static constexpr size_t MIN_BLOCK = 512;
+    static constexpr size_t SMALL_SIZE = size_t(1) << 20;
+    static constexpr size_t SMALL_SEGMENT = size_t(2) << 20;
+    static constexpr size_t LARGE_SEGMENT = size_t(20) << 20;
+    static constexpr size_t MIN_LARGE_ALLOC = size_t(10) << 20;
+    static constexpr size_t ROUND_LARGE = size_t(2) << 20;
+
+private:
+    struct Block {
+        const void* stream;
+        size_t size;
+        char* ptr;
+        bool small;
+        bool allocated;
+        Block* prev;
+        Block* next;
+    };
+
+    struct BlockLess {
+        bool operator()(const Block* a, const Block* b) const {
+            if (a->stream != b->stream)
+                return std::less<const void*>()(a->stream, b->stream);
+            if (a->size != b->size)
+                return a->size < b->size;
+            return std::less<char*>()(a->ptr, b->ptr);
+        }
+    };
+
+    using FreeList = std::set<Block*, BlockLess>;
+
+    Backend backend_;
+    int device_;
+    bool pinned_;
+    std::mutex mutex_;
+    FreeList smallBlocks_;
+    FreeList largeBlocks_;
+    std::unordered_map<void*, Block*> active_;
+    // Released blocks still used by queued work, see release()
+    std::vector<std::pair<Block*, std::shared_ptr<Event>>> deferred_;
+    MemoryPoolStats stats_;
+    size_t maxCached_;
+    bool enabled_;
+
+    MemoryPool(Backend backend, int device, bool pinned) :
+            backend_(backend), device_(device), pinned_(pinned) {
+        const char* pool = getenv("TEST_MEMORY_POOL");
+        enabled_ = pool == nullptr || std::string(pool) != "0";
+        const char* limit = getenv("TEST_POOL_MAX_CACHED_MB");
+        maxCached_ = limit == nullptr ? std::numeric_limits<size_t>::max() :
+            static_cast<size_t>(atoll(limit)) << 20;
+    }
+
+    static size_t roundUp(size_t bytes, size_t unit) {
+        return (bytes + unit - 1) / unit * unit;
+    }
+
+    static size_t segmentSize(size_t size) {
+        if (size <= SMALL_SIZE) return SMALL_SEGMENT;
+        if (size < MIN_LARGE_ALLOC) return LARGE_SEGMENT;
+        return roundUp(size, ROUND_LARGE);
+    }
+
+    FreeList& freeList(const Block* block) {
+        return block->small ? smallBlocks_ : largeBlocks_;
+    }
+
+    void* backendAllocate(size_t bytes) {
+        return pinned_ ? BackendMemory::tryAllocatePinned(bytes) :
+            BackendMemory::tryAllocate(backend_, bytes);
+    }
+
+    Block* newSegment(const void* stream, size_t size) {
+        size_t bytes = enabled_ ? segmentSize(size) : size;
+        void* ptr = backendAllocate(bytes);
+        if (ptr == nullptr) {
+            releaseCached(0);
+            ptr = backendAllocate(bytes);
+        }
+        if (ptr == nullptr) return nullptr;
+        stats_.reserved += bytes;
+        stats_.peakReserved = std::max(stats_.peakReserved, stats_.reserved);
+        stats_.backendAllocations++;
+        return new Block{stream, bytes, static_cast<char*>(ptr),
+            size <= SMALL_SIZE, false, nullptr, nullptr};
+    }
+
+    // Free whole cached segments, largest first, until at most limit
+    // bytes stay cached
+    void releaseCached(size_t limit) {
+        std::vector<Block*> segments;
+        for (FreeList* list : {&smallBlocks_, &largeBlocks_}) {
+            for (Block* block : *list) {
+                if (block->prev == nullptr && block->next == nullptr)
+                    segments.push_back(block);
+            }
+        }
+        std::sort(segments.begin(), segments.end(),
+                [](const Block* a, const Block* b) {
+                    return a->size > b->size;
+                });
+        for (Block* block : segments) {
+            if (stats_.cached() <= limit) break;
+            freeList(block).erase(block);
+            if (pinned_)
+                BackendMemory::releasePinned(block->ptr);
+            else
+                BackendMemory::release(backend_, block->ptr);
+            stats_.reserved -= block->size;
+            stats_.backendFrees++;
+            delete block;
+        }
+    }
+
+    Block* takeBlock(size_t size, const void* stream) {
+        bool small = size <= SMALL_SIZE;
+        FreeList& list = small ? smallBlocks_ : largeBlocks_;
+
+        Block key{stream, size, nullptr, small, false, nullptr, nullptr};
+        auto it = list.lower_bound(&key);
+        Block* block;
+        if (it != list.end() && (*it)->stream == stream) {
+            block = *it;
+            list.erase(it);
+        } else {
+            block = newSegment(stream, size);
+            if (block == nullptr) return nullptr;
+        }
+
+        size_t rest = block->size - size;
+        if (small ? rest >= MIN_BLOCK : rest > SMALL_SIZE) {
+            Block* tail = new Block{stream, rest, block->ptr + size, small,
+                false, block, block->next};
+            if (block->next != nullptr)
+                block->next->prev = tail;
+            block->next = tail;
+            block->size = size;
+            list.insert(tail);
+        }
+        return block;
+    }
+
+    void freeBlock(Block* block) {
+        block->allocated = false;
+        stats_.inUse -= block->size;
+
+        block = merge(block, block->prev);
+        block = merge(block, block->next);
+        freeList(block).insert(block);
+        if (!enabled_)
+            releaseCached(0);
+        else if (stats_.cached() > maxCached_)
+            releaseCached(maxCached_);
+    }
+
+    // Free the deferred blocks whose work has completed
+    void reclaimDeferred() {
+        auto done = std::partition(deferred_.begin(), deferred_.end(),
+                [](const std::pair<Block*, std::shared_ptr<Event>>& entry) {
+                    return !entry.second->query();
+                });
+        std::vector<Block*> blocks;
+        for (auto it = done; it != deferred_.end(); ++it)
+            blocks.push_back(it->first);
+        deferred_.erase(done, deferred_.end());
+        for (Block* block : blocks)
+            freeBlock(block);
+    }
+
+    // Out of memory: wait for the work still using released blocks.
+    // Host work may allocate from this pool, so the lock is let go.
+    void waitDeferred(std::unique_lock<std::mutex>& lock) {
+        std::vector<std::shared_ptr<Event>> events;
+        for (const auto& entry : deferred_)
+            events.push_back(entry.second);
+        lock.unlock();
+        for (const std::shared_ptr<Event>& event : events)
+            event->synchronize();
+        lock.lock();
+        reclaimDeferred();
+    }
+
+    // Merge block with a free neighbour, returns the merged block
+    Block* merge(Block* block, Block* other) {
+        if (other == nullptr || other->allocated) return block;
+        freeList(other).erase(other);
+        Block* first = other == block->prev ? other : block;
+        Block* second = other == block->prev ? block : other;
+        first->size += second->size;
+        first->next = second->next;
+        if (second->next != nullptr)
+            second->next->prev = first;
+        delete second;
+        return first;
+    }
+
+public:
+    MemoryPool(const MemoryPool&) = delete;
+    MemoryPool& operator=(const MemoryPool&) = delete;
+
+    // Pools live until the process exits so tensors destroyed during
+    // static destruction can still hand their memory back
+    static MemoryPool& get(Backend backend, int device) {
+        static std::mutex mutex;
+        static std::map<std::pair<Backend, int>, MemoryPool*> pools;
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryPool*& pool = pools[std::make_pair(backend, device)];
+        if (pool == nullptr)
+            pool = new MemoryPool(backend, device, false);
+        return *pool;
+    }
+
+    // Page-locked host memory shared by every device
+    static MemoryPool& pinned() {
+        static MemoryPool* pool = new MemoryPool(Backend::Host, -1, true);
+        return *pool;
+    }
+
+    // Pool of the calling thread's device
+    static MemoryPool& current(Backend backend) {
+        return get(backend, BackendMemory::currentDevice(backend));
+    }
+
+    // Blocks are only reused on the stream they were allocated on, the
+    // host and the default stream use nullptr
+    void* allocate(size_t bytes, const void* stream = nullptr) {
+        if (bytes == 0) return nullptr;
+        std::unique_lock<std::mutex> lock(mutex_);
+        reclaimDeferred();
+        size_t size = roundUp(bytes, MIN_BLOCK);
+        Block* block = takeBlock(size, stream);
+        if (block == nullptr && !deferred_.empty()) {
+            waitDeferred(lock);
+            block = takeBlock(size, stream);
+        }
+        if (block == nullptr) {
+            std::cerr << "Memory pool of " << (pinned_ ? "pinned " : "")
+                    << backendName(backend_) << " device " << device_
+                    << ": " << stats_ << std::endl;
+            CHECK_ARGS(false, "Out of memory!");
+        }
+
+        block->allocated = true;
+        active_[block->ptr] = block;
+        stats_.inUse += block->size;
+        stats_.peakInUse = std::max(stats_.peakInUse, stats_.inUse);
+        stats_.allocations++;
+        return block->ptr;
+    }
+
+    // With an event the block counts as in use until it has completed,
+    // for memory that queued work still reads or writes
+    void release(void* ptr, const std::shared_ptr<Event>& after = nullptr) {
+        if (ptr == nullptr) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = active_.find(ptr);
+        CHECK_ARGS(it != active_.end(), "Pointer not allocated by the pool!");
+        Block* block = it->second;
+        active_.erase(it);
+        if (after != nullptr && !after->query())
+            deferred_.emplace_back(block, after);
+        else
+            freeBlock(block);
+    }
+
+    // Return every fully free segment to the backend
+    void emptyCache() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        reclaimDeferred();
+        releaseCached(0);
+    }
+
+    void setMaxCached(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        maxCached_ = bytes;
+        releaseCached(maxCached_);
+    }
+
+    MemoryPoolStats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        reclaimDeferred();
+        MemoryPoolStats stats = stats_;
+        for (FreeList* list : {&smallBlocks_, &largeBlocks_}) {
+            for (Block* block : *list)
+                stats.largestFree = std::max(stats.largestFree, block->size);
+        }
+        return stats;
+    }
+
+    void resetPeakStats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.peakInUse = stats_.inUse;
+        stats_.peakReserved = stats_.reserved;
+    }
+};
+
+// Waitable handle of an asynchronous copy between a tensor and host
+// memory, see Tensor::copyFromHostAsync. The host buffer may be reused
+// after an upload, or read after a download, once wait() has returned.
+// HIP copies go through a pinned staging buffer that wait() hands back
+// to the pool, copying it out first for a download.
+class HostTransfer final{
+private:
+    std::shared_ptr<Event> event_;
+    void* staging_ = nullptr;
+    void* dst_ = nullptr;
+    size_t bytes_ = 0;
+
+public:
+    HostTransfer() {}
+    HostTransfer(const std::shared_ptr<Event>& event, void* staging,
+            void* dst, size_t bytes) :
+            event_(event), staging_(staging), dst_(dst), bytes_(bytes) {}
+
+    HostTransfer(const HostTransfer&) = delete;
+    HostTransfer& operator=(const HostTransfer&) = delete;
+
+    HostTransfer(HostTransfer&& other) noexcept :
+            event_(std::move(other.event_)), staging_(other.staging_),
+            dst_(other.dst_), bytes_(other.bytes_) {
+        other.staging_ = nullptr;
+    }
+
+    HostTransfer& operator=(HostTransfer&& other) noexcept {
+        if (this == &other) return *this;
+        wait();
+        event_ = std::move(other.event_);
+        staging_ = other.staging_;
+        dst_ = other.dst_;
+        bytes_ = other.bytes_;
+        other.staging_ = nullptr;
+        return *this;
+    }
+
+    ~HostTransfer() { wait(); }
+
+    bool ready() const { return event_ == nullptr || event_->query(); }
+
+    void wait() {
+        if (event_ != nullptr) {
+            event_->synchronize();
+            event_.reset();
+        }
+        if (staging_ == nullptr) return;
+        if (dst_ != nullptr)
+            memcpy(dst_, staging_, bytes_);
+        MemoryPool::pinned().release(staging_);
+        staging_ = nullptr;
+    }
+};
+
+#endif
@@ -2,6 +2,9 @@
 #define TEST_MPI_HPP
 
 #include "test_helper.hpp"
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
 #include <mpi.h>
 
 #define CHECK_CALLMPI(Expr) { \
@@ -14,7 +17,7 @@
 }
 
 template<typename T>
-inline MPI_Datatype toMpiDataType(T t) {
+inline MPI_Datatype toMpiDataType() {
     if(std::is_same<T, char>::value)
         return MPI_INT8_T;
     if(std::is_same<T, short>::value)
@@ -41,27 +44,867 @@ inline MPI_Datatype toMpiDataType(T t) {
     exit(1);
 }
 
+// TEST_ALLREDUCE_CHUNK_KB sets the chunk of the staged allreduce
+inline size_t defaultAllreduceChunk() {
+    const char* env = getenv("TEST_ALLREDUCE_CHUNK_KB");
+    size_t kb = env == nullptr ? 1024 : static_cast<size_t>(atoll(env));
+    CHECK_ARGS(kb > 0, "Invalid TEST_ALLREDUCE_CHUNK_KB!");
+    return kb << 10;
+}
+
+enum class AllreduceAlgo {
+    Auto,
+    Mpi,
+    Ring,
+    Halving
+};
+
+inline const char* allreduceAlgoName(AllreduceAlgo algo) {
+    switch (algo) {
+    case AllreduceAlgo::Mpi: return "mpi";
+    case AllreduceAlgo::Ring: return "ring";
+    case AllreduceAlgo::Halving: return "halving";
+    default: return "auto";
+    }
+}
+
+// TEST_ALLREDUCE_ALGO=mpi|ring|halving fixes the algorithm of
+// Communicator::allreduce, auto (the default) probes them
+inline AllreduceAlgo defaultAllreduceAlgo() {
+    const char* env = getenv("TEST_ALLREDUCE_ALGO");
+    std::string name = env == nullptr ? "auto" : env;
+    for (AllreduceAlgo algo : {AllreduceAlgo::Auto, AllreduceAlgo::Mpi,
+            AllreduceAlgo::Ring, AllreduceAlgo::Halving}) {
+        if (name == allreduceAlgoName(algo))
+            return algo;
+    }
+    CHECK_ARGS(false,
+            "TEST_ALLREDUCE_ALGO must be auto, mpi, ring or halving!");
+    return AllreduceAlgo::Auto;
+}
+
+// Elementwise sum, a loop the compiler vectorizes
+template<typename T>
+inline void reduceSum(T* dst, const T* src, int count) {
+    for (int i = 0; i < count; i++)
+        dst[i] += src[i];
+}
+
+enum class CompressionMode {
+    None,
+    Fp16,
+    Bf16,
+    TopK
+};
+
+// How one gradient is compressed for Communicator::allreduceCompressed.
+// TopK sends the ratio of the elements largest in magnitude and keeps
+// the rest in the residual, added to the gradient of the next step.
+struct Compression {
+    CompressionMode mode;
+    float ratio;
+    std::vector<float> residual;
+
+    explicit Compression(CompressionMode mode = CompressionMode::None,
+            float ratio = 0.01f) : mode(mode), ratio(ratio) {}
+};
+
+// Nonblocking sum of host memory, see Communicator::startSum. Through
+// the node hierarchy it is reduced to the node leader, allreduced between
+// the leaders and broadcast back, flat sums take the last stage only.
+struct SumRequest {
+    enum class Stage {
+        Reduce,
+        Leaders,
+        Broadcast,
+        Done
+    };
+
+    void* data = nullptr;
+    int count = 0;
+    MPI_Datatype type = MPI_DATATYPE_NULL;
+    Stage stage = Stage::Done;
+    MPI_Request request = MPI_REQUEST_NULL;
+};
+
+// IEEE half precision, rounded to nearest even
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t absBits = bits & 0x7fffffff;
+    if (absBits > 0x7f800000)
+        return sign | 0x7e00;
+    if (absBits >= 0x477ff000)
+        return sign | 0x7c00;
+    // Subnormal halves are multiples of 2^-24
+    if (absBits < 0x38800000)
+        return sign | static_cast<uint16_t>(std::nearbyint(
+                std::fabs(value) * 16777216.0f));
+    uint32_t half = ((absBits >> 23) - 112) << 10 |
+        (absBits & 0x7fffff) >> 13;
+    uint32_t rest = absBits & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | static_cast<uint16_t>(half);
+}
+
+inline float halfToFloat(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        float value = mantissa / 16777216.0f;
+        return sign ? -value : value;
+    }
+    uint32_t bits = sign | mantissa << 13 |
+        (exponent == 31 ? 0x7f800000 : (exponent + 112) << 23);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// bfloat16, the upper half of a float rounded to nearest even
+inline uint16_t floatToBf16(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000)
+        return static_cast<uint16_t>(bits >> 16 | 0x40);
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float bf16ToFloat(uint16_t half) {
+    uint32_t bits = static_cast<uint32_t>(half) << 16;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// MPI reductions of 16-bit floats, each pair is summed in fp32
+inline void sumFp16(void* in, void* inout, int* len, MPI_Datatype*) {
+    const uint16_t* a = static_cast<const uint16_t*>(in);
+    uint16_t* b = static_cast<uint16_t*>(inout);
+    for (int i = 0; i < *len; i++)
+        b[i] = floatToHalf(halfToFloat(a[i]) + halfToFloat(b[i]));
+}
+
+inline void sumBf16(void* in, void* inout, int* len, MPI_Datatype*) {
+    const uint16_t* a = static_cast<const uint16_t*>(in);
+    uint16_t* b = static_cast<uint16_t*>(inout);
+    for (int i = 0; i < *len; i++)
+        b[i] = floatToBf16(bf16ToFloat(a[i]) + bf16ToFloat(b[i]));
+}
+
 class Communicator {
 private:
+    static constexpr int ALLREDUCE_TAG = 17;
+
     int mpiRank, worldSize;
     MPI_Comm mpiWorld;
+    // Point-to-point traffic of the native collectives
+    MPI_Comm p2pWorld;
+    // Ranks sharing memory with this one, and rank 0 of every node
+    MPI_Comm nodeWorld;
+    MPI_Comm leaderWorld = MPI_COMM_NULL;
+    // Broadcasts of the nonblocking sums, apart from their reduces
+    MPI_Comm nodeBcastWorld = MPI_COMM_NULL;
+    int nodeRank, nodeSize;
+    bool hierarchical = false;
+    // Shared memory the ranks of the node reduce in, one slot each
+    MPI_Win window = MPI_WIN_NULL;
+    size_t windowBytes = 0;
+    std::vector<char*> slots;
+    size_t chunkBytes = defaultAllreduceChunk();
+    AllreduceAlgo algoSetting = defaultAllreduceAlgo();
+    // Fastest algorithm from each probed size on, see calibrateAllreduce
+    std::vector<std::pair<size_t, AllreduceAlgo>> algoTable;
+    // 16-bit floats and their sums for the compressed allreduce
+    MPI_Datatype halfType;
+    MPI_Op fp16Sum, bf16Sum;
+
+    template<typename T>
+    void exchange(MPI_Comm comm, const T* send, int sendCount, int sendPeer,
+            T* recv, int recvCount, int recvPeer) {
+        MPI_Request reqs[2];
+        CHECK_CALLMPI(MPI_Irecv(recv, recvCount, toMpiDataType<T>(),
+                recvPeer, ALLREDUCE_TAG, comm, &reqs[0]));
+        CHECK_CALLMPI(MPI_Isend(send, sendCount, toMpiDataType<T>(),
+                sendPeer, ALLREDUCE_TAG, comm, &reqs[1]));
+        CHECK_CALLMPI(MPI_Waitall(2, reqs, MPI_STATUSES_IGNORE));
+    }
+
+    // Reduce-scatter then allgather around the ring, each rank sends
+    // 2 * (p - 1) / p of the data whatever p is
+    template<typename T>
+    void allreduceRing(MPI_Comm comm, T* data, int count) {
+        int rank, size;
+        CHECK_CALLMPI(MPI_Comm_rank(comm, &rank));
+        CHECK_CALLMPI(MPI_Comm_size(comm, &size));
+        int right = (rank + 1) % size;
+        int left = (rank + size - 1) % size;
+        int base = count / size, extra = count % size;
+        auto begin = [base, extra](int k) {
+            return k * base + std::min(k, extra);
+        };
+        auto length = [base, extra](int k) { return base + (k < extra); };
+        std::vector<T> tmp(base + 1);
+        for (int step = 0; step < size - 1; step++) {
+            int out = (rank - step + size) % size;
+            int in = (rank - step - 1 + size) % size;
+            exchange(comm, data + begin(out), length(out), right,
+                    tmp.data(), length(in), left);
+            reduceSum(data + begin(in), tmp.data(), length(in));
+        }
+        for (int step = 0; step < size - 1; step++) {
+            int out = (rank - step + 1 + size) % size;
+            int in = (rank - step + size) % size;
+            exchange(comm, data + begin(out), length(out), right,
+                    data + begin(in), length(in), left);
+        }
+    }
+
+    // Recursive halving reduce-scatter then recursive doubling allgather
+    // over a power of two of ranks, log(p) steps each. The first 2 * rest
+    // ranks pair up around them.
+    template<typename T>
+    void allreduceHalving(MPI_Comm comm, T* data, int count) {
+        int rank, size;
+        CHECK_CALLMPI(MPI_Comm_rank(comm, &rank));
+        CHECK_CALLMPI(MPI_Comm_size(comm, &size));
+        int pof2 = 1;
+        while (pof2 * 2 <= size)
+            pof2 *= 2;
+        int rest = size - pof2;
+        std::vector<T> tmp(count);
+        int newRank = rank - rest;
+        if (rank < 2 * rest) {
+            if (rank % 2 == 0) {
+                exchange(comm, data, count, rank + 1, tmp.data(), 0,
+                        rank + 1);
+                newRank = -1;
+            } else {
+                exchange(comm, data, 0, rank - 1, tmp.data(), count,
+                        rank - 1);
+                reduceSum(data, tmp.data(), count);
+                newRank = rank / 2;
+            }
+        }
+
+        if (newRank >= 0) {
+            auto peer = [rest](int rank) {
+                return rank < rest ? rank * 2 + 1 : rank + rest;
+            };
+            std::vector<std::pair<int, int>> ranges;
+            int lo = 0, hi = count;
+            for (int mask = pof2 / 2; mask > 0; mask /= 2) {
+                int mid = lo + (hi - lo) / 2;
+                bool upper = (newRank & mask) != 0;
+                int keepLo = upper ? mid : lo, keepHi = upper ? hi : mid;
+                int sendLo = upper ? lo : mid, sendHi = upper ? mid : hi;
+                exchange(comm, data + sendLo, sendHi - sendLo,
+                        peer(newRank ^ mask), tmp.data(), keepHi - keepLo,
+                        peer(newRank ^ mask));
+                reduceSum(data + keepLo, tmp.data(), keepHi - keepLo);
+                ranges.emplace_back(lo, hi);
+                lo = keepLo;
+                hi = keepHi;
+            }
+            for (int mask = 1; mask < pof2; mask *= 2) {
+                std::pair<int, int> range = ranges.back();
+                ranges.pop_back();
+                int otherLo = lo == range.first ? hi : range.first;
+                int otherHi = lo == range.first ? range.second : lo;
+                exchange(comm, data + lo, hi - lo, peer(newRank ^ mask),
+                        data + otherLo, otherHi - otherLo,
+                        peer(newRank ^ mask));
+                lo = range.first;
+                hi = range.second;
+            }
+        }
+
+        if (rank < 2 * rest) {
+            if (rank % 2 == 0)
+                exchange(comm, data, 0, rank + 1, data, count, rank + 1);
+            else
+                exchange(comm, data, count, rank - 1, data, 0, rank - 1);
+        }
+    }
+
+    // One algorithm over every rank of comm, p2p carries the messages of
+    // the native ones
+    template<typename T>
+    void allreduceFlat(MPI_Comm comm, MPI_Comm p2p, T* data, int count,
+            MPI_Op opType, AllreduceAlgo algo) {
+        if (algo == AllreduceAlgo::Ring) {
+            allreduceRing(p2p, data, count);
+        } else if (algo == AllreduceAlgo::Halving) {
+            allreduceHalving(p2p, data, count);
+        } else {
+            CHECK_CALLMPI(MPI_Allreduce(MPI_IN_PLACE, data, count,
+                    toMpiDataType<T>(), opType, comm));
+        }
+    }
+
+    // Collective over the node, every rank asks for the same bytes
+    void reserveWindow(size_t bytes) {
+        if (bytes <= windowBytes) return;
+        if (window != MPI_WIN_NULL)
+            CHECK_CALLMPI(MPI_Win_free(&window));
+        windowBytes = std::max(bytes, size_t(1) << 20);
+        char* base;
+        CHECK_CALLMPI(MPI_Win_allocate_shared(windowBytes, 1,
+                MPI_INFO_NULL, nodeWorld, &base, &window));
+        slots.resize(nodeSize);
+        for (int r = 0; r < nodeSize; r++) {
+            MPI_Aint size;
+            int unit;
+            CHECK_CALLMPI(MPI_Win_shared_query(window, r, &size, &unit,
+                    &slots[r]));
+        }
+    }
+
+    void allreduce16(float* data, int count, CompressionMode mode) {
+        bool fp16 = mode == CompressionMode::Fp16;
+        std::vector<uint16_t> packed(count);
+        for (int i = 0; i < count; i++)
+            packed[i] = fp16 ? floatToHalf(data[i]) : floatToBf16(data[i]);
+        CHECK_CALLMPI(MPI_Allreduce(MPI_IN_PLACE, packed.data(), count,
+                halfType, fp16 ? fp16Sum : bf16Sum, mpiWorld));
+        for (int i = 0; i < count; i++)
+            data[i] = fp16 ? halfToFloat(packed[i]) : bf16ToFloat(packed[i]);
+    }
+
+    // Every rank sends the same number of (index, value) pairs, the sum
+    // is scattered back into the dense buffer
+    void allreduceTopK(float* data, int count, Compression& compression) {
+        int k = std::max(1, std::min(count,
+                static_cast<int>(compression.ratio * count)));
+        std::vector<float>& residual = compression.residual;
+        if (residual.size() != static_cast<size_t>(count))
+            residual.assign(count, 0.0f);
+        reduceSum(residual.data(), data, count);
+        std::vector<int> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        if (k < count) {
+            std::nth_element(order.begin(), order.begin() + k, order.end(),
+                    [&residual](int a, int b) {
+                        return std::fabs(residual[a]) >
+                            std::fabs(residual[b]);
+                    });
+        }
+        std::vector<float> values(k);
+        for (int i = 0; i < k; i++) {
+            values[i] = residual[order[i]];
+            residual[order[i]] = 0.0f;
+        }
+        std::vector<int> allIndices(k * worldSize);
+        std::vector<float> allValues(k * worldSize);
+        CHECK_CALLMPI(MPI_Allgather(order.data(), k, MPI_INT,
+                allIndices.data(), k, MPI_INT, mpiWorld));
+        CHECK_CALLMPI(MPI_Allgather(values.data(), k, MPI_FLOAT,
+                allValues.data(), k, MPI_FLOAT, mpiWorld));
+        std::fill(data, data + count, 0.0f);
+        for (int i = 0; i < k * worldSize; i++)
+            data[allIndices[i]] += allValues[i];
+    }
+
+    // The ranks of a node sum their slots in shared memory, each over
+    // its share of the elements, node leaders allreduce the result and
+    // the node reads it back. Only the leaders send anything.
+    template<typename T>
+    void allreduceHierarchical(T* data, int count, AllreduceAlgo algo) {
+        size_t bytes = count * sizeof(T);
+        reserveWindow(bytes);
+        memcpy(slots[nodeRank], data, bytes);
+        CHECK_CALLMPI(MPI_Win_fence(0, window));
+        int base = count / nodeSize, extra = count % nodeSize;
+        int begin = nodeRank * base + std::min(nodeRank, extra);
+        int length = base + (nodeRank < extra);
+        T* sum = reinterpret_cast<T*>(slots[0]);
+        for (int r = 1; r < nodeSize; r++)
+            reduceSum(sum + begin, reinterpret_cast<T*>(slots[r]) + begin,
+                    length);
+        CHECK_CALLMPI(MPI_Win_fence(0, window));
+        if (leaderWorld != MPI_COMM_NULL)
+            allreduceFlat(leaderWorld, leaderWorld, sum, count, MPI_SUM,
+                    algo);
+        CHECK_CALLMPI(MPI_Win_fence(0, window));
+        memcpy(data, sum, bytes);
+        // The slots are free for the next call once everyone has read
+        CHECK_CALLMPI(MPI_Win_fence(0, window));
+    }
+
 public:
     Communicator(int argc, char** argv){
         mpiWorld = MPI_COMM_WORLD;
         CHECK_CALLMPI(MPI_Init(&argc, &argv));
         CHECK_CALLMPI(MPI_Comm_rank(mpiWorld, &mpiRank));
         CHECK_CALLMPI(MPI_Comm_size(mpiWorld, &worldSize));
+        CHECK_CALLMPI(MPI_Comm_dup(mpiWorld, &p2pWorld));
+        // TEST_RANKS_PER_NODE groups consecutive ranks into nodes instead
+        // of asking MPI which ones share memory, to try out layouts on a
+        // single box. TEST_HIERARCHICAL=0 keeps the collectives flat.
+        const char* perNode = getenv("TEST_RANKS_PER_NODE");
+        if (perNode != nullptr) {
+            CHECK_ARGS(atoi(perNode) > 0, "Invalid TEST_RANKS_PER_NODE!");
+            CHECK_CALLMPI(MPI_Comm_split(mpiWorld, mpiRank / atoi(perNode),
+                    mpiRank, &nodeWorld));
+        } else {
+            CHECK_CALLMPI(MPI_Comm_split_type(mpiWorld,
+                    MPI_COMM_TYPE_SHARED, mpiRank, MPI_INFO_NULL,
+                    &nodeWorld));
+        }
+        CHECK_CALLMPI(MPI_Comm_rank(nodeWorld, &nodeRank));
+        CHECK_CALLMPI(MPI_Comm_size(nodeWorld, &nodeSize));
+        int maxNodeSize;
+        CHECK_CALLMPI(MPI_Allreduce(&nodeSize, &maxNodeSize, 1, MPI_INT,
+                MPI_MAX, mpiWorld));
+        const char* env = getenv("TEST_HIERARCHICAL");
+        hierarchical = maxNodeSize > 1 &&
+            (env == nullptr || std::string(env) != "0");
+        // Flat when every node has a single rank
+        if (hierarchical) {
+            CHECK_CALLMPI(MPI_Comm_split(mpiWorld,
+                    nodeRank == 0 ? 0 : MPI_UNDEFINED, mpiRank,
+                    &leaderWorld));
+            CHECK_CALLMPI(MPI_Comm_dup(nodeWorld, &nodeBcastWorld));
+        }
+        CHECK_CALLMPI(MPI_Type_contiguous(2, MPI_BYTE, &halfType));
+        CHECK_CALLMPI(MPI_Type_commit(&halfType));
+        CHECK_CALLMPI(MPI_Op_create(sumFp16, 1, &fp16Sum));
+        CHECK_CALLMPI(MPI_Op_create(sumBf16, 1, &bf16Sum));
         std::cout << "Rank at " << mpiRank << " in world ";
         std::cout << worldSize << std::endl;
     }
 
     ~Communicator(){
+        CHECK_CALLMPI(MPI_Op_free(&fp16Sum));
+        CHECK_CALLMPI(MPI_Op_free(&bf16Sum));
+        CHECK_CALLMPI(MPI_Type_free(&halfType));
+        if (window != MPI_WIN_NULL)
+            CHECK_CALLMPI(MPI_Win_free(&window));
+        if (leaderWorld != MPI_COMM_NULL)
+            CHECK_CALLMPI(MPI_Comm_free(&leaderWorld));
+        if (nodeBcastWorld != MPI_COMM_NULL)
+            CHECK_CALLMPI(MPI_Comm_free(&nodeBcastWorld));
+        CHECK_CALLMPI(MPI_Comm_free(&nodeWorld));
+        CHECK_CALLMPI(MPI_Comm_free(&p2pWorld));
         CHECK_CALLMPI(MPI_Finalize());
     }
 
     int getRank() { return mpiRank; }
     int getWorldSize() { return worldSize; }
     MPI_Comm& getWorld() { return mpiWorld; }
+    int getNodeRank() { return nodeRank; }
+    int getNodeSize() { return nodeSize; }
+    bool isHierarchical() { return hierarchical; }
+    size_t getChunkBytes() { return chunkBytes; }
+    void setChunkBytes(size_t bytes) {
+        CHECK_ARGS(bytes > 0, "Invalid allreduce chunk size!");
+        chunkBytes = bytes;
+    }
+    AllreduceAlgo getAllreduceAlgo() { return algoSetting; }
+    void setAllreduceAlgo(AllreduceAlgo algo) { algoSetting = algo; }
+
+    // Allreduce of host memory with the given algorithm, the native ones
+    // only sum. Sums go through the node hierarchy when there is one, the
+    // algorithm then runs between the node leaders.
+    template<typename T>
+    void allreduceHost(T* data, int count, MPI_Op opType,
+            AllreduceAlgo algo) {
+        if (algo == AllreduceAlgo::Auto)
+            algo = opType != MPI_SUM ? AllreduceAlgo::Mpi :
+                selectAllreduce(count * sizeof(T));
+        CHECK_ARGS(algo == AllreduceAlgo::Mpi || opType == MPI_SUM,
+                "Native allreduce algorithms only sum!");
+        if (worldSize == 1 || count == 0) return;
+        if (hierarchical && opType == MPI_SUM)
+            allreduceHierarchical(data, count, algo);
+        else
+            allreduceFlat(mpiWorld, p2pWorld, data, count, opType, algo);
+    }
+
+    // Time every algorithm on sizes from 4 KB to 2 MB. Collective, all
+    // ranks keep the choice of the slowest rank.
+    void calibrateAllreduce() {
+        algoTable.clear();
+        for (size_t bytes = 4 << 10; bytes <= 2 << 20; bytes *= 8) {
+            int count = static_cast<int>(bytes / sizeof(float));
+            std::vector<float> data(count, 1.0f);
+            AllreduceAlgo best = AllreduceAlgo::Mpi;
+            double bestTime = 0;
+            for (AllreduceAlgo algo : {AllreduceAlgo::Mpi,
+                    AllreduceAlgo::Ring, AllreduceAlgo::Halving}) {
+                allreduceHost(data.data(), count, MPI_SUM, algo);
+                double time = MPI_Wtime();
+                for (int i = 0; i < 3; i++)
+                    allreduceHost(data.data(), count, MPI_SUM, algo);
+                time = MPI_Wtime() - time;
+                CHECK_CALLMPI(MPI_Allreduce(MPI_IN_PLACE, &time, 1,
+                        MPI_DOUBLE, MPI_MAX, mpiWorld));
+                if (algo == AllreduceAlgo::Mpi || time < bestTime) {
+                    best = algo;
+                    bestTime = time;
+                }
+            }
+            algoTable.emplace_back(bytes, best);
+        }
+    }
+
+    // Algorithm for a buffer of bytes, probing on the first call
+    AllreduceAlgo selectAllreduce(size_t bytes) {
+        if (algoSetting != AllreduceAlgo::Auto)
+            return algoSetting;
+        if (algoTable.empty())
+            calibrateAllreduce();
+        AllreduceAlgo algo = algoTable.front().second;
+        for (const std::pair<size_t, AllreduceAlgo>& entry : algoTable) {
+            if (entry.first <= bytes)
+                algo = entry.second;
+        }
+        return algo;
+    }
+
+    std::string allreduceReport() {
+        std::ostringstream report;
+        for (const std::pair<size_t, AllreduceAlgo>& entry : algoTable)
+            report << (report.tellp() > 0 ? ", " : "") << entry.first
+                    << " B: " << allreduceAlgoName(entry.second);
+        return report.str();
+    }
+
+    // Allreduce of the tensor in place with the algorithm selected for
+    // its size. The native algorithms and the node hierarchy run on host
+    // memory with the sum vectorized, HIP tensors get there in chunks,
+    // see allreduceStaged.
+    template<typename T>
+    void allreduce(ExecContext& handle, Tensor<T>& tensor, MPI_Op opType) {
+        AllreduceAlgo algo = opType != MPI_SUM ? AllreduceAlgo::Mpi :
+            selectAllreduce(tensor.size() * sizeof(T));
+        if (tensor.backend() == Backend::Host) {
+            tensor.wait();
+            allreduceHost(tensor.data(), tensor.size(), opType, algo);
+            return;
+        }
+        allreduceStaged(handle, tensor, opType, algo);
+    }
+
+    // Sum of a gradient over the ranks in place, sent as 16-bit floats
+    // or as its top-k elements and decoded to fp32 on receipt. Each
+    // tensor keeps its own Compression across steps.
+    void allreduceCompressed(ExecContext& handle, Tensor<float>& tensor,
+            Compression& compression) {
+        CHECK_ARGS(compression.ratio > 0 && compression.ratio <= 1,
+                "Invalid top-k ratio!");
+        if (compression.mode == CompressionMode::None) {
+            allreduce(handle, tensor, MPI_SUM);
+            return;
+        }
+        if (worldSize == 1 || tensor.size() == 0) return;
+        float* host = tensor.data();
+        if (tensor.backend() == Backend::Host) {
+            tensor.wait();
+        } else {
+            host = static_cast<float*>(MemoryPool::pinned().allocate(
+                    tensor.size() * sizeof(float)));
+            tensor.copyToHostAsync(handle, host, true).wait();
+        }
+        if (compression.mode == CompressionMode::TopK)
+            allreduceTopK(host, tensor.size(), compression);
+        else
+            allreduce16(host, tensor.size(), compression.mode);
+        if (tensor.backend() != Backend::Host) {
+            tensor.copyFromHostAsync(handle, host, true).wait();
+            MemoryPool::pinned().release(host);
+        }
+    }
+
+    // Allreduce of the tensor in place through host memory, for MPI
+    // builds that cannot read device memory. Chunks go through two
+    // pinned buffers in turn: while chunk i is reduced, chunk i - 1 is
+    // uploaded and chunk i + 1 downloaded on the handle. Plain MPI
+    // reduces a chunk with MPI_Iallreduce, the native algorithms and the
+    // node hierarchy with allreduceHost. Returns once the tensor holds
+    // the result.
+    template<typename T>
+    void allreduceStaged(ExecContext& handle, Tensor<T>& tensor,
+            MPI_Op opType, AllreduceAlgo algo = AllreduceAlgo::Mpi) {
+        int count = tensor.size();
+        if (count == 0) return;
+        int chunk = static_cast<int>(std::min<size_t>(count,
+                std::max<size_t>(1, chunkBytes / sizeof(T))));
+        int chunks = (count + chunk - 1) / chunk;
+        Tensor<T> flat = tensor.reshape({count});
+        auto part = [&flat, chunk, count](int i) {
+            return flat.slice(0, i * chunk, std::min(count, (i + 1) * chunk));
+        };
+
+        MemoryPool& pool = MemoryPool::pinned();
+        T* buffers[2];
+        for (T*& buffer : buffers)
+            buffer = static_cast<T*>(pool.allocate(chunk * sizeof(T)));
+        bool native = algo != AllreduceAlgo::Mpi ||
+            (hierarchical && opType == MPI_SUM);
+        MPI_Request reqs[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+        HostTransfer download = part(0).copyToHostAsync(handle,
+                buffers[0], true);
+        HostTransfer upload;
+        for (int i = 0; i < chunks; i++) {
+            download.wait();
+            if (native) {
+                allreduceHost(buffers[i % 2], part(i).size(), opType, algo);
+            } else {
+                CHECK_CALLMPI(MPI_Iallreduce(MPI_IN_PLACE, buffers[i % 2],
+                        part(i).size(), toMpiDataType<T>(), opType,
+                        mpiWorld, &reqs[i % 2]));
+            }
+            // The upload is queued before the next download reuses the
+            // buffer, the handle runs them in order
+            if (i > 0) {
+                CHECK_CALLMPI(MPI_Wait(&reqs[(i - 1) % 2],
+                        MPI_STATUS_IGNORE));
+                upload = part(i - 1).copyFromHostAsync(handle,
+                        buffers[(i - 1) % 2], true);
+            }
+            if (i + 1 < chunks)
+                download = part(i + 1).copyToHostAsync(handle,
+                        buffers[(i + 1) % 2], true);
+        }
+        CHECK_CALLMPI(MPI_Wait(&reqs[(chunks - 1) % 2], MPI_STATUS_IGNORE));
+        upload = part(chunks - 1).copyFromHostAsync(handle,
+                buffers[(chunks - 1) % 2], true);
+        upload.wait();
+        for (T* buffer : buffers)
+            pool.release(buffer);
+    }
+
+    // Start a nonblocking sum of host memory over the ranks. Only the
+    // node leaders talk to other nodes when there is a hierarchy.
+    template<typename T>
+    void startSum(T* data, int count, SumRequest& sum) {
+        sum.data = data;
+        sum.count = count;
+        sum.type = toMpiDataType<T>();
+        if (!hierarchical) {
+            sum.stage = SumRequest::Stage::Broadcast;
+            CHECK_CALLMPI(MPI_Iallreduce(MPI_IN_PLACE, data, count,
+                    sum.type, MPI_SUM, mpiWorld, &sum.request));
+            return;
+        }
+        sum.stage = SumRequest::Stage::Reduce;
+        CHECK_CALLMPI(MPI_Ireduce(nodeRank == 0 ? MPI_IN_PLACE : data,
+                data, count, sum.type, MPI_SUM, 0, nodeWorld,
+                &sum.request));
+    }
+
+    // Move the sum on as far as it gets without waiting, or to the end
+    // with block, and tell whether it is done. Every stage starts in
+    // the same order on all ranks: not before it has for previous, the
+    // sum started before this one if it has not finished yet.
+    bool advanceSum(SumRequest& sum, bool block,
+            const SumRequest* previous = nullptr) {
+        while (sum.stage != SumRequest::Stage::Done) {
+            if (block) {
+                CHECK_CALLMPI(MPI_Wait(&sum.request, MPI_STATUS_IGNORE));
+            } else {
+                int done;
+                CHECK_CALLMPI(MPI_Test(&sum.request, &done,
+                        MPI_STATUS_IGNORE));
+                if (!done) return false;
+            }
+            SumRequest::Stage next = SumRequest::Stage::Done;
+            if (sum.stage == SumRequest::Stage::Reduce)
+                next = leaderWorld != MPI_COMM_NULL ?
+                    SumRequest::Stage::Leaders : SumRequest::Stage::Broadcast;
+            else if (sum.stage == SumRequest::Stage::Leaders)
+                next = SumRequest::Stage::Broadcast;
+            if (next != SumRequest::Stage::Done && previous != nullptr &&
+                    previous->stage < next) {
+                CHECK_ARGS(!block, "Sums have to finish in order!");
+                return false;
+            }
+            sum.stage = next;
+            if (next == SumRequest::Stage::Leaders) {
+                CHECK_CALLMPI(MPI_Iallreduce(MPI_IN_PLACE, sum.data,
+                        sum.count, sum.type, MPI_SUM, leaderWorld,
+                        &sum.request));
+            } else if (next == SumRequest::Stage::Broadcast) {
+                CHECK_CALLMPI(MPI_Ibcast(sum.data, sum.count, sum.type, 0,
+                        nodeBcastWorld, &sum.request));
+            }
+        }
+        return true;
+    }
+};
+
+// TEST_BUCKET_KB sets the size gradient buckets are closed at
+inline size_t defaultBucketBytes() {
+    const char* env = getenv("TEST_BUCKET_KB");
+    size_t kb = env == nullptr ? 1024 : static_cast<size_t>(atoll(env));
+    CHECK_ARGS(kb > 0, "Invalid TEST_BUCKET_KB!");
+    return kb << 10;
+}
+
+// Data-parallel gradient allreduce overlapped with the backward pass.
+// Gradients are added in the order the backward produces them, i.e.
+// reverse layer order, and packed into contiguous buckets closed once
+// they hold bucketBytes; every gradient is a view of its bucket. A bucket
+// is summed over the ranks with Communicator::startSum as soon as all of
+// its gradients are marked ready, through a pinned host copy on HIP, and
+// through the node leaders when there is a node hierarchy. Buckets
+// start in order, the same on every rank, and wait() returns once all of
+// them are reduced. Scaling by the world size is left to the optimizer.
+template<typename T>
+class GradientBuckets final{
+private:
+    struct Bucket {
+        Tensor<T> buffer;
+        T* host = nullptr;
+        HostTransfer download;
+        int grads = 0;
+        int waiting = 0;
+        bool staged = false;
+        SumRequest sum;
+    };
+
+    Communicator& comm_;
+    ExecContext& handle_;
+    size_t bucketBytes_;
+    std::vector<std::vector<int>> shapes_;
+    std::vector<int> bucketOf_;
+    std::vector<bool> ready_;
+    std::vector<Bucket> buckets_;
+    std::vector<Tensor<T>> grads_;
+    // First bucket whose allreduce has not started
+    size_t next_ = 0;
+
+    // Start the allreduce of every complete bucket in turn, only those
+    // whose gradients have been computed unless block is set, and move
+    // the started ones on
+    void progress(bool block) {
+        while (next_ < buckets_.size() && buckets_[next_].waiting == 0) {
+            Bucket& bucket = buckets_[next_];
+            if (bucket.host != nullptr && !bucket.staged) {
+                bucket.download = bucket.buffer.copyToHostAsync(handle_,
+                        bucket.host, true);
+                bucket.staged = true;
+            }
+            void* data = bucket.host;
+            if (data != nullptr) {
+                if (!block && !bucket.download.ready()) break;
+                bucket.download.wait();
+            } else {
+                if (!block && !bucket.buffer.ready()) break;
+                bucket.buffer.wait();
+                data = bucket.buffer.data();
+            }
+            comm_.startSum(static_cast<T*>(data), bucket.buffer.size(),
+                    bucket.sum);
+            next_++;
+        }
+        for (size_t i = 0; i < next_; i++)
+            comm_.advanceSum(buckets_[i].sum, false,
+                    i == 0 ? nullptr : &buckets_[i - 1].sum);
+    }
+
+public:
+    GradientBuckets(const GradientBuckets&) = delete;
+    GradientBuckets& operator=(const GradientBuckets&) = delete;
+
+    GradientBuckets(Communicator& comm, ExecContext& handle,
+            size_t bucketBytes = defaultBucketBytes()) :
+            comm_(comm), handle_(handle), bucketBytes_(bucketBytes) {}
+
+    ~GradientBuckets() {
+        for (Bucket& bucket : buckets_) {
+            comm_.advanceSum(bucket.sum, true);
+            bucket.download.wait();
+            MemoryPool::pinned().release(bucket.host);
+        }
+    }
+
+    // Id of a new gradient, valid once build() has run
+    int add(const std::vector<int>& shape) {
+        CHECK_ARGS(buckets_.empty(), "Gradients are already packed!");
+        shapes_.push_back(shape);
+        return static_cast<int>(shapes_.size()) - 1;
+    }
+
+    // Pack the gradients added so far into zeroed buckets
+    void build() {
+        CHECK_ARGS(buckets_.empty(), "Gradients are already packed!");
+        std::vector<int> offsets;
+        std::vector<int> sizes;
+        size_t bytes = bucketBytes_;
+        for (const std::vector<int>& shape : shapes_) {
+            if (bytes >= bucketBytes_) {
+                sizes.push_back(0);
+                bytes = 0;
+            }
+            int size = std::accumulate(shape.begin(), shape.end(), 1,
+                    std::multiplies<int>());
+            bucketOf_.push_back(static_cast<int>(sizes.size()) - 1);
+            offsets.push_back(sizes.back());
+            sizes.back() += size;
+            bytes += size * sizeof(T);
+        }
+        buckets_.resize(sizes.size());
+        for (size_t i = 0; i < sizes.size(); i++) {
+            buckets_[i].buffer = Tensor<T>({sizes[i]});
+            if (handle_.backend() == Backend::Hip)
+                buckets_[i].host = static_cast<T*>(MemoryPool::pinned()
+                        .allocate(sizes[i] * sizeof(T)));
+        }
+        for (size_t id = 0; id < shapes_.size(); id++) {
+            Bucket& bucket = buckets_[bucketOf_[id]];
+            int size = std::accumulate(shapes_[id].begin(),
+                    shapes_[id].end(), 1, std::multiplies<int>());
+            grads_.push_back(bucket.buffer.slice(0, offsets[id],
+                    offsets[id] + size).reshape(shapes_[id]));
+            bucket.grads++;
+        }
+        for (Bucket& bucket : buckets_)
+            bucket.waiting = bucket.grads;
+        ready_.assign(shapes_.size(), false);
+    }
+
+    Tensor<T>& grad(int id) {
+        CHECK_ARGS(id >= 0 && id < static_cast<int>(grads_.size()),
+                "Unknown gradient, missing build()?");
+        return grads_[id];
+    }
+    int buckets() const { return static_cast<int>(buckets_.size()); }
+
+    // The op writing the gradient has been queued
+    void ready(int id) {
+        CHECK_ARGS(id >= 0 && id < static_cast<int>(grads_.size()) &&
+                !ready_[id], "Gradient is unknown or already ready!");
+        ready_[id] = true;
+        buckets_[bucketOf_[id]].waiting--;
+        progress(false);
+    }
+
+    // Every gradient holds the sum over the ranks once this returns, the
+    // buckets are then ready for the next step
+    void wait() {
+        for (size_t id = 0; id < ready_.size(); id++)
+            CHECK_ARGS(ready_[id], "A gradient was never marked ready!");
+        progress(true);
+        std::vector<HostTransfer> uploads;
+        for (Bucket& bucket : buckets_) {
+            comm_.advanceSum(bucket.sum, true);
+            if (bucket.host != nullptr)
+                uploads.push_back(bucket.buffer.copyFromHostAsync(handle_,
+                        bucket.host, true));
+            bucket.waiting = bucket.grads;
+            bucket.staged = false;
+        }
+        for (HostTransfer& upload : uploads)
+            upload.wait();
+        ready_.assign(ready_.size(), false);
+        next_ = 0;
+    }
 };
 
 #endif
@@ -4,6 +4,7 @@
 #include "test_helper.hpp"
 #include "test_descriptors.hpp"
 #include "test_operators_funtions.hpp"
+#include "test_host_functions.hpp"
 
 #define HIP_GETTID() ((blockIdx.y * blockDim.y + threadIdx.y) \
         * (gridDim.x * blockDim.x) + (blockIdx.x * blockDim.x + threadIdx.x))
@@ -16,19 +17,154 @@
     ClassName(float); \
     ClassName(double);
 
+// Activation as applied by a GemmEpilogue, also on HIP by the kernels
+// that have no MIOpen descriptor
+inline HostActivation hostActivation(const ActivationDescriptor& activation) {
+    if (activation.mode == "relu")
+        return HostActivation::Relu;
+    if (activation.mode == "leakyrelu")
+        return HostActivation::LeakyRelu;
+    CHECK_ARGS(activation.mode == "clippedrelu", "Unknown activation mode!");
+    return HostActivation::ClippedRelu;
+}
+
+// Backend specific part of a prepared plan: MIOpen descriptors and the
+// chosen algorithms on HIP, the precomputed geometry on the host
+struct PlanState {
+    virtual ~PlanState() {}
+};
+
+#ifndef USE_HOST_ONLY
+struct ConvHipState;
+struct PoolingHipState;
+#endif
+
+struct ConvHostState : PlanState {
+    HostConvShape shape;
+    bool deconv = false;
+    size_t workspaceLimit;
+    ConvAlgoPolicy policy;
+    // Forward problem key and the algorithm picked for it
+    std::string key;
+    ConvAlgoEntry algo;
+    bool found = false;
+};
+
+template<typename T> class ConvolutionOp;
+template<typename T> class PoolingOp;
+
+// Convolution prepared once for fixed shapes and run many times. The
+// descriptors, the algorithm of each direction (searched on its first
+// run) and the workspace stay with the plan instead of being rebuilt by
+// every call. Runs share the state, so a plan may be dropped while its
+// work is still queued.
+template<typename T>
+class ConvPlan {
+public:
+    void Forward(const Tensor<T>& x, const Tensor<T>& w,
+            const Tensor<T>* bias, Tensor<T>& y) const;
+    // y = activation(conv(x, w) + bias) in one pass, bias may be nullptr
+    void Forward(const Tensor<T>& x, const Tensor<T>& w,
+            const Tensor<T>* bias, const ActivationDescriptor& activation,
+            Tensor<T>& y) const;
+    void BackwardWeight(const Tensor<T>& dy, const Tensor<T>& x,
+            Tensor<T>& dw, Tensor<T>* dbias) const;
+    void BackwardData(const Tensor<T>& dy, const Tensor<T>& w,
+            Tensor<T>& dx) const;
+
+    ExecContext& handle() const { return *handle_; }
+    const ConvDescriptor& spec() const { return spec_; }
+
+private:
+    friend class ConvolutionOp<T>;
+    ConvPlan(ExecContext& handle, const ConvDescriptor& convSpec,
+            const std::vector<int>& xDims, const std::vector<int>& wDims,
+            const std::vector<int>& yDims) : handle_(&handle),
+            spec_(convSpec), xDims_(xDims), wDims_(wDims), yDims_(yDims) {}
+
+    void RunForward(const Tensor<T>& x, const Tensor<T>& w,
+            const Tensor<T>* bias, const ActivationDescriptor* activation,
+            Tensor<T>& y) const;
+
+    ExecContext* handle_;
+    ConvDescriptor spec_;
+    std::vector<int> xDims_, wDims_, yDims_;
+    std::shared_ptr<PlanState> state_;
+};
+
 // Convolution Ops
 template<typename T>
 class ConvolutionOp {
 public:
-    static void ConvForward(HipHandle& handle, ConvDescriptor& convSpec,
+    // x, w and y are the shapes of the forward, dx and dy of the
+    // backward directions have the shapes of x and y
+    static ConvPlan<T> Prepare(ExecContext& handle,
+            const ConvDescriptor& convSpec,
+            const std::vector<int>& xDims, const std::vector<int>& wDims,
+            const std::vector<int>& yDims);
+
+    static void ConvForward(ExecContext& handle, ConvDescriptor& convSpec,
+            const Tensor<T>& x, const Tensor<T>& w,
+            const Tensor<T>* bias, Tensor<T>& y);
+
+    // Convolution, bias and activation fused: MIOpen's fusion plan on
+    // HIP, the GEMM epilogue on the host
+    static void ConvBiasActivationForward(ExecContext& handle,
+            ConvDescriptor& convSpec, const ActivationDescriptor& activation,
             const Tensor<T>& x, const Tensor<T>& w,
             const Tensor<T>* bias, Tensor<T>& y);
 
-    static void ConvBackwardWeight(HipHandle& handle, ConvDescriptor& convSpec,
+    static void ConvBackwardWeight(ExecContext& handle,
+            ConvDescriptor& convSpec,
+            const Tensor<T>& dy, const Tensor<T>& x,
+            Tensor<T>& dw, Tensor<T>* dbias);
+
+    static void ConvBackwardData(ExecContext& handle, ConvDescriptor& convSpec,
+            const Tensor<T>& dy, const Tensor<T>& w, Tensor<T>& dx);
+
+private:
+    friend class ConvPlan<T>;
+
+    // Plan of a one-shot call, prepared once per handle and problem
+    static ConvPlan<T> Cached(ExecContext& handle,
+            const ConvDescriptor& convSpec,
+            const std::vector<int>& xDims, const std::vector<int>& wDims,
+            const std::vector<int>& yDims);
+
+#ifndef USE_HOST_ONLY
+    static void PrepareHip(HipHandle& handle, ConvPlan<T>& plan);
+
+    static void ConvForwardHip(HipHandle& handle, ConvHipState& state,
+            const Tensor<T>& x, const Tensor<T>& w,
+            const Tensor<T>* bias, Tensor<T>& y,
+            const ActivationDescriptor* activation);
+
+    static void ConvBackwardWeightHip(HipHandle& handle,
+            ConvHipState& state,
+            const Tensor<T>& dy, const Tensor<T>& x,
+            Tensor<T>& dw, Tensor<T>* dbias);
+
+    static void ConvBackwardDataHip(HipHandle& handle,
+            ConvHipState& state,
+            const Tensor<T>& dy, const Tensor<T>& w, Tensor<T>& dx);
+#endif
+
+    static void PrepareHost(HostHandle& handle, ConvPlan<T>& plan);
+
+    // im2col + blocked GEMM on the handle's thread pool
+    static void ConvForwardHost(HostHandle& handle,
+            ConvHostState& state,
+            const Tensor<T>& x, const Tensor<T>& w,
+            const Tensor<T>* bias, Tensor<T>& y,
+            const ActivationDescriptor* activation);
+
+    static void ConvBackwardWeightHost(HostHandle& handle,
+            ConvHostState& state,
             const Tensor<T>& dy, const Tensor<T>& x,
             Tensor<T>& dw, Tensor<T>* dbias);
 
-    static void ConvBackwardData(HipHandle& handle, ConvDescriptor& convSpec,
+    static void ConvBackwardDataHost(HostHandle& handle,
+            ConvHostState& state,
             const Tensor<T>& dy, const Tensor<T>& w, Tensor<T>& dx);
 };
 
@@ -36,42 +172,211 @@ public:
 template<typename T>
 class DeconvolutionOp {
 public:
-    static void DeconvForward(HipHandle& handle, ConvDescriptor& convSpec,
+    static void DeconvForward(ExecContext& handle, ConvDescriptor& convSpec,
             const Tensor<T>& x, const Tensor<T>& w,
             const Tensor<T>* bias, Tensor<T>& y);
 
-    static void DeconvBackwardWeight(HipHandle& handle, ConvDescriptor& convSpec,
+    static void DeconvBackwardWeight(ExecContext& handle,
+            ConvDescriptor& convSpec,
             const Tensor<T>& dy, const Tensor<T>& x,
             Tensor<T>& dw, Tensor<T>* dbias);
 
-    static void DeconvBackwardData(HipHandle& handle, ConvDescriptor& convSpec,
+    static void DeconvBackwardData(ExecContext& handle,
+            ConvDescriptor& convSpec,
             const Tensor<T>& dy, const Tensor<T>& w, Tensor<T>& dx);
 };
 
+// Argmax of every max pooling output, kept by the caller from
+// PoolingForward to PoolingBackward so backward neither searches the
+// windows again nor reads a stale workspace. One context per layer,
+// reused across iterations; in async mode it must outlive the backward.
+// Indices count within the pooling window and take the narrowest type it
+// allows: uint8 up to 256 elements.
+struct PoolingContext {
+    std::unique_ptr<Tensor<uint8_t>> indices;
+    std::vector<int> yDims;
+    int indexBytes = 0;
+
+    static int indexBytesFor(const PoolingDescriptor& poolSpec) {
+        int window = poolSpec.kernelshape[0] * poolSpec.kernelshape[1];
+        return window <= (1 << 8) ? 1 : window <= (1 << 16) ? 2 : 4;
+    }
+
+    // Size the index buffer for one forward, kept if it already fits
+    void reserve(Backend backend, const PoolingDescriptor& poolSpec,
+            const std::vector<int>& dims, size_t bytes) {
+        if (indices == nullptr || indices->backend() != backend ||
+                static_cast<size_t>(indices->size()) != bytes) {
+            BackendGuard guard(backend);
+            indices.reset(new Tensor<uint8_t>(
+                    std::vector<int>{static_cast<int>(bytes)}));
+        }
+        yDims = dims;
+        indexBytes = indexBytesFor(poolSpec);
+    }
+
+    bool matches(Backend backend, const PoolingDescriptor& poolSpec,
+            const std::vector<int>& dims) const {
+        return indices != nullptr && indices->backend() == backend &&
+            yDims == dims && indexBytes == indexBytesFor(poolSpec);
+    }
+};
+
+// Pooling prepared once for fixed shapes. A max pooling plan that keeps
+// its indices owns the PoolingContext, so Backward uses what the last
+// Forward stored without the caller keeping one.
+template<typename T>
+class PoolingPlan {
+public:
+    void Forward(const Tensor<T>& x, Tensor<T>& y) const;
+    void Backward(const Tensor<T>& x, const Tensor<T>& y,
+            const Tensor<T>& dy, Tensor<T>& dx) const;
+
+    ExecContext& handle() const { return *handle_; }
+    const PoolingDescriptor& spec() const { return spec_; }
+
+private:
+    friend class PoolingOp<T>;
+    PoolingPlan(ExecContext& handle, const PoolingDescriptor& poolSpec,
+            const std::vector<int>& xDims, const std::vector<int>& yDims) :
+            handle_(&handle), spec_(poolSpec), xDims_(xDims), yDims_(yDims) {}
+
+    ExecContext* handle_;
+    PoolingDescriptor spec_;
+    std::vector<int> xDims_, yDims_;
+    std::shared_ptr<PoolingContext> context_;
+    std::shared_ptr<PlanState> state_;
+};
+
 // Pooling Ops
 template<typename T>
 class PoolingOp {
 public:
-    static void PoolingForward(HipHandle& handle, PoolingDescriptor& poolSpec,
-            const Tensor<T>& x, Tensor<T>& y);
-    static void PoolingBackward(HipHandle& handle, PoolingDescriptor& poolSpec,
+    // keepIndices only matters for max pooling, without it backward
+    // finds the maxima again from x
+    static PoolingPlan<T> Prepare(ExecContext& handle,
+            const PoolingDescriptor& poolSpec,
+            const std::vector<int>& xDims, const std::vector<int>& yDims,
+            bool keepIndices = true);
+
+    // With a context max pooling keeps its argmax indices there for
+    // PoolingBackward, without one forward skips them and backward finds
+    // them again from x
+    static void PoolingForward(ExecContext& handle, PoolingDescriptor& poolSpec,
+            const Tensor<T>& x, Tensor<T>& y,
+            PoolingContext* context = nullptr);
+    static void PoolingBackward(ExecContext& handle,
+            PoolingDescriptor& poolSpec,
+            const Tensor<T>& x, const Tensor<T>& y,
+            const Tensor<T>& dy, Tensor<T>& dx,
+            const PoolingContext* context = nullptr);
+
+private:
+    friend class PoolingPlan<T>;
+
+    static void RunForward(const PoolingPlan<T>& plan,
+            const Tensor<T>& x, Tensor<T>& y, PoolingContext* context);
+    static void RunBackward(const PoolingPlan<T>& plan,
+            const Tensor<T>& x, const Tensor<T>& y,
+            const Tensor<T>& dy, Tensor<T>& dx,
+            const PoolingContext* context);
+
+#ifndef USE_HOST_ONLY
+    static void PrepareHip(HipHandle& handle, PoolingPlan<T>& plan);
+
+    static void PoolingForwardHip(HipHandle& handle,
+            const PoolingHipState& state, const PoolingDescriptor& poolSpec,
+            const Tensor<T>& x, Tensor<T>& y, PoolingContext* context);
+    static void PoolingBackwardHip(HipHandle& handle,
+            const PoolingHipState& state, const PoolingDescriptor& poolSpec,
             const Tensor<T>& x, const Tensor<T>& y,
-            const Tensor<T>& dy, Tensor<T>& dx);
+            const Tensor<T>& dy, Tensor<T>& dx,
+            const PoolingContext* context);
+#endif
+
+    static void PoolingForwardHost(HostHandle& handle,
+            PoolingDescriptor& poolSpec,
+            const Tensor<T>& x, Tensor<T>& y, PoolingContext* context);
+    static void PoolingBackwardHost(HostHandle& handle,
+            PoolingDescriptor& poolSpec,
+            const Tensor<T>& x, const Tensor<T>& y,
+            const Tensor<T>& dy, Tensor<T>& dx,
+            const PoolingContext* context);
+};
+
+template<typename T> class FullyConnectOp;
+
+// Fully connected layer with its shapes checked once. The GEMMs need no
+// descriptors, the plan is there so an executor can treat every layer
+// the same way.
+template<typename T>
+class FullyConnectPlan {
+public:
+    void Forward(const Tensor<T>& x, const Tensor<T>& w,
+            const Tensor<T>* bias, Tensor<T>& y) const;
+    // y = activation(x * w^T + bias), bias may be nullptr. The host
+    // applies both as the GEMM stores y, HIP in a pass after it.
+    void Forward(const Tensor<T>& x, const Tensor<T>& w,
+            const Tensor<T>* bias, const ActivationDescriptor& activation,
+            Tensor<T>& y) const;
+    void BackwardWeight(const Tensor<T>& dy, const Tensor<T>& x,
+            Tensor<T>& dw, Tensor<T>* dbias) const;
+    void BackwardData(const Tensor<T>& dy, const Tensor<T>& w,
+            Tensor<T>& dx) const;
+
+    ExecContext& handle() const { return *handle_; }
+
+private:
+    friend class FullyConnectOp<T>;
+    FullyConnectPlan(ExecContext& handle, const std::vector<int>& xDims,
+            const std::vector<int>& wDims, const std::vector<int>& yDims) :
+            handle_(&handle), xDims_(xDims), wDims_(wDims), yDims_(yDims) {}
+
+    ExecContext* handle_;
+    std::vector<int> xDims_, wDims_, yDims_;
 };
 
 // FullyConnect Ops
 template <typename T>
 class FullyConnectOp {
 public:
-    static void FullyConnectForward(HipHandle& handle,
+    static FullyConnectPlan<T> Prepare(ExecContext& handle,
+            const std::vector<int>& xDims, const std::vector<int>& wDims,
+            const std::vector<int>& yDims);
+
+    static void FullyConnectForward(ExecContext& handle,
             const Tensor<T>& x, const Tensor<T>& w,
             const Tensor<T>* bias, Tensor<T>& y);
-    static void FullyConnectBackwardWeight(HipHandle& handle,
+    static void FullyConnectBackwardWeight(ExecContext& handle,
             const Tensor<T>& dy, const Tensor<T>& x,
             Tensor<T>& dw, Tensor<T>* dbias);
-    static void FullyConnectBackwardData(HipHandle& handle,
+    static void FullyConnectBackwardData(ExecContext& handle,
             const Tensor<T>& dy, const Tensor<T>& w,
             Tensor<T>& dx);
+
+private:
+    friend class FullyConnectPlan<T>;
+
+    static void RunForward(ExecContext& handle,
+            const Tensor<T>& x, const Tensor<T>& w, const Tensor<T>* bias,
+            const ActivationDescriptor* activation, Tensor<T>& y);
+};
+
+// Softmax cross-entropy loss, log-softmax, per-sample loss and the batch
+// mean in a single pass over the logits
+template <typename T>
+class CrossEntropyOp {
+public:
+    // x holds {batch, classes...} logits and labels {batch} class ids in
+    // [0, classes). loss is a single element. A label out of range stops
+    // the host backend and makes the loss and the gradients of its sample
+    // NaN on HIP, where the kernels cannot report it.
+    static void CrossEntropyForward(ExecContext& handle,
+            const Tensor<T>& x, const Tensor<int>& labels, Tensor<T>& loss);
+    // dx = (softmax(x) - onehot(labels)) * dloss / batch
+    static void CrossEntropyBackward(ExecContext& handle,
+            const Tensor<T>& x, const Tensor<int>& labels,
+            const Tensor<T>& dloss, Tensor<T>& dx);
 };
 
 #endif
@@ -0,0 +1,201 @@
+#ifndef TEST_RUN_OP_HPP
+#define TEST_RUN_OP_HPP
+
+// How operators and tensor copies are queued on an ExecContext
+
+// Every tensor an operator touches must live on the handle's backend.
+// Views work when contiguous, operators assume dense data.
+#define CHECK_BACKEND(handle, tensor) \
+    CHECK_ARGS((tensor).backend() == (handle).backend() && \
+            (tensor).contiguous(), \
+            "Tensor is not a dense tensor on the backend of the handle!")
+
+inline bool& insideOperator() {
+    static thread_local bool flag = false;
+    return flag;
+}
+
+inline void waitTensors(ExecContext&) {}
+
+template<typename T, typename... Rest>
+void waitTensors(ExecContext& handle, const Tensor<T>* tensor,
+        const Rest*... rest) {
+    if (tensor != nullptr && tensor->pending() != nullptr)
+        handle.waitEvent(tensor->pending());
+    waitTensors(handle, rest...);
+}
+
+inline void markTensors(const std::shared_ptr<Event>&, bool) {}
+
+template<typename T, typename... Rest>
+void markTensors(const std::shared_ptr<Event>& event, bool queued,
+        const Tensor<T>* tensor, const Rest*... rest) {
+    if (tensor != nullptr) {
+        tensor->markPending(event);
+        if (queued) tensor->markQueued(event);
+    }
+    markTensors(event, queued, rest...);
+}
+
+template<typename... Tensors>
+void submitOp(ExecContext& handle, const std::function<void()>& body,
+        bool queued, const Tensors*... tensors) {
+    if (insideOperator()) {
+        body();
+        return;
+    }
+    waitTensors(handle, tensors...);
+    handle.submit([body] {
+        insideOperator() = true;
+        body();
+        insideOperator() = false;
+    });
+    if (!handle.async()) {
+        handle.streamSynchronize();
+        return;
+    }
+    markTensors(handle.recordEvent(), queued, tensors...);
+}
+
+// Run the body of an operator on the handle. Work of other handles still
+// pending on the tensors (nullptr for absent ones) is waited for first.
+// Sync mode then waits for the body, async mode tags the tensors with an
+// event instead. Operators built from others run their parts inline.
+// The body may hold the tensors by reference, each of them waits for it
+// before it goes away or moves, temporary views included.
+template<typename... Tensors>
+void runOp(ExecContext& handle, const std::function<void()>& body,
+        const Tensors*... tensors) {
+    submitOp(handle, body, true, tensors...);
+}
+
+// runOp for bodies that only keep pointers into the storage, like the
+// copies below: the tensor objects are free to go before the body runs.
+template<typename... Tensors>
+void runCopyOp(ExecContext& handle, const std::function<void()>& body,
+        const Tensors*... tensors) {
+    submitOp(handle, body, false, tensors...);
+}
+
+template<typename T>
+Tensor<T> Tensor<T>::clone(ExecContext& handle) const {
+    CHECK_BACKEND(handle, *this);
+    Tensor<T> copy;
+    copy.dims_ = dims_;
+    copy.backend_ = backend_;
+    copy.size_ = size_;
+    if (size_ == 0) return copy;
+    copy.allocate();
+    const T* src = data();
+    T* dst = copy.data();
+    size_t bytes = sizeof(T) * size_;
+    runCopyOp(handle, [&handle, src, dst, bytes] {
+        if (handle.backend() == Backend::Host) {
+            memcpy(dst, src, bytes);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+        CHECK_CALL_HIP(hipMemcpyAsync(dst, src, bytes,
+                hipMemcpyDeviceToDevice, hipHandle.stream()));
+#endif
+    }, this, &copy);
+    return copy;
+}
+
+template<typename T>
+template<typename E>
+Tensor<T>::Tensor(ExecContext& handle, const TensorExpr<E>& expr) :
+        size_(0) {
+    shapeFrom(expr);
+    assign(handle, expr);
+}
+
+// Runs like an operator: after the work queued on the operands and on
+// this tensor, all of them tagged with its event in async mode
+template<typename T>
+template<typename E>
+Tensor<T>& Tensor<T>::assign(ExecContext& handle,
+        const TensorExpr<E>& expr) {
+    ExprInfo info = checkExpression(expr);
+    CHECK_BACKEND(handle, *this);
+    if (size_ == 0) return *this;
+    if (!insideOperator()) {
+        for (const std::shared_ptr<Event>& event : info.pending)
+            handle.waitEvent(event);
+    }
+    // The body keeps the expression, i.e. raw pointers, by value
+    E body = expr.self();
+    T* dst = data();
+    size_t size = size_;
+    runCopyOp(handle, [&handle, body, dst, size] {
+        void* stream = nullptr;
+#ifndef USE_HOST_ONLY
+        if (handle.backend() == Backend::Hip)
+            stream = static_cast<HipHandle&>(handle).stream();
+#endif
+        evaluateExpression(handle.backend(), dst, body, size, stream);
+    }, this);
+    if (handle.async() && !insideOperator())
+        body.mark(pending());
+    return *this;
+}
+
+// Body of the host copies of a tensor
+inline void copyHostBytes(ExecContext& handle, void* dst, const void* src,
+        size_t bytes, bool toHost) {
+    if (handle.backend() == Backend::Host) {
+        memcpy(dst, src, bytes);
+        return;
+    }
+#ifndef USE_HOST_ONLY
+    HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+    CHECK_CALL_HIP(hipMemcpyAsync(dst, src, bytes, toHost ?
+            hipMemcpyDeviceToHost : hipMemcpyHostToDevice,
+            hipHandle.stream()));
+#else
+    (void)toHost;
+#endif
+}
+
+template<typename T>
+HostTransfer Tensor<T>::copyFromHostAsync(ExecContext& handle,
+        const T* src, bool pinned) {
+    CHECK_BACKEND(handle, *this);
+    size_t bytes = sizeof(T) * size_;
+    if (bytes == 0) return HostTransfer();
+    CHECK_ARGS(src != nullptr, "Cannot copy from a nullptr!");
+    // The host buffer is free as soon as it is staged
+    void* staging = nullptr;
+    if (backend_ == Backend::Hip && !pinned) {
+        staging = MemoryPool::pinned().allocate(bytes);
+        memcpy(staging, src, bytes);
+    }
+    const void* from = staging != nullptr ? staging : src;
+    void* to = data();
+    runCopyOp(handle, [&handle, to, from, bytes] {
+        copyHostBytes(handle, to, from, bytes, false);
+    }, this);
+    return HostTransfer(pending(), staging, nullptr, 0);
+}
+
+template<typename T>
+HostTransfer Tensor<T>::copyToHostAsync(ExecContext& handle, T* dst,
+        bool pinned) const {
+    CHECK_BACKEND(handle, *this);
+    size_t bytes = sizeof(T) * size_;
+    if (bytes == 0) return HostTransfer();
+    CHECK_ARGS(dst != nullptr, "Cannot copy to a nullptr!");
+    void* staging = nullptr;
+    if (backend_ == Backend::Hip && !pinned)
+        staging = MemoryPool::pinned().allocate(bytes);
+    void* to = staging != nullptr ? staging : dst;
+    const void* from = data();
+    runCopyOp(handle, [&handle, to, from, bytes] {
+        copyHostBytes(handle, to, from, bytes, true);
+    }, this);
+    return HostTransfer(pending(), staging, staging != nullptr ? dst : nullptr,
+            bytes);
+}
+
+#endif
@@ -2,113 +2,345 @@
 #define TEST_TENSOR_HPP
 
 #include "test_tensor_functions.hpp"
+#include "test_memory_pool.hpp"
 #define FLOATERR 1e-2
 
+// Strides of a dense tensor, in elements
+inline std::vector<int> denseStrides(const std::vector<int>& dims) {
+    std::vector<int> strides(dims.size());
+    int stride = 1;
+    for (size_t i = dims.size(); i-- > 0;) {
+        strides[i] = stride;
+        stride *= dims[i];
+    }
+    return strides;
+}
+
 template <typename T>
 class Tensor final{
 private:
+    template<typename U> friend class Tensor;
+
+    // Points at the first element, views share the storage through it
     std::shared_ptr<T> devPtr_;
     std::vector<int> dims_;
-    hipStream_t hipStream;
+    std::vector<int> strides_;
+    Backend backend_;
     int size_;
+    // Last async work that touches the storage, nullptr once it has run.
+    // Shared with the views of the storage, nullptr once moved from.
+    std::shared_ptr<std::shared_ptr<Event>> pending_ =
+        std::make_shared<std::shared_ptr<Event>>();
+    // Last async work that reads this very object, not only its storage
+    mutable std::shared_ptr<Event> queued_;
+    // The storage goes back to the pool once the last work queued on it
+    // has completed, so dropping a tensor never waits for it
     struct deleteDevPtr {
+        MemoryPool* pool;
+        std::shared_ptr<std::shared_ptr<Event>> pending;
         void operator()(T* p) const {
-            hipFree(p);
+            pool->release(p, *pending);
         }
     };
 
+    void allocate() {
+        MemoryPool& pool = MemoryPool::current(backend_);
+        T* tmpPtr = static_cast<T*>(pool.allocate(sizeof(T) * size_));
+        // New storage, no longer shared with views
+        strides_ = denseStrides(dims_);
+        pending_ = std::make_shared<std::shared_ptr<Event>>();
+        devPtr_.reset(tmpPtr, deleteDevPtr{&pool, pending_});
+    }
+
+    // Storage from the pool shares the pending slot with its deleter.
+    // Other storage is waited for by the last tensor that uses it.
+    void leaveStorage() {
+        if (pending_.use_count() <= 1)
+            wait();
+        else
+            waitQueued();
+    }
+
+    // View on the storage of another tensor
+    Tensor(const std::shared_ptr<T>& ptr, const std::vector<int>& dims,
+            const std::vector<int>& strides, Backend backend,
+            const std::shared_ptr<std::shared_ptr<Event>>& pending) :
+            devPtr_(ptr), dims_(dims), strides_(strides), backend_(backend),
+            pending_(pending) {
+        size_ = std::accumulate(dims_.begin(), dims_.end(),
+            1, std::multiplies<int>());
+    }
+
+    // Takes the shape of an expression and allocates for it
+    template<typename E>
+    ExprInfo shapeFrom(const TensorExpr<E>& expr) {
+        ExprInfo info;
+        expr.self().prepare(info);
+        dims_ = *info.dims;
+        strides_ = denseStrides(dims_);
+        backend_ = info.backend;
+        size_ = info.size;
+        if (size_ > 0) allocate();
+        return info;
+    }
+
+    template<typename E>
+    ExprInfo checkExpression(const TensorExpr<E>& expr) const {
+        ExprInfo info;
+        expr.self().prepare(info);
+        CHECK_ARGS(info.size == size_ && info.backend == backend_,
+                "Expression does not match the tensor!");
+        CHECK_ARGS(contiguous(), "Cannot assign to strided views!");
+        return info;
+    }
+
 public:
+    // Deep copies are explicit, see clone()
     Tensor(const Tensor&) = delete;
-    Tensor(Tensor&&) = delete;
     Tensor& operator = (const Tensor&) = delete;
-    Tensor& operator = (Tensor&&) = delete;
 
-    Tensor() { devPtr_.reset(nullptr); }
+    // The storage and its pending work move along, other is left empty.
+    // Work still reading other itself is waited for first.
+    Tensor(Tensor&& other) noexcept : Tensor() {
+        *this = std::move(other);
+    }
+
+    // Work still reading this object is waited for, the old storage
+    // goes like in the destructor
+    Tensor& operator = (Tensor&& other) noexcept {
+        if (this == &other) return *this;
+        leaveStorage();
+        other.waitQueued();
+        devPtr_ = std::move(other.devPtr_);
+        dims_ = std::move(other.dims_);
+        strides_ = std::move(other.strides_);
+        backend_ = other.backend_;
+        size_ = other.size_;
+        pending_ = std::move(other.pending_);
+        other.size_ = 0;
+        return *this;
+    }
+
+    Tensor() : backend_(currentBackend()), size_(0) { devPtr_.reset(); }
+
+    // Queued work may still use the memory, see deleteDevPtr. Only work
+    // that reads this very object is waited for.
+    ~Tensor() { leaveStorage(); }
 
-    explicit Tensor(const std::vector<int>& dims) : dims_(dims) {
-        T* tmpPtr;
+    explicit Tensor(const std::vector<int>& dims) :
+            dims_(dims), strides_(denseStrides(dims)),
+            backend_(currentBackend()) {
         CHECK_ARGS(dims.size() > 0, 
                 "Trying to init Tensor with an empty shape!");
         size_ = std::accumulate(dims_.begin(), dims_.end(),
             1, std::multiplies<int>());
         CHECK_ARGS(size_ >= 0, "Trying to init Tensor with an invalid shape!");
         if (size_ == 0) return;
-        CHECK_CALL_HIP(hipMalloc(&tmpPtr, sizeof(T) * size_));
-        CHECK_CALL_HIP(hipMemset(tmpPtr, 0, sizeof(T) * size_));
-        devPtr_.reset(tmpPtr, deleteDevPtr());
+        allocate();
+        BackendMemory::memset(backend_, devPtr_.get(), 0, sizeof(T) * size_);
     }
 
     Tensor(T init, const std::vector<int>& dims) : Tensor(dims) {
         this->reset(init);
     }
 
-    Tensor(T* src, const std::vector<int>& dims) : dims_(dims) {
+    Tensor(T* src, const std::vector<int>& dims) :
+            dims_(dims), strides_(denseStrides(dims)),
+            backend_(currentBackend()) {
         CHECK_ARGS(src != nullptr, "Trying to init Tensor with a nullptr!");
-        T* tmpPtr;
         CHECK_ARGS(dims.size() > 0, 
                 "Trying to init Tensor with an empty shape!");
         size_ = std::accumulate(dims_.begin(), dims_.end(),
             1, std::multiplies<int>());
         CHECK_ARGS(size_ >= 0, "Trying to init Tensor with an invalid shape!");
         if (size_ == 0) return;
-        CHECK_CALL_HIP(hipMalloc(&tmpPtr, sizeof(T) * size_));
-        CHECK_CALL_HIP(hipMemcpy(tmpPtr, src,
-                size_ * sizeof(T), hipMemcpyHostToDevice));
-        devPtr_.reset(tmpPtr, deleteDevPtr());
+        allocate();
+        BackendMemory::copyFromHost(backend_, devPtr_.get(), src,
+                size_ * sizeof(T));
     }
 
     Tensor(const std::vector<T>& src, const std::vector<int>& dims) :
-            dims_(dims) {
-        T* tmpPtr;
+            dims_(dims), strides_(denseStrides(dims)),
+            backend_(currentBackend()) {
         CHECK_ARGS(dims.size() > 0, 
                 "Trying to init Tensor with an empty shape!");
         size_ = std::accumulate(dims_.begin(), dims_.end(),
             1, std::multiplies<int>());
-        CHECK_ARGS(size_ == src.size(), 
+        CHECK_ARGS(size_t(size_) == src.size(), 
                 "Trying to init Tensor with an invalid shape!");
-        CHECK_CALL_HIP(hipMalloc(&tmpPtr, sizeof(T) * size_));
-        T* hostPtr = static_cast<T*>(malloc(size_ * sizeof(T)));
-        int i = 0;
-        for (auto srcIt : src)
-            hostPtr[i++] = srcIt;
-        CHECK_CALL_HIP(hipMemcpy(tmpPtr, hostPtr,
-                size_ * sizeof(T), hipMemcpyHostToDevice));
-        free(hostPtr);
-        devPtr_.reset(tmpPtr, deleteDevPtr());
+        allocate();
+        BackendMemory::copyFromHost(backend_, devPtr_.get(), src.data(),
+                size_ * sizeof(T));
+    }
+
+    // Placed offset bytes into storage of the current backend, which it
+    // keeps alive. The memory is not cleared, see MemoryPlanner.
+    Tensor(const std::shared_ptr<void>& storage, size_t offset,
+            const std::vector<int>& dims) :
+            dims_(dims), strides_(denseStrides(dims)),
+            backend_(currentBackend()) {
+        CHECK_ARGS(dims.size() > 0,
+                "Trying to init Tensor with an empty shape!");
+        size_ = std::accumulate(dims_.begin(), dims_.end(),
+            1, std::multiplies<int>());
+        CHECK_ARGS(size_ >= 0, "Trying to init Tensor with an invalid shape!");
+        devPtr_ = std::shared_ptr<T>(storage, reinterpret_cast<T*>(
+                static_cast<char*>(storage.get()) + offset));
+    }
+
+    // Materializes an expression, see TensorExpr. Without a handle it
+    // waits for the operands and for the result, the kernel runs on the
+    // null stream.
+    template<typename E>
+    explicit Tensor(const TensorExpr<E>& expr) : size_(0) {
+        ExprInfo info = shapeFrom(expr);
+        if (size_ == 0) return;
+        info.wait();
+        evaluateExpression(backend_, devPtr_.get(), expr.self(), size_);
+        BackendMemory::synchronize(backend_);
     }
 
+    template<typename E>
+    Tensor<T>& operator= (const TensorExpr<E>& expr) {
+        ExprInfo info = checkExpression(expr);
+        info.wait();
+        wait();
+        evaluateExpression(backend_, devPtr_.get(), expr.self(), size_);
+        BackendMemory::synchronize(backend_);
+        return *this;
+    }
+
+    // The same queued on handle like an operator. Defined with runOp in
+    // test_run_op.hpp.
+    template<typename E>
+    Tensor(ExecContext& handle, const TensorExpr<E>& expr);
+    template<typename E>
+    Tensor<T>& assign(ExecContext& handle, const TensorExpr<E>& expr);
+
     int size() const { return size_; }
     T* data() const { return devPtr_.get();}
-    std::vector<int>& dims() const { return dims_; }
+    Backend backend() const { return backend_; }
+    const std::vector<int>& dims() const { return dims_; }
     int dim(int nth) const {
-        CHECK_ARGS(nth < dims_.size(), "Dim out of range!");
+        CHECK_ARGS(size_t(nth) < dims_.size(), "Dim out of range!");
         return dims_[nth];
     }
+    const std::vector<int>& strides() const { return strides_; }
+
+    // Whether the elements are dense in row-major order. Operators and
+    // host copies only take contiguous tensors.
+    bool contiguous() const {
+        int expected = 1;
+        for (size_t i = dims_.size(); i-- > 0;) {
+            if (dims_[i] != 1 && strides_[i] != expected)
+                return false;
+            expected *= dims_[i];
+        }
+        return true;
+    }
+
+    // Views share the storage and the pending work of the tensor, nothing
+    // is copied
+    Tensor<T> reshape(const std::vector<int>& dims) const {
+        CHECK_ARGS(contiguous(), "Only a contiguous tensor can be reshaped!");
+        CHECK_ARGS(dims.size() > 0 && std::accumulate(dims.begin(),
+                dims.end(), 1, std::multiplies<int>()) == size_,
+                "Reshape does not keep the number of elements!");
+        return {devPtr_, dims, denseStrides(dims), backend_, pending_};
+    }
+
+    // Elements [begin, end) of dim, contiguous when every dim before it
+    // is 1 or dim is the first
+    Tensor<T> slice(int dim, int begin, int end) const {
+        CHECK_ARGS(dim >= 0 && dim < static_cast<int>(dims_.size()) &&
+                0 <= begin && begin <= end && end <= dims_[dim],
+                "Slice out of range!");
+        std::vector<int> dims = dims_;
+        dims[dim] = end - begin;
+        std::shared_ptr<T> ptr(devPtr_, devPtr_.get() +
+                static_cast<size_t>(begin) * strides_[dim]);
+        return {ptr, dims, strides_, backend_, pending_};
+    }
+
+    // The same bytes as elements of U, the last dim is rescaled
+    template<typename U>
+    Tensor<U> view() const {
+        CHECK_ARGS(contiguous() && dims_.size() > 0,
+                "Only a contiguous tensor can be viewed as another type!");
+        size_t rowBytes = dims_.back() * sizeof(T);
+        CHECK_ARGS(rowBytes % sizeof(U) == 0,
+                "The last dim does not fit the type of the view!");
+        std::vector<int> dims = dims_;
+        dims.back() = static_cast<int>(rowBytes / sizeof(U));
+        std::shared_ptr<U> ptr(devPtr_, reinterpret_cast<U*>(devPtr_.get()));
+        return {ptr, dims, denseStrides(dims), backend_, pending_};
+    }
+
+    // Async operators tag every tensor they read or write with their
+    // event. Reading data() on the host, handing it to MPI or writing it
+    // outside an operator has to wait() first; the methods below do.
+    void markPending(const std::shared_ptr<Event>& event) const {
+        CHECK_ARGS(pending_ != nullptr, "Tensor has been moved from!");
+        *pending_ = event;
+    }
+    const std::shared_ptr<Event>& pending() const {
+        static const std::shared_ptr<Event> none;
+        return pending_ == nullptr ? none : *pending_;
+    }
+    bool ready() const { return pending() == nullptr || pending()->query(); }
+    void wait() const {
+        queued_.reset();
+        if (pending() == nullptr) return;
+        (*pending_)->synchronize();
+        pending_->reset();
+    }
+    // Operator bodies take their tensors by reference, see runOp
+    void markQueued(const std::shared_ptr<Event>& event) const {
+        queued_ = event;
+    }
+    void waitQueued() const {
+        if (queued_ == nullptr) return;
+        queued_->synchronize();
+        queued_.reset();
+    }
+
+    // Copy into new storage on the same backend, queued on handle like an
+    // operator. Defined with runOp in test_run_op.hpp.
+    Tensor<T> clone(ExecContext& handle) const;
+
+    // Copies between the whole tensor and host memory queued on handle,
+    // see HostTransfer. Host tensors and pinned host buffers, e.g. from
+    // MemoryPool::pinned(), skip the staging buffer.
+    HostTransfer copyFromHostAsync(ExecContext& handle, const T* src,
+            bool pinned = false);
+    HostTransfer copyToHostAsync(ExecContext& handle, T* dst,
+            bool pinned = false) const;
 
     void reset() {
-        T* tmpPtr;
-        CHECK_CALL_HIP(hipMalloc(&tmpPtr, sizeof(T) * size_));
-        CHECK_CALL_HIP(hipMemset(tmpPtr, 0, sizeof(T) * size_));
-        devPtr_.reset(tmpPtr, deleteDevPtr());
+        wait();
+        allocate();
+        BackendMemory::memset(backend_, devPtr_.get(), 0, sizeof(T) * size_);
     }
 
     void reset(const T init) {
         CHECK_ARGS(nullptr != devPtr_.get(), "Cannot reset for nullptr!");
+        CHECK_ARGS(contiguous(), "Cannot reset a strided view!");
+        wait();
         T* hostPtr = static_cast<T*>(malloc(sizeof(T) * size_));
         for (int i = 0; i < size_; i++)
             hostPtr[i] = init;
-        CHECK_CALL_HIP(hipMemcpy(devPtr_.get(), hostPtr,
-                sizeof(T) * size_, hipMemcpyHostToDevice));
+        BackendMemory::copyFromHost(backend_, devPtr_.get(), hostPtr,
+                sizeof(T) * size_);
         free(hostPtr);
     }
 
     void reset(const std::vector<int>& dims) {
-        T* tmpPtr;
+        wait();
+        dims_ = dims;
         size_ = std::accumulate(dims_.begin(), dims_.end(),
             1, std::multiplies<int>());
-        CHECK_CALL_HIP(hipMalloc(&tmpPtr, sizeof(T) * size_));
-        CHECK_CALL_HIP(hipMemset(tmpPtr, 0, sizeof(T) * size_));
-        devPtr_.reset(tmpPtr, deleteDevPtr());
+        allocate();
+        BackendMemory::memset(backend_, devPtr_.get(), 0, sizeof(T) * size_);
     }
 
     template<typename D>
@@ -121,18 +353,22 @@ public:
             if (info) msg << "One or two tensors have invalid devPtr!";
             return false;
         }
-        for (int i = 0; i < dims_.size(); i++) {
+        CHECK_ARGS(contiguous() && b.contiguous(),
+                "Cannot compare strided views!");
+        for (size_t i = 0; i < dims_.size(); i++) {
             if (dims_[i] != b.dim(i)) {
                 if (info) msg << "Tensors have difference size in dim" << i;
                 return false;
             }
         }
-        T* hostPtrThis = malloc(size_ * sizeof(T));
-        T* hostPtrB = malloc(size_ * sizeof(T));
-        CHECK_CALL_HIP(hipMemcpy(hostPtrThis, devPtr_.get(),
-                size_ * sizeof(T), hipMemcpyDeviceToHost));
-        CHECK_CALL_HIP(hipMemcpy(hostPtrB, b.data(),
-                size_ * sizeof(T), hipMemcpyDeviceToHost));
+        wait();
+        b.wait();
+        T* hostPtrThis = static_cast<T*>(malloc(size_ * sizeof(T)));
+        T* hostPtrB = static_cast<T*>(malloc(size_ * sizeof(T)));
+        BackendMemory::copyToHost(backend_, hostPtrThis, devPtr_.get(),
+                size_ * sizeof(T));
+        BackendMemory::copyToHost(b.backend(), hostPtrB, b.data(),
+                size_ * sizeof(T));
         bool flag = true;
         if (info) msg << "Tensor data does not match: " << std::endl;
         for (int i = 0; i < size_; i++) {
@@ -162,16 +398,18 @@ public:
             if (info) msg << "Tensor has invalid devPtr!";
             return false;
         }
-        if (size_ != b.size()) {
+        CHECK_ARGS(contiguous(), "Cannot compare strided views!");
+        if (size_t(size_) != b.size()) {
             if (info) {
                 msg << "Tensors have difference size: " << size_;
                 msg << " vs. " << b.size();
             }
             return false;
         }
+        wait();
         T* hostPtrThis = static_cast<T*>(malloc(size_ * sizeof(T)));
-        CHECK_CALL_HIP(hipMemcpy(hostPtrThis, devPtr_.get(),
-                size_ * sizeof(T), hipMemcpyDeviceToHost));
+        BackendMemory::copyToHost(backend_, hostPtrThis, devPtr_.get(),
+                size_ * sizeof(T));
         bool flag = true;
         if (info) msg << "Data does not match: " << std::endl;
         for (int i = 0; i < size_; i++) {
@@ -211,23 +449,23 @@ public:
     }
 
     template<typename D>
-    Tensor<T>& operator+= (D b){
-        OPERATOR_FUNC(Add);
+    Tensor<T>& operator+= (const D& b){
+        OPERATOR_FUNC(+);
     }
 
     template<typename D>
-    Tensor<T>& operator-= (D b){
-        OPERATOR_FUNC(Sub);
+    Tensor<T>& operator-= (const D& b){
+        OPERATOR_FUNC(-);
     }
 
     template<typename D>
-    Tensor<T>& operator*= (D b){
-        OPERATOR_FUNC(Mul);
+    Tensor<T>& operator*= (const D& b){
+        OPERATOR_FUNC(*);
     }
 
     template<typename D>
-    Tensor<T>& operator/= (D b){
-        OPERATOR_FUNC(Div);
+    Tensor<T>& operator/= (const D& b){
+        OPERATOR_FUNC(/);
     }
 
     template<typename D>
@@ -237,9 +475,11 @@ public:
     friend bool operator!= (std::vector<D>& a, Tensor<T>& b) { return b != a; }
 
     friend std::ostream& operator << (std::ostream& os, Tensor<T>& b) {
+        CHECK_ARGS(b.contiguous(), "Cannot print strided views!");
+        b.wait();
         T* hostPtrB = static_cast<T*>(malloc(b.size() * sizeof(T)));
-        CHECK_CALL_HIP(hipMemcpy(hostPtrB, b.data(),
-                b.size() * sizeof(T), hipMemcpyDeviceToHost));
+        BackendMemory::copyToHost(b.backend(), hostPtrB, b.data(),
+                b.size() * sizeof(T));
         for (int i = 0; i < b.size(); i++)
             os << "Tensor-" << i << ": " << hostPtrB[i] << std::endl;
         free(hostPtrB);
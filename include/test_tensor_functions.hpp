@@ -1,59 +1,272 @@
 #ifndef TEST_TENSOR_FUNCTIONS_HPP
 
 #ifndef AFTER_DECLARE
-#define OPERATOR_FUNC(Func) \
+#include <cmath>
+#include <type_traits>
+
+// Compound assignment goes through the lazy expressions below. The
+// scalar is converted to T first, as "src op= static_cast<T>(b)" did.
+#define OPERATOR_FUNC(op) \
     { \
         CHECK_ARGS(devPtr_.get() != nullptr, \
                 "Error: Invalid operation due to nullptr!"); \
-        size_t blockSize = 256; \
-        size_t gridSize = size_ > blockSize ? (size_ + 255) / 256 : 1; \
-        Func<T, D> opClass; \
-        hipStream_t stream; \
-        hipStreamCreate(&stream); \
-        hipLaunchKernelGGL((scalarOpKernel<T, D, Func<T, D>>), \
-                dim3(gridSize), dim3(blockSize), 0, stream, \
-                opClass, devPtr_.get(), b, size_); \
-        hipStreamDestroy(stream); \
-        return *this; \
+        return *this = *this op exprScalarCast<T>(b); \
     }
 
-template<typename T, typename D>
-struct Add{
-    T& operator()(T& src, const D& tg){
-        src += static_cast<T>(tg);
-        return src;
+#ifdef USE_HOST_ONLY
+#define EXPR_FUNC inline
+#else
+#define EXPR_FUNC __host__ __device__ inline
+#endif
+
+template<typename T> class Tensor;
+
+// Elementwise arithmetic on tensors is lazy: "a * 2 + exp(b)" only builds
+// an expression, which runs as one kernel or one host loop when it is
+// assigned to a tensor or used to construct one. The expression keeps
+// pointers to its tensors and must not outlive them. Tensor::assign runs
+// it on a handle like an operator, plain assignment blocks.
+template<typename E>
+struct TensorExpr {
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+// Shape, placement and readiness of the tensors of an expression
+struct ExprInfo {
+    const std::vector<int>* dims = nullptr;
+    int size = -1;
+    Backend backend = Backend::Host;
+    // Work still queued on the operands
+    std::vector<std::shared_ptr<Event>> pending;
+
+    template<typename T>
+    void add(const Tensor<T>& t) {
+        CHECK_ARGS(t.data() != nullptr || t.size() == 0,
+                "Error: Invalid operation due to nullptr!");
+        CHECK_ARGS(t.contiguous(),
+                "Strided views cannot be used in expressions!");
+        if (dims == nullptr) {
+            dims = &t.dims();
+            size = t.size();
+            backend = t.backend();
+        } else {
+            CHECK_ARGS(size == t.size(),
+                    "Tensors in an expression have different sizes!");
+            CHECK_ARGS(backend == t.backend(),
+                    "Tensors in an expression are on different backends!");
+        }
+        if (t.pending() != nullptr)
+            pending.push_back(t.pending());
+    }
+
+    void wait() const {
+        for (const std::shared_ptr<Event>& event : pending)
+            event->synchronize();
     }
 };
 
-template<typename T, typename D>
-struct Sub{
-    T& operator()(T& src, const D& tg){
-        src -= static_cast<T>(tg);
-        return src;
+template<typename T>
+struct TensorLeaf : TensorExpr<TensorLeaf<T>> {
+    typedef T value_type;
+    const Tensor<T>* tensor;
+    const T* ptr;
+
+    explicit TensorLeaf(const Tensor<T>& t) : tensor(&t), ptr(t.data()) {}
+    EXPR_FUNC T operator[](size_t i) const { return ptr[i]; }
+    void prepare(ExprInfo& info) const { info.add(*tensor); }
+    void mark(const std::shared_ptr<Event>& event) const {
+        tensor->markPending(event);
     }
 };
 
-template<typename T, typename D>
-struct Mul{
-    T& operator()(T& src, const D& tg){
-        src *= static_cast<T>(tg);
-        return src;
+template<typename T>
+struct ScalarLeaf : TensorExpr<ScalarLeaf<T>> {
+    typedef T value_type;
+    T value;
+
+    explicit ScalarLeaf(T v) : value(v) {}
+    EXPR_FUNC T operator[](size_t) const { return value; }
+    void prepare(ExprInfo&) const {}
+    void mark(const std::shared_ptr<Event>&) const {}
+};
+
+template<typename Op, typename L, typename R>
+struct BinaryExpr : TensorExpr<BinaryExpr<Op, L, R>> {
+    typedef typename std::common_type<typename L::value_type,
+            typename R::value_type>::type value_type;
+    L lhs;
+    R rhs;
+
+    BinaryExpr(const L& l, const R& r) : lhs(l), rhs(r) {}
+    EXPR_FUNC value_type operator[](size_t i) const {
+        return Op::apply(static_cast<value_type>(lhs[i]),
+                static_cast<value_type>(rhs[i]));
+    }
+    void prepare(ExprInfo& info) const {
+        lhs.prepare(info);
+        rhs.prepare(info);
+    }
+    void mark(const std::shared_ptr<Event>& event) const {
+        lhs.mark(event);
+        rhs.mark(event);
     }
 };
 
-template<typename T, typename D>
-struct Div{
-    T& operator()(T& src, const D& tg){
-        src /= static_cast<T>(tg);
-        return src;
+template<typename Op, typename E>
+struct UnaryExpr : TensorExpr<UnaryExpr<Op, E>> {
+    typedef typename E::value_type value_type;
+    E arg;
+
+    explicit UnaryExpr(const E& e) : arg(e) {}
+    EXPR_FUNC value_type operator[](size_t i) const {
+        return Op::apply(arg[i]);
     }
+    void prepare(ExprInfo& info) const { arg.prepare(info); }
+    void mark(const std::shared_ptr<Event>& event) const { arg.mark(event); }
+};
+
+#define EXPR_OP(Name, expr) \
+    struct Name { \
+        template<typename T> \
+        EXPR_FUNC static T apply(T a, T b) { return expr; } \
+    };
+
+EXPR_OP(ExprAdd, a + b)
+EXPR_OP(ExprSub, a - b)
+EXPR_OP(ExprMul, a * b)
+EXPR_OP(ExprDiv, a / b)
+EXPR_OP(ExprMax, a > b ? a : b)
+EXPR_OP(ExprMin, a < b ? a : b)
+#undef EXPR_OP
+
+#define EXPR_UNARY_OP(Name, expr) \
+    struct Name { \
+        template<typename T> \
+        EXPR_FUNC static T apply(T a) { return expr; } \
+    };
+
+EXPR_UNARY_OP(ExprNeg, -a)
+EXPR_UNARY_OP(ExprExp, std::exp(a))
+EXPR_UNARY_OP(ExprLog, std::log(a))
+EXPR_UNARY_OP(ExprSqrt, std::sqrt(a))
+EXPR_UNARY_OP(ExprAbs, a < T(0) ? -a : a)
+EXPR_UNARY_OP(ExprTanh, std::tanh(a))
+#undef EXPR_UNARY_OP
+
+// What a tensor, expression or scalar turns into inside an expression.
+// lazy is false for scalars, an operator needs at least one lazy operand.
+template<typename X, typename = void>
+struct ExprOperand {
+    static const bool valid = false;
+    static const bool lazy = false;
+};
+
+template<typename T>
+struct ExprOperand<Tensor<T>, void> {
+    static const bool valid = true;
+    static const bool lazy = true;
+    typedef TensorLeaf<T> type;
+    static type wrap(const Tensor<T>& t) { return type(t); }
 };
 
-template<typename T, typename D, typename Func>
-__global__ void scalarOpKernel(Func op, T* src, D tg, size_t borderSize){
+template<typename E>
+struct ExprOperand<E, typename std::enable_if<
+        std::is_base_of<TensorExpr<E>, E>::value>::type> {
+    static const bool valid = true;
+    static const bool lazy = true;
+    typedef E type;
+    static const E& wrap(const E& e) { return e; }
+};
+
+template<typename S>
+struct ExprOperand<S, typename std::enable_if<
+        std::is_arithmetic<S>::value>::type> {
+    static const bool valid = true;
+    static const bool lazy = false;
+    typedef ScalarLeaf<S> type;
+    static type wrap(S s) { return type(s); }
+};
+
+#define EXPR_BINARY(name, Op) \
+    template<typename L, typename R> \
+    typename std::enable_if<ExprOperand<L>::valid && \
+            ExprOperand<R>::valid && \
+            (ExprOperand<L>::lazy || ExprOperand<R>::lazy), \
+            BinaryExpr<Op, typename ExprOperand<L>::type, \
+            typename ExprOperand<R>::type>>::type \
+    name(const L& l, const R& r) { \
+        return BinaryExpr<Op, typename ExprOperand<L>::type, \
+            typename ExprOperand<R>::type>( \
+            ExprOperand<L>::wrap(l), ExprOperand<R>::wrap(r)); \
+    }
+
+EXPR_BINARY(operator+, ExprAdd)
+EXPR_BINARY(operator-, ExprSub)
+EXPR_BINARY(operator*, ExprMul)
+EXPR_BINARY(operator/, ExprDiv)
+EXPR_BINARY(maximum, ExprMax)
+EXPR_BINARY(minimum, ExprMin)
+#undef EXPR_BINARY
+
+#define EXPR_UNARY(name, Op) \
+    template<typename E> \
+    typename std::enable_if<ExprOperand<E>::lazy, \
+            UnaryExpr<Op, typename ExprOperand<E>::type>>::type \
+    name(const E& e) { \
+        return UnaryExpr<Op, typename ExprOperand<E>::type>( \
+            ExprOperand<E>::wrap(e)); \
+    }
+
+EXPR_UNARY(operator-, ExprNeg)
+EXPR_UNARY(exp, ExprExp)
+EXPR_UNARY(log, ExprLog)
+EXPR_UNARY(sqrt, ExprSqrt)
+EXPR_UNARY(abs, ExprAbs)
+EXPR_UNARY(tanh, ExprTanh)
+#undef EXPR_UNARY
+
+template<typename T, typename D>
+typename std::enable_if<std::is_arithmetic<D>::value, T>::type
+exprScalarCast(const D& b) {
+    return static_cast<T>(b);
+}
+
+template<typename T, typename D>
+typename std::enable_if<!std::is_arithmetic<D>::value, const D&>::type
+exprScalarCast(const D& b) {
+    return b;
+}
+
+#ifndef USE_HOST_ONLY
+template<typename T, typename E>
+__global__ void expressionKernel(T* dst, E expr, size_t size){
     size_t globalId = blockIdx.x * blockDim.x + threadIdx.x;
-    if(globalId < borderSize)
-        op(src[globalId], tg);
+    if(globalId < size)
+        dst[globalId] = static_cast<T>(expr[globalId]);
+}
+#endif
+
+// Every element is read and written at the same index, so dst may be one
+// of the tensors of the expression. Kernels run on the given stream, see
+// Tensor::assign for the one of a handle.
+template<typename T, typename E>
+void evaluateExpression(Backend backend, T* dst, const E& expr, size_t size,
+        void* stream = nullptr){
+    if (size == 0) return;
+    if (backend == Backend::Host) {
+        for (size_t i = 0; i < size; i++)
+            dst[i] = static_cast<T>(expr[i]);
+        return;
+    }
+#ifndef USE_HOST_ONLY
+    size_t blockSize = 256;
+    size_t gridSize = (size + blockSize - 1) / blockSize;
+    hipLaunchKernelGGL((expressionKernel<T, E>),
+            dim3(gridSize), dim3(blockSize), 0,
+            static_cast<hipStream_t>(stream), dst, expr, size);
+#else
+    (void)stream;
+#endif
 }
 
 #endif
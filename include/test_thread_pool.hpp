@@ -0,0 +1,194 @@
+#ifndef TEST_THREAD_POOL_HPP
+#define TEST_THREAD_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <deque>
+
+// Fixed-size pool of worker threads running fork-join jobs. The calling
+// thread always takes part as worker 0, so a pool of size 1 has no threads.
+class ThreadPool final{
+private:
+    std::vector<std::thread> workers_;
+    std::mutex runMutex_;
+    std::mutex mutex_;
+    std::condition_variable wakeCond_;
+    std::condition_variable doneCond_;
+    std::function<void(int)> job_;
+    size_t generation_ = 0;
+    int pending_ = 0;
+    bool stop_ = false;
+
+    static bool& insideJob() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    void workerLoop(int id) {
+        size_t seen = 0;
+        insideJob() = true;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wakeCond_.wait(lock,
+                        [&] { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+            }
+            job_(id);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (--pending_ == 0) doneCond_.notify_one();
+            }
+        }
+    }
+
+public:
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool& operator=(ThreadPool&&) = delete;
+
+    explicit ThreadPool(int numThreads) {
+        numThreads = std::max(1, numThreads);
+        for (int i = 1; i < numThreads; i++)
+            workers_.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wakeCond_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+    }
+
+    static int defaultSize() {
+        int n = static_cast<int>(std::thread::hardware_concurrency());
+        return n > 0 ? n : 1;
+    }
+
+    int size() const { return static_cast<int>(workers_.size()) + 1; }
+
+    // Run job(tid) once on every thread of the pool and wait for all of
+    // them. Nested calls from inside a job run inline on the caller.
+    void run(const std::function<void(int)>& job) {
+        if (workers_.empty() || insideJob()) {
+            job(0);
+            return;
+        }
+        std::lock_guard<std::mutex> runLock(runMutex_);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = job;
+            pending_ = static_cast<int>(workers_.size());
+            generation_++;
+        }
+        wakeCond_.notify_all();
+        insideJob() = true;
+        job(0);
+        insideJob() = false;
+        std::unique_lock<std::mutex> lock(mutex_);
+        doneCond_.wait(lock, [&] { return pending_ == 0; });
+        job_ = nullptr;
+    }
+
+    // Split [0, n) into contiguous ranges, one per thread.
+    void parallelFor(size_t n,
+            const std::function<void(size_t, size_t)>& body) {
+        if (n == 0) return;
+        size_t nthreads = std::min(n, static_cast<size_t>(size()));
+        if (nthreads == 1 || insideJob()) {
+            body(0, n);
+            return;
+        }
+        run([&](int tid) {
+            size_t id = static_cast<size_t>(tid);
+            if (id >= nthreads) return;
+            size_t chunk = n / nthreads, rest = n % nthreads;
+            size_t begin = id * chunk + std::min(id, rest);
+            size_t end = begin + chunk + (id < rest ? 1 : 0);
+            body(begin, end);
+        });
+    }
+};
+
+// One worker thread running tasks in the order they were pushed, the
+// host counterpart of a stream
+class TaskQueue final{
+private:
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable wakeCond_;
+    std::condition_variable idleCond_;
+    std::deque<std::function<void()>> tasks_;
+    bool busy_ = false;
+    bool stop_ = false;
+
+    void workerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wakeCond_.wait(lock,
+                        [&] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+                busy_ = true;
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                busy_ = false;
+                if (tasks_.empty()) idleCond_.notify_all();
+            }
+        }
+    }
+
+public:
+    TaskQueue(const TaskQueue&) = delete;
+    TaskQueue& operator=(const TaskQueue&) = delete;
+
+    // The worker starts with the first task
+    TaskQueue() {}
+
+    ~TaskQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wakeCond_.notify_all();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+    void push(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!worker_.joinable())
+                worker_ = std::thread(&TaskQueue::workerLoop, this);
+            tasks_.push_back(std::move(task));
+        }
+        wakeCond_.notify_one();
+    }
+
+    // Wait until every task pushed so far has run
+    void drain() {
+        if (onWorker()) return;
+        std::unique_lock<std::mutex> lock(mutex_);
+        idleCond_.wait(lock, [&] { return tasks_.empty() && !busy_; });
+    }
+
+    bool onWorker() const {
+        return std::this_thread::get_id() == worker_.get_id();
+    }
+};
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef TEST_TUNING_DB_HPP
+#define TEST_TUNING_DB_HPP
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+// Algorithm picked for one problem and the workspace it runs with, time
+// is what the search measured in ms (0 if unknown)
+struct ConvAlgoEntry {
+    int algo = 0;
+    float time = 0;
+    size_t workSpaceSize = 0;
+};
+
+// On-disk layout: one header followed by fixed-size records, so a file
+// can be mmapped and scanned in place. New results are appended, a later
+// record for the same (arch, key) replaces an earlier one until compact()
+// drops it.
+struct TuningDbHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint8_t reserved[48];
+};
+
+struct TuningDbRecord {
+    char arch[16];
+    char key[224];
+    int32_t algo;
+    float time;
+    uint64_t workSpaceSize;
+};
+
+static_assert(sizeof(TuningDbHeader) == 64, "Unexpected tuning db header");
+static_assert(sizeof(TuningDbRecord) == 256, "Unexpected tuning db record");
+
+class TuningDb {
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    // TEST_TUNING_DB=<file> overrides $HOME/.test_tuning.db, an empty
+    // value turns the database off
+    static std::string defaultPath() {
+        const char* env = getenv("TEST_TUNING_DB");
+        if (env != nullptr)
+            return env;
+        const char* home = getenv("HOME");
+        return home == nullptr ? "" : std::string(home) + "/.test_tuning.db";
+    }
+
+    static bool fits(const std::string& arch, const std::string& key) {
+        return arch.size() < sizeof(TuningDbRecord::arch) &&
+            key.size() < sizeof(TuningDbRecord::key);
+    }
+
+    // Calls visit(arch, key, entry) for every record in file order.
+    // Missing files are empty, files of another version are skipped.
+    template<typename Visitor>
+    static bool load(const std::string& path, Visitor visit) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        // Shared lock so compact() does not rewrite it under the scan
+        struct stat st;
+        bool ok = flock(fd, LOCK_SH) == 0 && fstat(fd, &st) == 0 &&
+            size_t(st.st_size) >= sizeof(TuningDbHeader);
+        void* map = ok ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED,
+                fd, 0) : MAP_FAILED;
+        if (map == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+
+        const TuningDbHeader* header =
+            static_cast<const TuningDbHeader*>(map);
+        ok = validHeader(*header);
+        if (!ok) {
+            std::cerr << "Warning: ignoring tuning db " << path
+                    << " with unknown format" << std::endl;
+        }
+        size_t count = ok ? (st.st_size - sizeof(TuningDbHeader)) /
+            sizeof(TuningDbRecord) : 0;
+        const TuningDbRecord* records =
+            reinterpret_cast<const TuningDbRecord*>(header + 1);
+        for (size_t i = 0; i < count; i++) {
+            const TuningDbRecord& record = records[i];
+            ConvAlgoEntry entry;
+            entry.algo = record.algo;
+            entry.time = record.time;
+            entry.workSpaceSize = record.workSpaceSize;
+            visit(std::string(record.arch, strnlen(record.arch,
+                    sizeof(record.arch))),
+                    std::string(record.key, strnlen(record.key,
+                    sizeof(record.key))), entry);
+        }
+        munmap(map, st.st_size);
+        close(fd);
+        return ok;
+    }
+
+    // Append one record, safe against other processes appending to the
+    // same file. Nothing is written when the latest record for (arch, key)
+    // already picks the same algorithm and workspace.
+    static bool append(const std::string& path, const std::string& arch,
+            const std::string& key, const ConvAlgoEntry& entry) {
+        if (path.empty() || !fits(arch, key)) return false;
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return false;
+        bool ok = flock(fd, LOCK_EX) == 0;
+        struct stat st;
+        ok = ok && fstat(fd, &st) == 0;
+        if (ok && st.st_size == 0) {
+            TuningDbHeader header = makeHeader();
+            ok = write(fd, &header, sizeof(header)) == sizeof(header);
+        }
+        TuningDbRecord record = makeRecord(arch, key, entry);
+        std::vector<TuningDbRecord> records;
+        bool known = false;
+        if (ok && readRecords(fd, st.st_size, records)) {
+            for (const TuningDbRecord& old : records) {
+                if (sameProblem(old, record))
+                    known = old.algo == record.algo &&
+                        old.workSpaceSize == record.workSpaceSize;
+            }
+        }
+        if (!known)
+            ok = ok && write(fd, &record, sizeof(record)) == sizeof(record);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return ok;
+    }
+
+    // Rewrite the file in place with only the latest record of every
+    // (arch, key), in the order they were appended. Files without
+    // duplicates are left alone.
+    static bool compact(const std::string& path) {
+        if (path.empty()) return false;
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0) return false;
+        struct stat st;
+        std::vector<TuningDbRecord> records;
+        bool ok = flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0 &&
+            readRecords(fd, st.st_size, records);
+        std::map<std::pair<std::string, std::string>, size_t> latest;
+        for (size_t i = 0; ok && i < records.size(); i++)
+            latest[problem(records[i])] = i;
+        if (ok && latest.size() < records.size()) {
+            std::vector<TuningDbRecord> kept;
+            for (size_t i = 0; i < records.size(); i++) {
+                if (latest[problem(records[i])] == i)
+                    kept.push_back(records[i]);
+            }
+            size_t bytes = kept.size() * sizeof(TuningDbRecord);
+            ok = pwrite(fd, kept.data(), bytes, sizeof(TuningDbHeader)) ==
+                    ssize_t(bytes) &&
+                ftruncate(fd, sizeof(TuningDbHeader) + bytes) == 0;
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+        return ok;
+    }
+
+    // Combine several databases into one compacted file. For a problem
+    // found in more than one input the fastest measured result wins.
+    static bool merge(const std::vector<std::string>& inputs,
+            const std::string& output) {
+        std::map<std::pair<std::string, std::string>, ConvAlgoEntry> best;
+        for (const std::string& input : inputs) {
+            bool ok = load(input, [&](const std::string& arch,
+                    const std::string& key, const ConvAlgoEntry& entry) {
+                auto it = best.find(std::make_pair(arch, key));
+                if (it == best.end() || it->second.time <= 0 ||
+                        (entry.time > 0 && entry.time <= it->second.time))
+                    best[std::make_pair(arch, key)] = entry;
+            });
+            if (!ok) {
+                std::cerr << "Error: cannot read tuning db " << input
+                        << std::endl;
+                return false;
+            }
+        }
+
+        std::string tmp = output + ".tmp";
+        FILE* file = fopen(tmp.c_str(), "wb");
+        if (file == nullptr) return false;
+        TuningDbHeader header = makeHeader();
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        for (const auto& item : best) {
+            TuningDbRecord record = makeRecord(item.first.first,
+                    item.first.second, item.second);
+            ok = ok && fwrite(&record, sizeof(record), 1, file) == 1;
+        }
+        ok = fclose(file) == 0 && ok;
+        return ok && rename(tmp.c_str(), output.c_str()) == 0;
+    }
+
+private:
+    static std::pair<std::string, std::string> problem(
+            const TuningDbRecord& record) {
+        return std::make_pair(
+                std::string(record.arch, strnlen(record.arch,
+                sizeof(record.arch))),
+                std::string(record.key, strnlen(record.key,
+                sizeof(record.key))));
+    }
+
+    static bool sameProblem(const TuningDbRecord& a,
+            const TuningDbRecord& b) {
+        return memcmp(a.arch, b.arch, sizeof(a.arch)) == 0 &&
+            memcmp(a.key, b.key, sizeof(a.key)) == 0;
+    }
+
+    // Records of a locked file of the given size, false unless it has a
+    // valid header
+    static bool readRecords(int fd, off_t size,
+            std::vector<TuningDbRecord>& records) {
+        TuningDbHeader header;
+        if (size_t(size) < sizeof(header) ||
+                pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+                !validHeader(header))
+            return false;
+        records.resize((size - sizeof(header)) / sizeof(TuningDbRecord));
+        size_t bytes = records.size() * sizeof(TuningDbRecord);
+        return pread(fd, records.data(), bytes, sizeof(header)) ==
+            ssize_t(bytes);
+    }
+
+    static bool validHeader(const TuningDbHeader& header) {
+        TuningDbHeader expected = makeHeader();
+        return memcmp(header.magic, expected.magic,
+                sizeof(header.magic)) == 0 &&
+            header.version == VERSION &&
+            header.recordSize == sizeof(TuningDbRecord);
+    }
+
+    static TuningDbHeader makeHeader() {
+        TuningDbHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "TSTTUNDB", sizeof(header.magic));
+        header.version = VERSION;
+        header.recordSize = sizeof(TuningDbRecord);
+        return header;
+    }
+
+    static TuningDbRecord makeRecord(const std::string& arch,
+            const std::string& key, const ConvAlgoEntry& entry) {
+        TuningDbRecord record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.arch, arch.data(), arch.size());
+        memcpy(record.key, key.data(), key.size());
+        record.algo = entry.algo;
+        record.time = entry.time;
+        record.workSpaceSize = entry.workSpaceSize;
+        return record;
+    }
+};
+
+#endif
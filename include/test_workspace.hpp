@@ -0,0 +1,100 @@
+#ifndef TEST_WORKSPACE_HPP
+#define TEST_WORKSPACE_HPP
+
+#include <limits>
+#include "test_memory_pool.hpp"
+#include "test_algo_cache.hpp"
+
+// Scratch memory of one handle. Operators borrow it for the duration of
+// a call instead of allocating their own workspace: it grows to the
+// largest request seen and keeps that size, so after the first iteration
+// of a training loop no operator allocates scratch any more.
+//
+// An optional hard cap bounds the arena and algorithm selection only
+// picks algorithms whose workspace fits under it, choosing among those
+// by the arena's policy. TEST_WORKSPACE_LIMIT_MB and TEST_CONV_ALGO_POLICY
+// set both for new handles.
+class WorkspaceArena final{
+public:
+    static constexpr size_t UNLIMITED = std::numeric_limits<size_t>::max();
+
+private:
+    Backend backend_;
+    int device_;
+    const void* stream_;
+    void* ptr_ = nullptr;
+    size_t capacity_ = 0;
+    size_t highWater_ = 0;
+    size_t grows_ = 0;
+    size_t limit_;
+    ConvAlgoPolicy policy_;
+
+    void release() {
+        if (ptr_ != nullptr)
+            MemoryPool::get(backend_, device_).release(ptr_);
+        ptr_ = nullptr;
+        capacity_ = 0;
+    }
+
+public:
+    WorkspaceArena(const WorkspaceArena&) = delete;
+    WorkspaceArena& operator=(const WorkspaceArena&) = delete;
+
+    // stream is the one the borrowed memory is used on, see MemoryPool
+    WorkspaceArena(Backend backend, int device,
+            const void* stream = nullptr) :
+            backend_(backend), device_(device), stream_(stream) {
+        const char* limit = getenv("TEST_WORKSPACE_LIMIT_MB");
+        limit_ = limit == nullptr ? UNLIMITED :
+            static_cast<size_t>(atoll(limit)) << 20;
+        policy_ = ConvAlgoPolicy::parse(getenv("TEST_CONV_ALGO_POLICY"));
+    }
+
+    ~WorkspaceArena() { release(); }
+
+    // At least bytes of scratch, valid until the next borrow. The
+    // contents are not preserved when the arena grows.
+    void* borrow(size_t bytes) {
+        CHECK_ARGS(fits(bytes), "Workspace request exceeds the limit!");
+        highWater_ = std::max(highWater_, bytes);
+        if (bytes > capacity_) {
+            release();
+            ptr_ = MemoryPool::get(backend_, device_).allocate(bytes, stream_);
+            capacity_ = bytes;
+            grows_++;
+        }
+        return bytes == 0 ? nullptr : ptr_;
+    }
+
+    bool fits(size_t bytes) const { return bytes <= limit_; }
+
+    // A cap below the current size gives the memory back right away
+    void setLimit(size_t bytes) {
+        limit_ = bytes;
+        if (capacity_ > limit_)
+            release();
+    }
+
+    size_t limit() const { return limit_; }
+
+    // HandleDefault stands for Fastest here
+    void setPolicy(const ConvAlgoPolicy& policy) {
+        policy_ = policy.kind == ConvAlgoPolicy::HandleDefault ?
+            ConvAlgoPolicy(ConvAlgoPolicy::Fastest) : policy;
+    }
+    const ConvAlgoPolicy& policy() const { return policy_; }
+
+    // Budget and policy of one call, a spec only tightens the budget
+    size_t budget(size_t callLimit) const {
+        return std::min(limit_, callLimit);
+    }
+    ConvAlgoPolicy policy(const ConvAlgoPolicy& callPolicy) const {
+        return callPolicy.kind == ConvAlgoPolicy::HandleDefault ?
+            policy_ : callPolicy;
+    }
+    size_t capacity() const { return capacity_; }
+    size_t highWater() const { return highWater_; }
+    size_t grows() const { return grows_; }
+};
+
+#endif
@@ -1,261 +1,513 @@
 #include "test_operators.hpp"
 
+template<typename T>
+ConvPlan<T> ConvolutionOp<T>::Prepare(ExecContext& handle,
+        const ConvDescriptor& convSpec,
+        const std::vector<int>& xDims, const std::vector<int>& wDims,
+        const std::vector<int>& yDims){
+    CHECK_ARGS(xDims.size() == 4 && wDims.size() == 4 && yDims.size() == 4,
+            "Only 2d convolution is supported!");
+    ConvPlan<T> plan(handle, convSpec, xDims, wDims, yDims);
+    if (handle.backend() == Backend::Host) {
+        PrepareHost(static_cast<HostHandle&>(handle), plan);
+        return plan;
+    }
+#ifndef USE_HOST_ONLY
+    PrepareHip(static_cast<HipHandle&>(handle), plan);
+#endif
+    return plan;
+}
+
+template<typename T>
+ConvPlan<T> ConvolutionOp<T>::Cached(ExecContext& handle,
+        const ConvDescriptor& convSpec,
+        const std::vector<int>& xDims, const std::vector<int>& wDims,
+        const std::vector<int>& yDims){
+    // The budget and policy of the spec are set in the state too
+    std::string key = makeConvProblemKey<T>(ConvDirection::Forward,
+            convSpec, xDims, wDims, yDims) + "-ws" +
+        std::to_string(convSpec.workspaceLimit) + "-policy" +
+        std::to_string(convSpec.algoPolicy.kind) + ":" +
+        std::to_string(convSpec.algoPolicy.tolerance);
+    std::shared_ptr<PlanState>& state = handle.planCache()[key];
+    if (state == nullptr) {
+        ConvPlan<T> plan = Prepare(handle, convSpec, xDims, wDims, yDims);
+        state = plan.state_;
+        return plan;
+    }
+    ConvPlan<T> plan(handle, convSpec, xDims, wDims, yDims);
+    plan.state_ = state;
+    return plan;
+}
+
 // Convolution Ops
 template<typename T>
-void ConvolutionOp<T>::ConvForward(HipHandle& handle,
+void ConvolutionOp<T>::ConvForward(ExecContext& handle,
         ConvDescriptor& convSpec,
         const Tensor<T>& x, const Tensor<T>& w,
         const Tensor<T>* bias, Tensor<T>& y){
+    Cached(handle, convSpec, x.dims(), w.dims(), y.dims()).Forward(
+            x, w, bias, y);
+}
 
-    if (convSpec.mode == "conv") {
-        if (convSpec.dilation.size() != 0) {
-            CHECK_ARGS(convSpec.dilation[0] == 1 &&
-                    convSpec.dilation[1] == 1,
-                    "Invalid dilation for convolution!");
-        }
-        convSpec.dilation.push_back(1);
-        convSpec.dilation.push_back(1);
+template<typename T>
+void ConvolutionOp<T>::ConvBiasActivationForward(ExecContext& handle,
+        ConvDescriptor& convSpec, const ActivationDescriptor& activation,
+        const Tensor<T>& x, const Tensor<T>& w,
+        const Tensor<T>* bias, Tensor<T>& y){
+    Cached(handle, convSpec, x.dims(), w.dims(), y.dims()).Forward(
+            x, w, bias, activation, y);
+}
+
+template<typename T>
+void ConvolutionOp<T>::ConvBackwardWeight(ExecContext& handle,
+        ConvDescriptor& convSpec, const Tensor<T>& dy, 
+        const Tensor<T>& x, Tensor<T>& dw, Tensor<T>* dbias){
+    Cached(handle, convSpec, x.dims(), dw.dims(), dy.dims()).BackwardWeight(
+            dy, x, dw, dbias);
+}
+
+template<typename T>
+void ConvolutionOp<T>::ConvBackwardData(ExecContext& handle,
+        ConvDescriptor& convSpec, const Tensor<T>& dy,
+        const Tensor<T>& w, Tensor<T>& dx){
+    Cached(handle, convSpec, dx.dims(), w.dims(), dy.dims()).BackwardData(
+            dy, w, dx);
+}
+
+#ifndef USE_HOST_ONLY
+static void setDefaultDilation(ConvDescriptor& convSpec) {
+    if (convSpec.mode != "conv")
+        return;
+    if (convSpec.dilation.size() != 0) {
+        CHECK_ARGS(convSpec.dilation[0] == 1 &&
+                convSpec.dilation[1] == 1,
+                "Invalid dilation for convolution!");
+        return;
     }
+    convSpec.dilation.push_back(1);
+    convSpec.dilation.push_back(1);
+}
 
-    std::vector<int> workSpaceDims = {0};
-    const T alpha = 1.0;
-    const T beta = 0.0;
-    
-    miopenTensorDescriptor_t xDesc, wDesc, yDesc;
+static void setTensorDescriptor(miopenTensorDescriptor_t desc,
+        const std::vector<int>& dims) {
+    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(desc, miopenFloat,
+            dims[0], dims[1], dims[2], dims[3]));
+}
+
+struct ConvHipState : PlanState {
+    miopenTensorDescriptor_t xDesc, wDesc, yDesc, bDesc;
     miopenConvolutionDescriptor_t convDesc;
-    int returnedAlgoCount;
-    miopenConvAlgoPerf_t perfResults;
-    size_t workSpaceSize;
-    
+    size_t workspaceLimit;
+    ConvAlgoPolicy policy;
+    // Indexed by ConvDirection
+    std::string keys[3];
+    ConvAlgoEntry algos[3];
+    bool found[3] = {false, false, false};
+    // Fusion plan of the fused forward, built on its first run for one
+    // activation mode with or without bias. fusion is -1 when MIOpen
+    // cannot fuse the problem and the run makes separate calls instead.
+    miopenFusionPlanDescriptor_t fusePlan = nullptr;
+    miopenFusionOpDescriptor_t fuseConv, fuseBias, fuseActiv;
+    miopenOperatorArgs_t fuseArgs = nullptr;
+    miopenActivationDescriptor_t activDesc;
+    std::string fuseKey;
+    int fusion = 0;
+
+    ConvHipState() {
+        CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&xDesc));
+        CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&wDesc));
+        CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&yDesc));
+        CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&bDesc));
+        CHECK_CALL_MIOPEN(miopenCreateConvolutionDescriptor(&convDesc));
+        CHECK_CALL_MIOPEN(miopenCreateActivationDescriptor(&activDesc));
+    }
+
+    ~ConvHipState() {
+        if (fusePlan != nullptr)
+            CHECK_CALL_MIOPEN(miopenDestroyFusionPlan(fusePlan));
+        if (fuseArgs != nullptr)
+            CHECK_CALL_MIOPEN(miopenDestroyOperatorArgs(fuseArgs));
+        CHECK_CALL_MIOPEN(miopenDestroyActivationDescriptor(activDesc));
+        CHECK_CALL_MIOPEN(miopenDestroyConvolutionDescriptor(convDesc));
+        CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(xDesc));
+        CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(wDesc));
+        CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(yDesc));
+        CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(bDesc));
+    }
+};
+
+// Most algorithms a search ranks, MIOpen has at most five per direction
+static const int CONV_FIND_ALGOS = 8;
+
+// Algorithm of one direction of the plan. On the first run it is looked
+// up, or picked by the policy from what find ranks under the budget, and
+// kept while it still fits.
+template<typename Find>
+static const ConvAlgoEntry& planConvAlgo(HipHandle& handle,
+        ConvHipState& state, ConvDirection direction, Find find) {
+    int d = static_cast<int>(direction);
+    WorkspaceArena& arena = handle.workspace();
+    size_t budget = arena.budget(state.workspaceLimit);
+    if (state.found[d] && state.algos[d].workSpaceSize <= budget)
+        return state.algos[d];
+    ConvAlgoPolicy policy = arena.policy(state.policy);
+    std::string key = makeConvSearchKey(state.keys[d], budget, policy);
+    if (!ConvAlgoCache::instance().find(handle.deviceId(), key,
+            state.algos[d])) {
+        std::vector<ConvAlgoEntry> candidates = find(budget);
+        int picked = selectConvAlgo(candidates, budget, policy);
+        CHECK_ARGS(picked >= 0,
+                "No convolution algorithm fits the workspace budget!");
+        state.algos[d] = candidates[picked];
+        ConvAlgoCache::instance().insert(handle.deviceId(), key,
+                state.algos[d]);
+    }
+    state.found[d] = true;
+    return state.algos[d];
+}
+
+// Compiles the conv -> bias -> activation fusion plan when the
+// combination changes, returns false when MIOpen cannot fuse it
+static bool planConvFusion(HipHandle& handle, ConvHipState& state,
+        const ActivationDescriptor& activation, bool bias) {
+    std::string key = activation.mode + (bias ? "+bias" : "");
+    if (state.fuseKey == key)
+        return state.fusion > 0;
+    if (state.fusePlan != nullptr)
+        CHECK_CALL_MIOPEN(miopenDestroyFusionPlan(state.fusePlan));
+    if (state.fuseArgs == nullptr)
+        CHECK_CALL_MIOPEN(miopenCreateOperatorArgs(&state.fuseArgs));
+    state.fuseKey = key;
+    CHECK_CALL_MIOPEN(miopenCreateFusionPlan(&state.fusePlan,
+            miopenVerticalFusion, state.xDesc));
+    CHECK_CALL_MIOPEN(miopenCreateOpConvForward(state.fusePlan,
+            &state.fuseConv, state.convDesc, state.wDesc));
+    if (bias) {
+        CHECK_CALL_MIOPEN(miopenCreateOpBiasForward(state.fusePlan,
+                &state.fuseBias, state.bDesc));
+    }
+    CHECK_CALL_MIOPEN(miopenCreateOpActivationForward(state.fusePlan,
+            &state.fuseActiv, activation.getMode()));
+    state.fusion = miopenCompileFusionPlan(handle.miopenHandle(),
+            state.fusePlan) == miopenStatusSuccess ? 1 : -1;
+    return state.fusion > 0;
+}
+
+// Find's ranked results as cache entries, algo reads the id field of
+// the direction
+template<typename AlgoOf>
+static std::vector<ConvAlgoEntry> convCandidates(
+        const miopenConvAlgoPerf_t* perfResults, int count, AlgoOf algoOf) {
+    std::vector<ConvAlgoEntry> candidates(count);
+    for (int i = 0; i < count; i++) {
+        candidates[i].algo = algoOf(perfResults[i]);
+        candidates[i].time = perfResults[i].time;
+        candidates[i].workSpaceSize = perfResults[i].memory;
+    }
+    return candidates;
+}
+
+template<typename T>
+void ConvolutionOp<T>::PrepareHip(HipHandle& handle, ConvPlan<T>& plan){
+    ConvDescriptor& convSpec = plan.spec_;
+    setDefaultDilation(convSpec);
+
     CHECK_CALL_HIP(hipSetDevice(handle.deviceId()));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&xDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&wDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&yDesc));
-    
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(xDesc, miopenFloat,
-            x.dim(0), x.dim(1), x.dim(2), x.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(wDesc, miopenFloat,
-            w.dim(0), w.dim(1), w.dim(2), w.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(yDesc, miopenFloat,
-            y.dim(0), y.dim(1), y.dim(2), y.dim(3)));
-    CHECK_CALL_MIOPEN(miopenCreateConvolutionDescriptor(&convDesc));
-    CHECK_CALL_MIOPEN(miopenInitConvolutionDescriptor(convDesc,
+    std::shared_ptr<ConvHipState> state(new ConvHipState);
+    state->workspaceLimit = convSpec.workspaceLimit;
+    state->policy = convSpec.algoPolicy;
+    setTensorDescriptor(state->xDesc, plan.xDims_);
+    setTensorDescriptor(state->wDesc, plan.wDims_);
+    setTensorDescriptor(state->yDesc, plan.yDims_);
+    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(state->bDesc,
+            miopenFloat, 1, plan.yDims_[1], 1, 1));
+    CHECK_CALL_MIOPEN(miopenInitConvolutionDescriptor(state->convDesc,
             convSpec.getMode(),
             convSpec.padding[0], convSpec.padding[1],
             convSpec.stride[0], convSpec.stride[1],
             convSpec.dilation[0], convSpec.dilation[1]));
-    
-    CHECK_CALL_MIOPEN(miopenConvolutionForwardGetWorkSpaceSize(
-            handle.miopenHandle(),
-            wDesc, xDesc, convDesc, yDesc,
-            &workSpaceSize));
-    
-    workSpaceDims[0] = static_cast<int>(workSpaceSize / sizeof(T));
-    Tensor<T> workSpace(workSpaceDims);
-    
-    CHECK_CALL_MIOPEN(miopenFindConvolutionForwardAlgorithm(
-            handle.miopenHandle(),
-            xDesc, x.data(), wDesc, w.data(),
-            convDesc, yDesc, y.data(),
-            1, &returnedAlgoCount, &perfResults,
-            workSpace.data(), workSpaceSize, false));
-    
-    workSpaceDims[0] = static_cast<int>(perfResults.memory / sizeof(T));
-    workSpace.reset(workSpaceDims);
-    
+
+    ConvDirection directions[] = {ConvDirection::Forward,
+        ConvDirection::BackwardData, ConvDirection::BackwardWeight};
+    for (ConvDirection direction : directions) {
+        state->keys[static_cast<int>(direction)] =
+            makeConvProblemKey<T>(direction, convSpec,
+                    plan.xDims_, plan.wDims_, plan.yDims_);
+    }
+    plan.state_ = state;
+}
+
+template<typename T>
+void ConvolutionOp<T>::ConvForwardHip(HipHandle& handle,
+        ConvHipState& state,
+        const Tensor<T>& x, const Tensor<T>& w,
+        const Tensor<T>* bias, Tensor<T>& y,
+        const ActivationDescriptor* activation){
+
+    BackendGuard guard(Backend::Hip);
+    WorkspaceArena& arena = handle.workspace();
+    const T alpha = 1.0;
+    const T beta = 0.0;
+
+    CHECK_CALL_HIP(hipSetDevice(handle.deviceId()));
+    if (activation != nullptr && planConvFusion(handle, state, *activation,
+            bias != nullptr)) {
+        CHECK_CALL_MIOPEN(miopenSetOpArgsConvForward(state.fuseArgs,
+                state.fuseConv, &alpha, &beta, w.data()));
+        if (bias != nullptr) {
+            CHECK_CALL_MIOPEN(miopenSetOpArgsBiasForward(state.fuseArgs,
+                    state.fuseBias, &alpha, &beta, bias->data()));
+        }
+        CHECK_CALL_MIOPEN(miopenSetOpArgsActivForward(state.fuseArgs,
+                state.fuseActiv, &alpha, &beta, activation->alpha, 0, 0));
+        CHECK_CALL_MIOPEN(miopenExecuteFusionPlan(handle.miopenHandle(),
+                state.fusePlan, state.xDesc, x.data(),
+                state.yDesc, y.data(), state.fuseArgs));
+        return;
+    }
+
+    const ConvAlgoEntry& algo = planConvAlgo(handle, state,
+            ConvDirection::Forward, [&](size_t budget) {
+        int returnedAlgoCount;
+        miopenConvAlgoPerf_t perfResults[CONV_FIND_ALGOS];
+        size_t workSpaceSize;
+        CHECK_CALL_MIOPEN(miopenConvolutionForwardGetWorkSpaceSize(
+                handle.miopenHandle(),
+                state.wDesc, state.xDesc, state.convDesc, state.yDesc,
+                &workSpaceSize));
+        // Find only considers the algorithms that fit in its workspace
+        workSpaceSize = std::min(workSpaceSize, budget);
+
+        CHECK_CALL_MIOPEN(miopenFindConvolutionForwardAlgorithm(
+                handle.miopenHandle(),
+                state.xDesc, x.data(), state.wDesc, w.data(),
+                state.convDesc, state.yDesc, y.data(),
+                CONV_FIND_ALGOS, &returnedAlgoCount, perfResults,
+                arena.borrow(workSpaceSize), workSpaceSize, false));
+        return convCandidates(perfResults, returnedAlgoCount,
+                [](const miopenConvAlgoPerf_t& perf) {
+            return static_cast<int>(perf.fwd_algo);
+        });
+    });
+
     CHECK_CALL_MIOPEN(miopenConvolutionForward(handle.miopenHandle(),
-            &alpha, xDesc, x.data(), 
-            wDesc, w.data(), convDesc,
-            perfResults.fwd_algo,
-            &beta, yDesc, y.data(),
-            workSpace.data(), perfResults.memory));
+            &alpha, state.xDesc, x.data(), 
+            state.wDesc, w.data(), state.convDesc,
+            static_cast<miopenConvFwdAlgorithm_t>(algo.algo),
+            &beta, state.yDesc, y.data(),
+            arena.borrow(algo.workSpaceSize), algo.workSpaceSize));
 
     if (bias != nullptr) {
-        miopenTensorDescriptor_t bDesc;
-
-        CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&bDesc));
-        CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(bDesc,
-                miopenFloat, 1, bias->dim(0), 1, 1));
         CHECK_CALL_MIOPEN(miopenConvolutionForwardBias(
                 handle.miopenHandle(),
-                &alpha, bDesc, bias->data(),
-                &beta, yDesc, y.data()));
-        CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(bDesc));
+                &alpha, state.bDesc, bias->data(),
+                &beta, state.yDesc, y.data()));
     }
 
-    CHECK_CALL_MIOPEN(miopenDestroyConvolutionDescriptor(convDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(xDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(wDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(yDesc));
-    handle.streamSynchronize();
+    if (activation != nullptr) {
+        CHECK_CALL_MIOPEN(miopenSetActivationDescriptor(state.activDesc,
+                activation->getMode(), activation->alpha, 0, 0));
+        CHECK_CALL_MIOPEN(miopenActivationForward(handle.miopenHandle(),
+                state.activDesc, &alpha, state.yDesc, y.data(),
+                &beta, state.yDesc, y.data()));
+    }
 }
 
 template<typename T>
-void ConvolutionOp<T>::ConvBackwardWeight(HipHandle& handle,
-        ConvDescriptor& convSpec, const Tensor<T>& dy, 
+void ConvolutionOp<T>::ConvBackwardWeightHip(HipHandle& handle,
+        ConvHipState& state, const Tensor<T>& dy, 
         const Tensor<T>& x, Tensor<T>& dw, Tensor<T>* dbias){
-    
-    if (convSpec.mode == "conv") {
-        if (convSpec.dilation.size() != 0) {
-            CHECK_ARGS(convSpec.dilation[0] == 1 &&
-                    convSpec.dilation[1] == 1,
-                    "Invalid dilation for convolution!");
-        }
-        convSpec.dilation.push_back(1);
-        convSpec.dilation.push_back(1);
-    }
 
-    std::vector<int> workSpaceDims = {0};
+    BackendGuard guard(Backend::Hip);
+    WorkspaceArena& arena = handle.workspace();
     const T alpha = 1.0;
     const T beta = 0.0;
-    
-    miopenTensorDescriptor_t dyDesc, dwDesc, xDesc;
-    miopenConvolutionDescriptor_t convDesc;
-    int returnedAlgoCount;
-    miopenConvAlgoPerf_t perfResults;
-    size_t workSpaceSize;
-    
+
     CHECK_CALL_HIP(hipSetDevice(handle.deviceId()));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&dyDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&dwDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&xDesc));
-    
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(dyDesc, miopenFloat,
-            dy.dim(0), dy.dim(1), dy.dim(2), dy.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(dwDesc, miopenFloat,
-            dw.dim(0), dw.dim(1), dw.dim(2), dw.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(xDesc, miopenFloat,
-            x.dim(0), x.dim(1), x.dim(2), x.dim(3)));
-            
-    CHECK_CALL_MIOPEN(miopenCreateConvolutionDescriptor(&convDesc));
-    CHECK_CALL_MIOPEN(miopenInitConvolutionDescriptor(convDesc,
-            convSpec.getMode(),
-            convSpec.padding[0], convSpec.padding[1],
-            convSpec.stride[0], convSpec.stride[1],
-            convSpec.dilation[0], convSpec.dilation[1]));
-    
-    // Start Backward Weight
-    CHECK_CALL_MIOPEN(miopenConvolutionBackwardWeightsGetWorkSpaceSize(
-            handle.miopenHandle(),
-            dyDesc, xDesc, convDesc, dwDesc,
-            &workSpaceSize));
-    
-    workSpaceDims[0] = static_cast<int>(workSpaceSize / sizeof(T));
-    Tensor<T> workSpace(workSpaceDims);
-    
-    CHECK_CALL_MIOPEN(miopenFindConvolutionBackwardWeightsAlgorithm(
-            handle.miopenHandle(),
-            dyDesc, dy.data(), xDesc, x.data(),
-            convDesc, dwDesc, dw.data(),
-            1, &returnedAlgoCount, &perfResults,
-            workSpace.data(), workSpaceSize, false));
-    
-    workSpaceSize = perfResults.memory;
-    workSpaceDims[0] = static_cast<int>(workSpaceSize / sizeof(T));
-    workSpace.reset(workSpaceDims);
-    
+    const ConvAlgoEntry& algo = planConvAlgo(handle, state,
+            ConvDirection::BackwardWeight, [&](size_t budget) {
+        int returnedAlgoCount;
+        miopenConvAlgoPerf_t perfResults[CONV_FIND_ALGOS];
+        size_t workSpaceSize;
+        CHECK_CALL_MIOPEN(miopenConvolutionBackwardWeightsGetWorkSpaceSize(
+                handle.miopenHandle(),
+                state.yDesc, state.xDesc, state.convDesc, state.wDesc,
+                &workSpaceSize));
+        // Find only considers the algorithms that fit in its workspace
+        workSpaceSize = std::min(workSpaceSize, budget);
+
+        CHECK_CALL_MIOPEN(miopenFindConvolutionBackwardWeightsAlgorithm(
+                handle.miopenHandle(),
+                state.yDesc, dy.data(), state.xDesc, x.data(),
+                state.convDesc, state.wDesc, dw.data(),
+                CONV_FIND_ALGOS, &returnedAlgoCount, perfResults,
+                arena.borrow(workSpaceSize), workSpaceSize, false));
+        return convCandidates(perfResults, returnedAlgoCount,
+                [](const miopenConvAlgoPerf_t& perf) {
+            return static_cast<int>(perf.bwd_weights_algo);
+        });
+    });
+
     CHECK_CALL_MIOPEN(miopenConvolutionBackwardWeights(handle.miopenHandle(),
-            &alpha, dyDesc, dy.data(), 
-            xDesc, x.data(), convDesc,
-            perfResults.bwd_weights_algo,
-            &beta, dwDesc, dw.data(),
-            workSpace.data(), workSpaceSize));
+            &alpha, state.yDesc, dy.data(), 
+            state.xDesc, x.data(), state.convDesc,
+            static_cast<miopenConvBwdWeightsAlgorithm_t>(algo.algo),
+            &beta, state.wDesc, dw.data(),
+            arena.borrow(algo.workSpaceSize), algo.workSpaceSize));
 
     if (dbias != nullptr) {
-        miopenTensorDescriptor_t dbDesc;
-
-        CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&dbDesc));
-        CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(dbDesc,
-                miopenFloat, 1, dbias->dim(0), 1, 1));
         CHECK_CALL_MIOPEN(miopenConvolutionBackwardBias(
                 handle.miopenHandle(),
-                &alpha, dyDesc, dy.data(),
-                &beta, dbDesc, dbias->data()));
-        CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(dbDesc));
+                &alpha, state.yDesc, dy.data(),
+                &beta, state.bDesc, dbias->data()));
     }
-       
-    CHECK_CALL_MIOPEN(miopenDestroyConvolutionDescriptor(convDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(dyDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(dwDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(xDesc));
-    handle.streamSynchronize();
 }
 
 template<typename T>
-void ConvolutionOp<T>::ConvBackwardData(HipHandle& handle,
-        ConvDescriptor& convSpec, const Tensor<T>& dy,
+void ConvolutionOp<T>::ConvBackwardDataHip(HipHandle& handle,
+        ConvHipState& state, const Tensor<T>& dy,
         const Tensor<T>& w, Tensor<T>& dx){
-    
-    if (convSpec.mode == "conv") {
-        if (convSpec.dilation.size() != 0) {
-            CHECK_ARGS(convSpec.dilation[0] == 1 &&
-                    convSpec.dilation[1] == 1,
-                    "Invalid dilation for convolution!");
-        }
-        convSpec.dilation.push_back(1);
-        convSpec.dilation.push_back(1);
-    }
 
-    std::vector<int> workSpaceDims = {0};
+    BackendGuard guard(Backend::Hip);
+    WorkspaceArena& arena = handle.workspace();
     const T alpha = 1.0;
     const T beta = 0.0;
-    
-    miopenTensorDescriptor_t dyDesc, dxDesc, wDesc;
-    miopenConvolutionDescriptor_t convDesc;
-    int returnedAlgoCount;
-    miopenConvAlgoPerf_t perfResults;
-    size_t workSpaceSize;
-    
+
     CHECK_CALL_HIP(hipSetDevice(handle.deviceId()));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&dyDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&dxDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&wDesc));
-    
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(dyDesc, miopenFloat,
-            dy.dim(0), dy.dim(1), dy.dim(2), dy.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(dxDesc, miopenFloat,
-            dx.dim(0), dx.dim(1), dx.dim(2), dx.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(wDesc, miopenFloat,
-            w.dim(0), w.dim(1), w.dim(2), w.dim(3)));
-
-    CHECK_CALL_MIOPEN(miopenCreateConvolutionDescriptor(&convDesc));
-    CHECK_CALL_MIOPEN(miopenInitConvolutionDescriptor(convDesc,
-            convSpec.getMode(),
-            convSpec.padding[0], convSpec.padding[1],
-            convSpec.stride[0], convSpec.stride[1],
-            convSpec.dilation[0], convSpec.dilation[1]));
-    
-    CHECK_CALL_MIOPEN(miopenConvolutionBackwardDataGetWorkSpaceSize(
-            handle.miopenHandle(),
-            dyDesc, wDesc, convDesc, dxDesc,
-            &workSpaceSize));
-    
-    workSpaceDims[0] = static_cast<int>(workSpaceSize / sizeof(T));
-    Tensor<T> workSpace(workSpaceDims);
-    
-    CHECK_CALL_MIOPEN(miopenFindConvolutionBackwardDataAlgorithm(
-            handle.miopenHandle(),
-            dyDesc, dy.data(), wDesc, w.data(),
-            convDesc, dxDesc, dx.data(),
-            1, &returnedAlgoCount, &perfResults,
-            workSpace.data(), workSpaceSize, false));
-    
-    workSpaceSize = perfResults.memory;
-    workSpaceDims[0] = static_cast<int>(workSpaceSize / sizeof(T));
-    workSpace.reset(workSpaceDims);
-    
+    const ConvAlgoEntry& algo = planConvAlgo(handle, state,
+            ConvDirection::BackwardData, [&](size_t budget) {
+        int returnedAlgoCount;
+        miopenConvAlgoPerf_t perfResults[CONV_FIND_ALGOS];
+        size_t workSpaceSize;
+        CHECK_CALL_MIOPEN(miopenConvolutionBackwardDataGetWorkSpaceSize(
+                handle.miopenHandle(),
+                state.yDesc, state.wDesc, state.convDesc, state.xDesc,
+                &workSpaceSize));
+        // Find only considers the algorithms that fit in its workspace
+        workSpaceSize = std::min(workSpaceSize, budget);
+
+        CHECK_CALL_MIOPEN(miopenFindConvolutionBackwardDataAlgorithm(
+                handle.miopenHandle(),
+                state.yDesc, dy.data(), state.wDesc, w.data(),
+                state.convDesc, state.xDesc, dx.data(),
+                CONV_FIND_ALGOS, &returnedAlgoCount, perfResults,
+                arena.borrow(workSpaceSize), workSpaceSize, false));
+        return convCandidates(perfResults, returnedAlgoCount,
+                [](const miopenConvAlgoPerf_t& perf) {
+            return static_cast<int>(perf.bwd_data_algo);
+        });
+    });
+
     CHECK_CALL_MIOPEN(miopenConvolutionBackwardData(handle.miopenHandle(),
-            &alpha, dyDesc, dy.data(), 
-            wDesc, w.data(), convDesc,
-            perfResults.bwd_data_algo,
-            &beta, dxDesc, dx.data(),
-            workSpace.data(), workSpaceSize));
-    
-    CHECK_CALL_MIOPEN(miopenDestroyConvolutionDescriptor(convDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(dyDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(wDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(dxDesc));
-    handle.streamSynchronize();
+            &alpha, state.yDesc, dy.data(), 
+            state.wDesc, w.data(), state.convDesc,
+            static_cast<miopenConvBwdDataAlgorithm_t>(algo.algo),
+            &beta, state.xDesc, dx.data(),
+            arena.borrow(algo.workSpaceSize), algo.workSpaceSize));
+}
+#endif
+
+template<typename T>
+void ConvPlan<T>::Forward(const Tensor<T>& x, const Tensor<T>& w,
+        const Tensor<T>* bias, Tensor<T>& y) const {
+    RunForward(x, w, bias, nullptr, y);
+}
+
+template<typename T>
+void ConvPlan<T>::Forward(const Tensor<T>& x, const Tensor<T>& w,
+        const Tensor<T>* bias, const ActivationDescriptor& activation,
+        Tensor<T>& y) const {
+    CHECK_ARGS(activation.mode == "relu" ||
+            activation.mode == "leakyrelu" ||
+            activation.mode == "clippedrelu",
+            "Unknown activation mode!");
+    RunForward(x, w, bias, &activation, y);
+}
+
+template<typename T>
+void ConvPlan<T>::RunForward(const Tensor<T>& x, const Tensor<T>& w,
+        const Tensor<T>* bias, const ActivationDescriptor* activation,
+        Tensor<T>& y) const {
+    ExecContext& handle = *handle_;
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, w);
+    CHECK_BACKEND(handle, y);
+    if (bias != nullptr) CHECK_BACKEND(handle, *bias);
+    CHECK_ARGS(x.dims() == xDims_ && w.dims() == wDims_ &&
+            y.dims() == yDims_, "Tensor shapes do not match the plan!");
+    std::shared_ptr<PlanState> state = state_;
+    // Copied for the queued run
+    std::shared_ptr<ActivationDescriptor> activ;
+    if (activation != nullptr)
+        activ.reset(new ActivationDescriptor(*activation));
+    runOp(handle, [&handle, state, &x, &w, bias, activ, &y] {
+        if (handle.backend() == Backend::Host) {
+            ConvolutionOp<T>::ConvForwardHost(
+                    static_cast<HostHandle&>(handle),
+                    static_cast<ConvHostState&>(*state),
+                    x, w, bias, y, activ.get());
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        ConvolutionOp<T>::ConvForwardHip(static_cast<HipHandle&>(handle),
+                static_cast<ConvHipState&>(*state), x, w, bias, y,
+                activ.get());
+#endif
+    }, &x, &w, bias, &y);
+}
+
+template<typename T>
+void ConvPlan<T>::BackwardWeight(const Tensor<T>& dy, const Tensor<T>& x,
+        Tensor<T>& dw, Tensor<T>* dbias) const {
+    ExecContext& handle = *handle_;
+    CHECK_BACKEND(handle, dy);
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, dw);
+    if (dbias != nullptr) CHECK_BACKEND(handle, *dbias);
+    CHECK_ARGS(x.dims() == xDims_ && dw.dims() == wDims_ &&
+            dy.dims() == yDims_, "Tensor shapes do not match the plan!");
+    std::shared_ptr<PlanState> state = state_;
+    runOp(handle, [&handle, state, &dy, &x, &dw, dbias] {
+        if (handle.backend() == Backend::Host) {
+            ConvolutionOp<T>::ConvBackwardWeightHost(
+                    static_cast<HostHandle&>(handle),
+                    static_cast<ConvHostState&>(*state),
+                    dy, x, dw, dbias);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        ConvolutionOp<T>::ConvBackwardWeightHip(
+                static_cast<HipHandle&>(handle),
+                static_cast<ConvHipState&>(*state), dy, x, dw, dbias);
+#endif
+    }, &dy, &x, &dw, dbias);
+}
+
+template<typename T>
+void ConvPlan<T>::BackwardData(const Tensor<T>& dy, const Tensor<T>& w,
+        Tensor<T>& dx) const {
+    ExecContext& handle = *handle_;
+    CHECK_BACKEND(handle, dy);
+    CHECK_BACKEND(handle, w);
+    CHECK_BACKEND(handle, dx);
+    CHECK_ARGS(dx.dims() == xDims_ && w.dims() == wDims_ &&
+            dy.dims() == yDims_, "Tensor shapes do not match the plan!");
+    std::shared_ptr<PlanState> state = state_;
+    runOp(handle, [&handle, state, &dy, &w, &dx] {
+        if (handle.backend() == Backend::Host) {
+            ConvolutionOp<T>::ConvBackwardDataHost(
+                    static_cast<HostHandle&>(handle),
+                    static_cast<ConvHostState&>(*state), dy, w, dx);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        ConvolutionOp<T>::ConvBackwardDataHip(
+                static_cast<HipHandle&>(handle),
+                static_cast<ConvHipState&>(*state), dy, w, dx);
+#endif
+    }, &dy, &w, &dx);
 }
 
+template class ConvPlan<float>;
 template class ConvolutionOp<float>;
@@ -0,0 +1,251 @@
+#include "test_operators.hpp"
+
+// Describe the problem from the forward convolution point of view: for
+// "conv" x is the image and y the output, "deconv" swaps the two.
+static HostConvShape makeHostConvShape(const ConvDescriptor& convSpec,
+        const std::vector<int>& x, const std::vector<int>& w,
+        const std::vector<int>& y) {
+    CHECK_ARGS(convSpec.convdim == 2 && convSpec.padding.size() >= 2 &&
+            convSpec.stride.size() >= 2,
+            "Only 2d convolution is supported!");
+    CHECK_ARGS(convSpec.mode == "conv" || convSpec.mode == "deconv",
+            "Unknown convolution mode!");
+    bool deconv = convSpec.mode == "deconv";
+    const std::vector<int>& im = deconv ? y : x;
+    const std::vector<int>& out = deconv ? x : y;
+
+    HostConvShape shape;
+    shape.batch = im[0];
+    shape.group = convSpec.group;
+    shape.imChannels = im[1];
+    shape.imH = im[2];
+    shape.imW = im[3];
+    shape.outChannels = out[1];
+    shape.outH = out[2];
+    shape.outW = out[3];
+    shape.kernelH = w[2];
+    shape.kernelW = w[3];
+    shape.padH = convSpec.padding[0];
+    shape.padW = convSpec.padding[1];
+    shape.strideH = convSpec.stride[0];
+    shape.strideW = convSpec.stride[1];
+    if (convSpec.dilation.size() >= 2) {
+        shape.dilationH = convSpec.dilation[0];
+        shape.dilationW = convSpec.dilation[1];
+    }
+
+    CHECK_ARGS(shape.group > 0 && shape.imChannels % shape.group == 0 &&
+            shape.outChannels % shape.group == 0,
+            "Invalid group for convolution!");
+    CHECK_ARGS(out[0] == shape.batch &&
+            w[0] == shape.outChannels &&
+            w[1] * shape.group == shape.imChannels,
+            "Tensor shapes do not match the convolution!");
+    CHECK_ARGS(shape.outH == (shape.imH + 2 * shape.padH -
+            shape.dilationH * (shape.kernelH - 1) - 1) / shape.strideH + 1 &&
+            shape.outW == (shape.imW + 2 * shape.padW -
+            shape.dilationW * (shape.kernelW - 1) - 1) / shape.strideW + 1,
+            "Output size does not match the convolution!");
+    return shape;
+}
+
+// Elements of scratch an im2col conv takes under budget: per-thread
+// buffers when they fit, a single one otherwise
+template<typename T>
+static size_t hostIm2colWorkspace(HostHandle& handle,
+        const HostConvShape& shape, bool backwardWeight, size_t budget) {
+    size_t size = HostFunc<T>::convWorkspaceSize(handle.threadPool(), shape,
+            backwardWeight, true);
+    if (size * sizeof(T) > budget)
+        size = HostFunc<T>::convWorkspaceSize(handle.threadPool(), shape,
+                backwardWeight, false);
+    return size;
+}
+
+template<typename T>
+static T* borrowHostWorkspace(HostHandle& handle, const ConvHostState& state,
+        bool backwardWeight, size_t& size) {
+    size_t budget = handle.workspace().budget(state.workspaceLimit);
+    size = hostIm2colWorkspace<T>(handle, state.shape, backwardWeight,
+            budget);
+    CHECK_ARGS(size * sizeof(T) <= budget,
+            "Convolution needs more workspace than the limit!");
+    return static_cast<T*>(handle.workspace().borrow(size * sizeof(T)));
+}
+
+template<typename T>
+void ConvolutionOp<T>::PrepareHost(HostHandle&, ConvPlan<T>& plan){
+    std::shared_ptr<ConvHostState> state(new ConvHostState);
+    state->shape = makeHostConvShape(plan.spec_, plan.xDims_, plan.wDims_,
+            plan.yDims_);
+    state->deconv = plan.spec_.mode == "deconv";
+    state->workspaceLimit = plan.spec_.workspaceLimit;
+    state->policy = plan.spec_.algoPolicy;
+    state->key = makeConvProblemKey<T>(ConvDirection::Forward, plan.spec_,
+            plan.xDims_, plan.wDims_, plan.yDims_);
+    plan.state_ = state;
+}
+
+// Forward algorithms that apply to the problem with the bytes of
+// scratch each takes under budget. Deconvolution only has im2col.
+template<typename T>
+static std::vector<ConvAlgoEntry> hostConvCandidates(HostHandle& handle,
+        const ConvHostState& state, size_t budget) {
+    std::vector<ConvAlgoEntry> candidates(1);
+    candidates[0].algo = static_cast<int>(HostConvAlgo::Im2col);
+    candidates[0].workSpaceSize = sizeof(T) *
+        hostIm2colWorkspace<T>(handle, state.shape, false, budget);
+    if (state.deconv)
+        return candidates;
+    ConvAlgoEntry direct;
+    direct.algo = static_cast<int>(HostConvAlgo::Direct);
+    candidates.push_back(direct);
+    if (HostFunc<T>::winogradApplies(state.shape)) {
+        ConvAlgoEntry winograd;
+        winograd.algo = static_cast<int>(HostConvAlgo::Winograd);
+        winograd.workSpaceSize = sizeof(T) *
+            HostFunc<T>::winogradWorkspaceSize(state.shape);
+        candidates.push_back(winograd);
+    }
+    return candidates;
+}
+
+// epilogue may be nullptr. Every forward algorithm applies it as it
+// stores the output, deconvolution makes a separate pass.
+template<typename T>
+static void runHostConvForward(HostHandle& handle, const ConvHostState& state,
+        const ConvAlgoEntry& algo, const T* x, const T* w, T* y,
+        const GemmEpilogue<T>* epilogue) {
+    ThreadPool& pool = handle.threadPool();
+    T* workspace = static_cast<T*>(handle.workspace().borrow(
+            algo.workSpaceSize));
+    size_t workspaceSize = algo.workSpaceSize / sizeof(T);
+    switch (static_cast<HostConvAlgo>(algo.algo)) {
+    case HostConvAlgo::Direct:
+        HostFunc<T>::convForwardDirect(pool, state.shape, x, w, y,
+                epilogue);
+        break;
+    case HostConvAlgo::Winograd:
+        HostFunc<T>::convForwardWinograd(pool, state.shape, x, w, y,
+                workspace, epilogue);
+        break;
+    default:
+        if (!state.deconv) {
+            HostFunc<T>::convForward(pool, state.shape, x, w, y,
+                    workspace, workspaceSize, epilogue);
+            break;
+        }
+        HostFunc<T>::convBackwardData(pool, state.shape, x, w, y,
+                workspace, workspaceSize);
+        if (epilogue) {
+            HostFunc<T>::channelEpilogue(pool, state.shape.batch,
+                    state.shape.imChannels, state.shape.imH * state.shape.imW,
+                    *epilogue, y);
+        }
+    }
+}
+
+// Like miopenFind, the first run of a problem times every algorithm that
+// fits on the real tensors and the policy picks from those timings
+template<typename T>
+static const ConvAlgoEntry& hostConvAlgo(HostHandle& handle,
+        ConvHostState& state, const T* x, const T* w, T* y) {
+    WorkspaceArena& arena = handle.workspace();
+    size_t budget = arena.budget(state.workspaceLimit);
+    if (state.found && state.algo.workSpaceSize <= budget)
+        return state.algo;
+    ConvAlgoPolicy policy = arena.policy(state.policy);
+    std::string key = makeConvSearchKey(state.key, budget, policy);
+    if (!ConvAlgoCache::instance().find(handle.deviceId(), key, state.algo)) {
+        std::vector<ConvAlgoEntry> candidates =
+            hostConvCandidates<T>(handle, state, budget);
+        for (ConvAlgoEntry& candidate : candidates) {
+            if (candidate.workSpaceSize > budget) continue;
+            auto start = std::chrono::steady_clock::now();
+            runHostConvForward<T>(handle, state, candidate, x, w, y,
+                    nullptr);
+            candidate.time = std::chrono::duration<float, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
+        int picked = selectConvAlgo(candidates, budget, policy);
+        CHECK_ARGS(picked >= 0,
+                "Convolution needs more workspace than the limit!");
+        state.algo = candidates[picked];
+        ConvAlgoCache::instance().insert(handle.deviceId(), key, state.algo);
+    }
+    state.found = true;
+    return state.algo;
+}
+
+// Convolution Ops
+template<typename T>
+void ConvolutionOp<T>::ConvForwardHost(HostHandle& handle,
+        ConvHostState& state,
+        const Tensor<T>& x, const Tensor<T>& w,
+        const Tensor<T>* bias, Tensor<T>& y,
+        const ActivationDescriptor* activation){
+    const ConvAlgoEntry& algo = hostConvAlgo(handle, state,
+            x.data(), w.data(), y.data());
+
+    // Bias and activation are added to the output tiles as they are stored
+    GemmEpilogue<T> epilogue;
+    if (bias != nullptr)
+        epilogue.bias = bias->data();
+    if (activation != nullptr) {
+        epilogue.activation = hostActivation(*activation);
+        epilogue.alpha = activation->alpha;
+    }
+    bool fused = bias != nullptr || activation != nullptr;
+    runHostConvForward(handle, state, algo, x.data(), w.data(), y.data(),
+            fused ? &epilogue : nullptr);
+}
+
+template<typename T>
+void ConvolutionOp<T>::ConvBackwardWeightHost(HostHandle& handle,
+        ConvHostState& state, const Tensor<T>& dy,
+        const Tensor<T>& x, Tensor<T>& dw, Tensor<T>* dbias){
+    size_t workspaceSize;
+    T* workspace = borrowHostWorkspace<T>(handle, state, true,
+            workspaceSize);
+
+    if (!state.deconv)
+        HostFunc<T>::convBackwardWeight(handle.threadPool(), state.shape,
+                dy.data(), x.data(), dw.data(), workspace, workspaceSize);
+    else
+        HostFunc<T>::convBackwardWeight(handle.threadPool(), state.shape,
+                x.data(), dy.data(), dw.data(), workspace, workspaceSize);
+
+    if (dbias != nullptr) {
+        HostFunc<T>::reduceChannelBias(handle.threadPool(),
+                dy.dim(0), dy.dim(1), dy.dim(2) * dy.dim(3),
+                dy.data(), dbias->data());
+    }
+}
+
+template<typename T>
+void ConvolutionOp<T>::ConvBackwardDataHost(HostHandle& handle,
+        ConvHostState& state, const Tensor<T>& dy,
+        const Tensor<T>& w, Tensor<T>& dx){
+    size_t workspaceSize;
+    T* workspace = borrowHostWorkspace<T>(handle, state, false,
+            workspaceSize);
+
+    if (!state.deconv)
+        HostFunc<T>::convBackwardData(handle.threadPool(), state.shape,
+                dy.data(), w.data(), dx.data(), workspace, workspaceSize);
+    else
+        HostFunc<T>::convForward(handle.threadPool(), state.shape,
+                dy.data(), w.data(), dx.data(), workspace, workspaceSize);
+}
+
+template void ConvolutionOp<float>::PrepareHost(HostHandle&,
+        ConvPlan<float>&);
+template void ConvolutionOp<float>::ConvForwardHost(HostHandle&,
+        ConvHostState&, const Tensor<float>&, const Tensor<float>&,
+        const Tensor<float>*, Tensor<float>&, const ActivationDescriptor*);
+template void ConvolutionOp<float>::ConvBackwardWeightHost(HostHandle&,
+        ConvHostState&, const Tensor<float>&, const Tensor<float>&,
+        Tensor<float>&, Tensor<float>*);
+template void ConvolutionOp<float>::ConvBackwardDataHost(HostHandle&,
+        ConvHostState&, const Tensor<float>&, const Tensor<float>&,
+        Tensor<float>&);
@@ -0,0 +1,207 @@
+#include "test_operators.hpp"
+
+// Threads of the block that handles one sample on HIP
+#define CE_BLOCK 256
+
+#ifndef USE_HOST_ONLY
+// Sum of value over the block in a fixed order, every thread gets it
+template<typename T>
+__device__ T hipBlockSum(T value, T* shared) {
+    uint32_t tid = threadIdx.x;
+    shared[tid] = value;
+    __syncthreads();
+    for (uint32_t s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (tid < s) shared[tid] += shared[tid + s];
+        __syncthreads();
+    }
+    T sum = shared[0];
+    __syncthreads();
+    return sum;
+}
+
+// Max of a row and the sum of exp(x - max) over it, every thread of the
+// block gets both
+template<typename T>
+__device__ void hipRowLogSumExp(const T* row, uint32_t classes,
+        T* shared, T& rowMax, T& sum) {
+    uint32_t tid = threadIdx.x;
+    T value = row[0];
+    for (uint32_t i = tid; i < classes; i += blockDim.x)
+        value = row[i] > value ? row[i] : value;
+    shared[tid] = value;
+    __syncthreads();
+    for (uint32_t s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (tid < s && shared[tid + s] > shared[tid])
+            shared[tid] = shared[tid + s];
+        __syncthreads();
+    }
+    rowMax = shared[0];
+    __syncthreads();
+
+    value = T(0);
+    for (uint32_t i = tid; i < classes; i += blockDim.x)
+        value += exp(row[i] - rowMax);
+    sum = hipBlockSum(value, shared);
+}
+
+__device__ inline bool hipLabelValid(int label, uint32_t classes) {
+    return label >= 0 && uint32_t(label) < classes;
+}
+
+// One block per sample writes its loss, NaN for an invalid label
+template<typename T>
+__global__ void hipCrossEntropyForwardKernel(uint32_t classes,
+        const T* x, const int* labels, T* losses) {
+    __shared__ T shared[CE_BLOCK];
+    const T* row = x + size_t(blockIdx.x) * classes;
+    T rowMax, sum;
+    hipRowLogSumExp(row, classes, shared, rowMax, sum);
+    if (threadIdx.x == 0) {
+        int label = labels[blockIdx.x];
+        losses[blockIdx.x] = hipLabelValid(label, classes) ?
+            rowMax + log(sum) - row[label] : T(NAN);
+    }
+}
+
+// One block sums the losses of the samples, the same way on every run
+template<typename T>
+__global__ void hipCrossEntropySumKernel(uint32_t batch, T scale,
+        const T* losses, T* loss) {
+    __shared__ T shared[CE_BLOCK];
+    T value = T(0);
+    for (uint32_t i = threadIdx.x; i < batch; i += blockDim.x)
+        value += losses[i];
+    value = hipBlockSum(value, shared);
+    if (threadIdx.x == 0)
+        loss[0] = value * scale;
+}
+
+template<typename T>
+__global__ void hipCrossEntropyBackwardKernel(uint32_t classes, T scale,
+        const T* x, const int* labels, const T* dloss, T* dx) {
+    __shared__ T shared[CE_BLOCK];
+    const T* row = x + size_t(blockIdx.x) * classes;
+    T* dst = dx + size_t(blockIdx.x) * classes;
+    T rowMax, sum;
+    hipRowLogSumExp(row, classes, shared, rowMax, sum);
+    T grad = dloss[0] * scale;
+    int label = labels[blockIdx.x];
+    bool valid = hipLabelValid(label, classes);
+    for (uint32_t i = threadIdx.x; i < classes; i += blockDim.x) {
+        T prob = exp(row[i] - rowMax) / sum;
+        dst[i] = valid ? (int(i) == label ? prob - T(1) : prob) * grad :
+            T(NAN);
+    }
+}
+#endif
+
+// Max of a row and the sum of exp(x - max) over it
+template<typename T>
+static void hostRowLogSumExp(const T* row, int classes, T& rowMax, T& sum) {
+    rowMax = *std::max_element(row, row + classes);
+    sum = T(0);
+    for (int i = 0; i < classes; i++)
+        sum += std::exp(row[i] - rowMax);
+}
+
+static void checkCrossEntropyShapes(const std::vector<int>& xDims,
+        const Tensor<int>& labels) {
+    CHECK_ARGS(xDims.size() >= 2 && labels.size() == xDims[0],
+            "Tensor shapes do not match the cross entropy!");
+}
+
+template<typename T>
+void CrossEntropyOp<T>::CrossEntropyForward(ExecContext& handle,
+        const Tensor<T>& x, const Tensor<int>& labels, Tensor<T>& loss){
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, labels);
+    CHECK_BACKEND(handle, loss);
+    checkCrossEntropyShapes(x.dims(), labels);
+    CHECK_ARGS(loss.size() == 1, "Cross entropy loss is a scalar!");
+    runOp(handle, [&handle, &x, &labels, &loss] {
+        int batch = x.dim(0);
+        int classes = x.size() / batch;
+        T scale = T(1) / batch;
+
+        if (handle.backend() == Backend::Host) {
+            HostHandle& hostHandle = static_cast<HostHandle&>(handle);
+            T* losses = static_cast<T*>(hostHandle.workspace().borrow(
+                    batch * sizeof(T)));
+            hostHandle.threadPool().parallelFor(batch,
+                    [&](size_t begin, size_t end) {
+                for (size_t n = begin; n < end; n++) {
+                    const T* row = x.data() + n * classes;
+                    int label = labels.data()[n];
+                    CHECK_ARGS(label >= 0 && label < classes,
+                            "Label out of range!");
+                    T rowMax, sum;
+                    hostRowLogSumExp(row, classes, rowMax, sum);
+                    losses[n] = rowMax + std::log(sum) - row[label];
+                }
+            });
+            T total = T(0);
+            for (int n = 0; n < batch; n++)
+                total += losses[n];
+            loss.data()[0] = total * scale;
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+        T* losses = static_cast<T*>(hipHandle.workspace().borrow(
+                batch * sizeof(T)));
+        hipLaunchKernelGGL((hipCrossEntropyForwardKernel<T>),
+                dim3(batch), dim3(CE_BLOCK), 0, hipHandle.stream(),
+                uint32_t(classes), x.data(), labels.data(), losses);
+        hipLaunchKernelGGL((hipCrossEntropySumKernel<T>),
+                dim3(1), dim3(CE_BLOCK), 0, hipHandle.stream(),
+                uint32_t(batch), scale, losses, loss.data());
+#endif
+    }, &x, &labels, &loss);
+}
+
+template<typename T>
+void CrossEntropyOp<T>::CrossEntropyBackward(ExecContext& handle,
+        const Tensor<T>& x, const Tensor<int>& labels,
+        const Tensor<T>& dloss, Tensor<T>& dx){
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, labels);
+    CHECK_BACKEND(handle, dloss);
+    CHECK_BACKEND(handle, dx);
+    checkCrossEntropyShapes(x.dims(), labels);
+    CHECK_ARGS(dx.size() == x.size() && dloss.size() == 1,
+            "Tensor shapes do not match the cross entropy!");
+    runOp(handle, [&handle, &x, &labels, &dloss, &dx] {
+        int batch = x.dim(0);
+        int classes = x.size() / batch;
+        T scale = T(1) / batch;
+
+        if (handle.backend() == Backend::Host) {
+            T grad = dloss.data()[0] * scale;
+            static_cast<HostHandle&>(handle).threadPool().parallelFor(batch,
+                    [&](size_t begin, size_t end) {
+                for (size_t n = begin; n < end; n++) {
+                    const T* row = x.data() + n * classes;
+                    T* dst = dx.data() + n * classes;
+                    int label = labels.data()[n];
+                    CHECK_ARGS(label >= 0 && label < classes,
+                            "Label out of range!");
+                    T rowMax, sum;
+                    hostRowLogSumExp(row, classes, rowMax, sum);
+                    for (int i = 0; i < classes; i++)
+                        dst[i] = std::exp(row[i] - rowMax) / sum * grad;
+                    dst[label] -= grad;
+                }
+            });
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+        hipLaunchKernelGGL((hipCrossEntropyBackwardKernel<T>),
+                dim3(batch), dim3(CE_BLOCK), 0, hipHandle.stream(),
+                uint32_t(classes), scale, x.data(), labels.data(),
+                dloss.data(), dx.data());
+#endif
+    }, &x, &labels, &dloss, &dx);
+}
+
+template class CrossEntropyOp<float>;
@@ -2,7 +2,7 @@
 
 // Deconvolution Ops
 template<typename T>
-void DeconvolutionOp<T>::DeconvForward(HipHandle& handle,
+void DeconvolutionOp<T>::DeconvForward(ExecContext& handle,
         ConvDescriptor& convSpec,
         const Tensor<T>& x, const Tensor<T>& w,
         const Tensor<T>* bias, Tensor<T>& y){
@@ -14,7 +14,7 @@ void DeconvolutionOp<T>::DeconvForward(HipHandle& handle,
 }
 
 template<typename T>
-void DeconvolutionOp<T>::DeconvBackwardWeight(HipHandle& handle,
+void DeconvolutionOp<T>::DeconvBackwardWeight(ExecContext& handle,
         ConvDescriptor& convSpec,
         const Tensor<T>& dy, const Tensor<T>& x,
         Tensor<T>& dw, Tensor<T>* dbias){
@@ -26,7 +26,7 @@ void DeconvolutionOp<T>::DeconvBackwardWeight(HipHandle& handle,
 }
 
 template<typename T>
-void DeconvolutionOp<T>::DeconvBackwardData(HipHandle& handle,
+void DeconvolutionOp<T>::DeconvBackwardData(ExecContext& handle,
         ConvDescriptor& convSpec, const Tensor<T>& dy,
         const Tensor<T>& w, Tensor<T>& dx){
     CHECK_ARGS(convSpec.mode == "deconv",
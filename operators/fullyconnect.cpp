@@ -1,93 +1,306 @@
 #include "test_operators.hpp"
 
+// dbias is summed in two levels: blocks of rows into partial sums kept
+// in the workspace, then the partials. Blocks are FC_BIAS_ROWS rows by
+// FC_BIAS_COLS outputs so every load of a row is coalesced.
+#define FC_BIAS_COLS 32
+#define FC_BIAS_ROWS 8
+// Rows per block of the first level and the most partials per output
+#define FC_BIAS_CHUNK 256
+#define FC_BIAS_MAX_CHUNKS 256
+
+#ifndef USE_HOST_ONLY
+// Fills y with the bias so the GEMM adds onto it with beta = 1
 template<typename T>
-__global__ void hipFullyConnectForwardBiasKernel(
+__global__ void hipFullyConnectBiasBroadcastKernel(
         uint32_t m, uint32_t n, const T *bias, T *y) {
-    size_t i = HIP_GETTID();
-    if (i >= n) return;
+    size_t total = size_t(m) * n;
+    size_t step = size_t(gridDim.x) * blockDim.x;
+    for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < total;
+            i += step)
+        y[i] = bias[i % n];
+}
+
+// Activation of y in place after the GEMM
+template<typename T>
+__global__ void hipFullyConnectActivationKernel(size_t total,
+        HostActivation activation, T alpha, T *y) {
+    size_t step = size_t(gridDim.x) * blockDim.x;
+    for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < total;
+            i += step) {
+        T value = y[i];
+        if (activation == HostActivation::LeakyRelu)
+            value = value > T(0) ? value : alpha * value;
+        else if (activation != HostActivation::None)
+            value = value > T(0) ? value : T(0);
+        if (activation == HostActivation::ClippedRelu && value > alpha)
+            value = alpha;
+        y[i] = value;
+    }
+}
+
+// Sums rows [blockIdx.y * rowsPerBlock, +rowsPerBlock) of dy into row
+// blockIdx.y of partial
+template<typename T>
+__global__ void hipFullyConnectBackwardBiasKernel(uint32_t m, uint32_t n,
+        uint32_t rowsPerBlock, const T *dy, T *partial) {
+    __shared__ T sums[FC_BIAS_ROWS][FC_BIAS_COLS + 1];
+    uint32_t tx = threadIdx.x, ty = threadIdx.y;
+    uint32_t i = blockIdx.x * FC_BIAS_COLS + tx;
+    uint32_t begin = blockIdx.y * rowsPerBlock;
+    uint32_t end = begin + rowsPerBlock < m ? begin + rowsPerBlock : m;
 
-    for (uint32_t j = 0; j < m; ++j) {
-        y[j * n + i] += bias[i];
+    T sum = T(0);
+    if (i < n) {
+        for (uint32_t j = begin + ty; j < end; j += FC_BIAS_ROWS)
+            sum += dy[size_t(j) * n + i];
     }
+    sums[ty][tx] = sum;
+    __syncthreads();
+    for (uint32_t s = FC_BIAS_ROWS / 2; s > 0; s >>= 1) {
+        if (ty < s) sums[ty][tx] += sums[ty + s][tx];
+        __syncthreads();
+    }
+    if (ty == 0 && i < n)
+        partial[size_t(blockIdx.y) * n + i] = sums[0][tx];
 }
 
 template<typename T>
-__global__ void hipFullyConnectBackwardBiasKernel(
+static void hipFullyConnectBackwardBias(HipHandle& handle,
         uint32_t m, uint32_t n, const T *dy, T *dbias) {
-    size_t i = HIP_GETTID();
-    if (i >= n) return;
+    dim3 blockSize(FC_BIAS_COLS, FC_BIAS_ROWS);
+    uint32_t colBlocks = (n + FC_BIAS_COLS - 1) / FC_BIAS_COLS;
+    uint32_t chunks = std::min<uint32_t>(FC_BIAS_MAX_CHUNKS,
+            (m + FC_BIAS_CHUNK - 1) / FC_BIAS_CHUNK);
+    if (!handle.workspace().fits(size_t(chunks) * n * sizeof(T)))
+        chunks = 1;
+    uint32_t rowsPerBlock = (m + chunks - 1) / chunks;
+    T* partial = chunks == 1 ? dbias : static_cast<T*>(
+            handle.workspace().borrow(size_t(chunks) * n * sizeof(T)));
+
+    hipLaunchKernelGGL((hipFullyConnectBackwardBiasKernel<T>),
+            dim3(colBlocks, chunks), blockSize, 0, handle.stream(),
+            m, n, rowsPerBlock, dy, partial);
+    if (chunks == 1) return;
+    hipLaunchKernelGGL((hipFullyConnectBackwardBiasKernel<T>),
+            dim3(colBlocks, 1), blockSize, 0, handle.stream(),
+            chunks, n, chunks, static_cast<const T*>(partial), dbias);
+}
+#endif
 
-    dbias[i] = T(0);
-    for (uint32_t j = 0; j < m; ++j) {
-        dbias[i] += dy[j * n + i];
+// One partial row per task, then a pass over the outputs
+template<typename T>
+static void hostFullyConnectBackwardBias(HostHandle& handle,
+        uint32_t m, uint32_t n, const T *dy, T *dbias) {
+    ThreadPool& pool = handle.threadPool();
+    size_t chunks = std::min<size_t>(pool.size(),
+            (m + FC_BIAS_CHUNK - 1) / FC_BIAS_CHUNK);
+    if (!handle.workspace().fits(chunks * n * sizeof(T)))
+        chunks = 1;
+    if (chunks <= 1) {
+        pool.parallelFor(n, [&](size_t begin, size_t end) {
+            std::fill(dbias + begin, dbias + end, T(0));
+            for (uint32_t j = 0; j < m; ++j) {
+                for (size_t i = begin; i < end; ++i)
+                    dbias[i] += dy[j * n + i];
+            }
+        });
+        return;
     }
+
+    T* partial = static_cast<T*>(
+            handle.workspace().borrow(chunks * n * sizeof(T)));
+    pool.parallelFor(chunks, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            T* sum = partial + c * n;
+            std::fill(sum, sum + n, T(0));
+            for (size_t j = c * m / chunks; j < (c + 1) * m / chunks; ++j) {
+                for (uint32_t i = 0; i < n; ++i)
+                    sum[i] += dy[j * n + i];
+            }
+        }
+    });
+    pool.parallelFor(n, [&](size_t begin, size_t end) {
+        std::fill(dbias + begin, dbias + end, T(0));
+        for (size_t c = 0; c < chunks; c++) {
+            for (size_t i = begin; i < end; ++i)
+                dbias[i] += partial[c * n + i];
+        }
+    });
+}
+
+// Elements past the first dim of every shape, the inputs of x and w and
+// the outputs of y
+static int fullyConnectWidth(const std::vector<int>& dims) {
+    return std::accumulate(dims.begin() + 1, dims.end(),
+            1, std::multiplies<int>());
+}
+
+// x is {batch, inputs...}, w {outputs, inputs...} and y {batch, outputs...}
+template <typename T>
+FullyConnectPlan<T> FullyConnectOp<T>::Prepare(ExecContext& handle,
+        const std::vector<int>& xDims, const std::vector<int>& wDims,
+        const std::vector<int>& yDims){
+    CHECK_ARGS(xDims.size() >= 2 && wDims.size() >= 2 && yDims.size() >= 2,
+            "Invalid shapes for fully connected layer!");
+    CHECK_ARGS(fullyConnectWidth(wDims) == fullyConnectWidth(xDims) &&
+            yDims[0] == xDims[0] && fullyConnectWidth(yDims) == wDims[0],
+            "Tensor shapes do not match the fully connected layer!");
+    return FullyConnectPlan<T>(handle, xDims, wDims, yDims);
+}
+
+template <typename T>
+void FullyConnectPlan<T>::Forward(const Tensor<T>& x, const Tensor<T>& w,
+        const Tensor<T>* bias, Tensor<T>& y) const {
+    CHECK_ARGS(x.dims() == xDims_ && w.dims() == wDims_ &&
+            y.dims() == yDims_, "Tensor shapes do not match the plan!");
+    FullyConnectOp<T>::FullyConnectForward(*handle_, x, w, bias, y);
+}
+
+template <typename T>
+void FullyConnectPlan<T>::Forward(const Tensor<T>& x, const Tensor<T>& w,
+        const Tensor<T>* bias, const ActivationDescriptor& activation,
+        Tensor<T>& y) const {
+    CHECK_ARGS(x.dims() == xDims_ && w.dims() == wDims_ &&
+            y.dims() == yDims_, "Tensor shapes do not match the plan!");
+    FullyConnectOp<T>::RunForward(*handle_, x, w, bias, &activation, y);
+}
+
+template <typename T>
+void FullyConnectPlan<T>::BackwardWeight(const Tensor<T>& dy,
+        const Tensor<T>& x, Tensor<T>& dw, Tensor<T>* dbias) const {
+    CHECK_ARGS(x.dims() == xDims_ && dw.dims() == wDims_ &&
+            dy.dims() == yDims_, "Tensor shapes do not match the plan!");
+    FullyConnectOp<T>::FullyConnectBackwardWeight(*handle_, dy, x, dw, dbias);
+}
+
+template <typename T>
+void FullyConnectPlan<T>::BackwardData(const Tensor<T>& dy,
+        const Tensor<T>& w, Tensor<T>& dx) const {
+    CHECK_ARGS(dx.dims() == xDims_ && w.dims() == wDims_ &&
+            dy.dims() == yDims_, "Tensor shapes do not match the plan!");
+    FullyConnectOp<T>::FullyConnectBackwardData(*handle_, dy, w, dx);
 }
 
 // FullyConnect Ops
 template <typename T>
-void FullyConnectOp<T>::FullyConnectForward(HipHandle& handle,
+void FullyConnectOp<T>::FullyConnectForward(ExecContext& handle,
         const Tensor<T>& x, const Tensor<T>& w,
         const Tensor<T>* bias, Tensor<T>& y){
-    const T alpha = 1.0;
-    const T beta = 0.0;
-
-    int M = x.dim(0);
-    int K = x.size() / x.dim(0);
-    int N = w.dim(0);
-
-    OperatorsFunc<T>::gemmImpl(handle, BLAS_OP_T, BLAS_OP_N,
-            N, M, K, alpha, w, x, beta, y);
-
-    if (bias) {
-        size_t blockSize = 256;
-        size_t gridSize = (N + 255) / 256;
-        hipLaunchKernelGGL((hipFullyConnectForwardBiasKernel<T>),
-                dim3(gridSize), dim3(blockSize), 0, handle.stream(),
-                uint32_t(M), uint32_t(N), bias->data(), y.data());
-    }
-    handle.streamSynchronize();
+    RunForward(handle, x, w, bias, nullptr, y);
 }
 
 template <typename T>
-void FullyConnectOp<T>::FullyConnectBackwardWeight(HipHandle& handle,
+void FullyConnectOp<T>::RunForward(ExecContext& handle,
+        const Tensor<T>& x, const Tensor<T>& w, const Tensor<T>* bias,
+        const ActivationDescriptor* activation, Tensor<T>& y){
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, w);
+    CHECK_BACKEND(handle, y);
+    if (bias) CHECK_BACKEND(handle, *bias);
+    HostActivation activ = activation != nullptr ?
+        hostActivation(*activation) : HostActivation::None;
+    T activAlpha = activation != nullptr ? T(activation->alpha) : T(0);
+    runOp(handle, [&handle, &x, &w, bias, activ, activAlpha, &y] {
+        const T alpha = 1.0;
+        const T beta = 0.0;
+
+        int M = x.dim(0);
+        int K = x.size() / x.dim(0);
+        int N = w.dim(0);
+
+        // The bias is added as the GEMM stores y, by the epilogue on the
+        // host and by starting from the broadcast bias with beta = 1 on HIP
+        if (handle.backend() == Backend::Host) {
+            GemmEpilogue<T> epilogue;
+            epilogue.bias = bias ? bias->data() : nullptr;
+            epilogue.biasPerRow = true;
+            epilogue.activation = activ;
+            epilogue.alpha = activAlpha;
+            bool fused = bias != nullptr || activ != HostActivation::None;
+            HostFunc<T>::gemm(&static_cast<HostHandle&>(handle).threadPool(),
+                    BLAS_OP_T, BLAS_OP_N, N, M, K, alpha, w.data(), K,
+                    x.data(), K, beta, y.data(), N,
+                    fused ? &epilogue : nullptr);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        if (bias) {
+            size_t blockSize = 256;
+            size_t gridSize = std::min<size_t>(
+                    (size_t(M) * N + blockSize - 1) / blockSize, 1024);
+            hipLaunchKernelGGL((hipFullyConnectBiasBroadcastKernel<T>),
+                    dim3(gridSize), dim3(blockSize), 0,
+                    static_cast<HipHandle&>(handle).stream(),
+                    uint32_t(M), uint32_t(N), bias->data(), y.data());
+        }
+        OperatorsFunc<T>::gemmImpl(handle, BLAS_OP_T, BLAS_OP_N,
+                N, M, K, alpha, w, x, bias ? T(1) : beta, y);
+        if (activ != HostActivation::None) {
+            size_t blockSize = 256;
+            size_t gridSize = std::min<size_t>(
+                    (size_t(M) * N + blockSize - 1) / blockSize, 1024);
+            hipLaunchKernelGGL((hipFullyConnectActivationKernel<T>),
+                    dim3(gridSize), dim3(blockSize), 0,
+                    static_cast<HipHandle&>(handle).stream(),
+                    size_t(M) * N, activ, activAlpha, y.data());
+        }
+#endif
+    }, &x, &w, bias, &y);
+}
+
+template <typename T>
+void FullyConnectOp<T>::FullyConnectBackwardWeight(ExecContext& handle,
         const Tensor<T>& dy, const Tensor<T>& x,
         Tensor<T>& dw, Tensor<T>* dbias){
-    const T alpha = 1.0;
-    const T beta = 0.0;
+    CHECK_BACKEND(handle, dy);
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, dw);
+    if (dbias) CHECK_BACKEND(handle, *dbias);
+    runOp(handle, [&handle, &dy, &x, &dw, dbias] {
+        const T alpha = 1.0;
+        const T beta = 0.0;
 
-    int M = x.dim(0);
-    int K = x.size() / x.dim(0);
-    int N = dw.dim(0);
+        int M = x.dim(0);
+        int K = x.size() / x.dim(0);
+        int N = dw.dim(0);
 
-    OperatorsFunc<T>::gemmImpl(handle, BLAS_OP_N, BLAS_OP_T,
-            K, N, M, alpha, x, dy, beta, dw);
+        OperatorsFunc<T>::gemmImpl(handle, BLAS_OP_N, BLAS_OP_T,
+                K, N, M, alpha, x, dy, beta, dw);
+        if (!dbias) return;
 
-    if (dbias) {
         uint32_t m = dy.dim(0);
         uint32_t n = dy.dim(1);
-        size_t blockSize = 256;
-        size_t gridSize = (n + 255) / 256;
-
-        hipLaunchKernelGGL((hipFullyConnectBackwardBiasKernel<T>),
-                dim3(gridSize), dim3(blockSize), 0, handle.stream(),
-                m, n, dy.data(), dbias->data());
-    }
-    handle.streamSynchronize();
+        if (handle.backend() == Backend::Host) {
+            hostFullyConnectBackwardBias(static_cast<HostHandle&>(handle),
+                    m, n, dy.data(), dbias->data());
+        } else {
+#ifndef USE_HOST_ONLY
+            hipFullyConnectBackwardBias(static_cast<HipHandle&>(handle),
+                    m, n, dy.data(), dbias->data());
+#endif
+        }
+    }, &dy, &x, &dw, dbias);
 }
 
 template <typename T>
-void FullyConnectOp<T>::FullyConnectBackwardData(HipHandle& handle,
+void FullyConnectOp<T>::FullyConnectBackwardData(ExecContext& handle,
         const Tensor<T>& dy, const Tensor<T>& w, Tensor<T>& dx){
-    const T alpha = 1.0;
-    const T beta = 0.0;
+    CHECK_BACKEND(handle, dy);
+    CHECK_BACKEND(handle, w);
+    CHECK_BACKEND(handle, dx);
+    runOp(handle, [&handle, &dy, &w, &dx] {
+        const T alpha = 1.0;
+        const T beta = 0.0;
 
-    int M = dx.dim(0);
-    int K = dx.size() / dx.dim(0);
-    int N = w.dim(0);
+        int M = dx.dim(0);
+        int K = dx.size() / dx.dim(0);
+        int N = w.dim(0);
 
-    OperatorsFunc<T>::gemmImpl(handle, BLAS_OP_N, BLAS_OP_N,
-            K, M, N, alpha, w, dy, beta, dx);
-    handle.streamSynchronize();
+        OperatorsFunc<T>::gemmImpl(handle, BLAS_OP_N, BLAS_OP_N,
+                K, M, N, alpha, w, dy, beta, dx);
+    }, &dy, &w, &dx);
 }
 
+template class FullyConnectPlan<float>;
 template class FullyConnectOp<float>;
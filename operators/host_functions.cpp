@@ -0,0 +1,431 @@
+#include "test_operators.hpp"
+
+template<typename T>
+void HostFunc<T>::im2col(const HostConvShape& shape, const T* im, T* col) {
+    int channels = shape.imChannels / shape.group;
+    int cols = shape.colCols();
+    for (int c = 0; c < channels; c++) {
+        for (int kh = 0; kh < shape.kernelH; kh++) {
+            for (int kw = 0; kw < shape.kernelW; kw++) {
+                int row = (c * shape.kernelH + kh) * shape.kernelW + kw;
+                T* dst = col + static_cast<size_t>(row) * cols;
+                const T* src = im + static_cast<size_t>(c) *
+                    shape.imH * shape.imW;
+                for (int oh = 0; oh < shape.outH; oh++) {
+                    int ih = oh * shape.strideH - shape.padH +
+                        kh * shape.dilationH;
+                    T* dstRow = dst + oh * shape.outW;
+                    if (ih < 0 || ih >= shape.imH) {
+                        std::fill(dstRow, dstRow + shape.outW, T(0));
+                        continue;
+                    }
+                    const T* srcRow = src + ih * shape.imW;
+                    for (int ow = 0; ow < shape.outW; ow++) {
+                        int iw = ow * shape.strideW - shape.padW +
+                            kw * shape.dilationW;
+                        dstRow[ow] = (iw < 0 || iw >= shape.imW) ?
+                            T(0) : srcRow[iw];
+                    }
+                }
+            }
+        }
+    }
+}
+
+template<typename T>
+void HostFunc<T>::col2im(const HostConvShape& shape, const T* col, T* im) {
+    int channels = shape.imChannels / shape.group;
+    int cols = shape.colCols();
+    for (int c = 0; c < channels; c++) {
+        for (int kh = 0; kh < shape.kernelH; kh++) {
+            for (int kw = 0; kw < shape.kernelW; kw++) {
+                int row = (c * shape.kernelH + kh) * shape.kernelW + kw;
+                const T* src = col + static_cast<size_t>(row) * cols;
+                T* dst = im + static_cast<size_t>(c) *
+                    shape.imH * shape.imW;
+                for (int oh = 0; oh < shape.outH; oh++) {
+                    int ih = oh * shape.strideH - shape.padH +
+                        kh * shape.dilationH;
+                    if (ih < 0 || ih >= shape.imH) continue;
+                    const T* srcRow = src + oh * shape.outW;
+                    T* dstRow = dst + ih * shape.imW;
+                    for (int ow = 0; ow < shape.outW; ow++) {
+                        int iw = ow * shape.strideW - shape.padW +
+                            kw * shape.dilationW;
+                        if (iw >= 0 && iw < shape.imW)
+                            dstRow[iw] += srcRow[ow];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Images are spread over the threads when there are enough of them,
+// otherwise each image runs one after another on the threaded GEMM.
+static bool useImageParallel(ThreadPool& pool, const HostConvShape& shape) {
+    return pool.size() > 1 && shape.batch >= pool.size();
+}
+
+template<typename T>
+size_t HostFunc<T>::convWorkspaceSize(ThreadPool& pool,
+        const HostConvShape& shape, bool backwardWeight, bool parallel) {
+    size_t col = shape.isPointwise() ? 0 :
+        static_cast<size_t>(shape.colRows()) * shape.colCols();
+    if (!parallel || !useImageParallel(pool, shape))
+        return col;
+    size_t partials = backwardWeight ? static_cast<size_t>(shape.outChannels)
+        * shape.colRows() * (pool.size() - 1) : 0;
+    return col * pool.size() + partials;
+}
+
+template<typename T>
+void HostFunc<T>::convForward(ThreadPool& pool, const HostConvShape& shape,
+        const T* im, const T* w, T* out,
+        T* workspace, size_t workspaceSize,
+        const GemmEpilogue<T>* epilogue) {
+    int groupIm = shape.imChannels / shape.group * shape.imH * shape.imW;
+    int groupOut = shape.outChannels / shape.group;
+    size_t rows = shape.colRows(), cols = shape.colCols();
+    size_t groupW = groupOut * rows;
+    bool pointwise = shape.isPointwise();
+    size_t colSize = pointwise ? 0 : rows * cols;
+    CHECK_ARGS(workspaceSize >= colSize, "Workspace is too small!");
+
+    auto runImage = [&](ThreadPool* gemmPool, int n, T* col) {
+        for (int g = 0; g < shape.group; g++) {
+            const T* imG = im + static_cast<size_t>(n) * shape.imSize() +
+                static_cast<size_t>(g) * groupIm;
+            T* outG = out + static_cast<size_t>(n) * shape.outSize() +
+                static_cast<size_t>(g) * groupOut * cols;
+            const T* colG = imG;
+            if (!pointwise) {
+                im2col(shape, imG, col);
+                colG = col;
+            }
+            // The columns of a group's output are its channels
+            GemmEpilogue<T> groupEpilogue;
+            if (epilogue)
+                groupEpilogue = epilogue->offset(0, g * groupOut);
+            gemm(gemmPool, BLAS_OP_N, BLAS_OP_N, cols, groupOut, rows,
+                    T(1), colG, cols, w + g * groupW, rows,
+                    T(0), outG, cols, epilogue ? &groupEpilogue : nullptr);
+        }
+    };
+
+    if (useImageParallel(pool, shape) &&
+            workspaceSize >= convWorkspaceSize(pool, shape, false, true)) {
+        pool.run([&](int tid) {
+            for (int n = tid; n < shape.batch; n += pool.size())
+                runImage(nullptr, n, workspace + tid * colSize);
+        });
+    } else {
+        for (int n = 0; n < shape.batch; n++)
+            runImage(&pool, n, workspace);
+    }
+}
+
+template<typename T>
+void HostFunc<T>::convBackwardData(ThreadPool& pool,
+        const HostConvShape& shape, const T* out, const T* w, T* im,
+        T* workspace, size_t workspaceSize) {
+    int groupIm = shape.imChannels / shape.group * shape.imH * shape.imW;
+    int groupOut = shape.outChannels / shape.group;
+    size_t rows = shape.colRows(), cols = shape.colCols();
+    size_t groupW = groupOut * rows;
+    bool pointwise = shape.isPointwise();
+    size_t colSize = pointwise ? 0 : rows * cols;
+    CHECK_ARGS(workspaceSize >= colSize, "Workspace is too small!");
+
+    auto runImage = [&](ThreadPool* gemmPool, int n, T* col) {
+        T* imN = im + static_cast<size_t>(n) * shape.imSize();
+        if (!pointwise)
+            std::fill(imN, imN + shape.imSize(), T(0));
+        for (int g = 0; g < shape.group; g++) {
+            T* imG = imN + static_cast<size_t>(g) * groupIm;
+            const T* outG = out + static_cast<size_t>(n) * shape.outSize() +
+                static_cast<size_t>(g) * groupOut * cols;
+            T* colG = pointwise ? imG : col;
+            gemm(gemmPool, BLAS_OP_N, BLAS_OP_T, cols, rows, groupOut,
+                    T(1), outG, cols, w + g * groupW, rows,
+                    T(0), colG, cols);
+            if (!pointwise)
+                col2im(shape, colG, imG);
+        }
+    };
+
+    if (useImageParallel(pool, shape) &&
+            workspaceSize >= convWorkspaceSize(pool, shape, false, true)) {
+        pool.run([&](int tid) {
+            for (int n = tid; n < shape.batch; n += pool.size())
+                runImage(nullptr, n, workspace + tid * colSize);
+        });
+    } else {
+        for (int n = 0; n < shape.batch; n++)
+            runImage(&pool, n, workspace);
+    }
+}
+
+template<typename T>
+void HostFunc<T>::convBackwardWeight(ThreadPool& pool,
+        const HostConvShape& shape, const T* out, const T* im, T* dw,
+        T* workspace, size_t workspaceSize) {
+    int groupIm = shape.imChannels / shape.group * shape.imH * shape.imW;
+    int groupOut = shape.outChannels / shape.group;
+    size_t rows = shape.colRows(), cols = shape.colCols();
+    size_t groupW = groupOut * rows;
+    size_t dwSize = groupW * shape.group;
+    bool pointwise = shape.isPointwise();
+    size_t colSize = pointwise ? 0 : rows * cols;
+    CHECK_ARGS(workspaceSize >= colSize, "Workspace is too small!");
+
+    auto runImage = [&](ThreadPool* gemmPool, int n, T* col,
+            T* dwAcc, T beta) {
+        for (int g = 0; g < shape.group; g++) {
+            const T* imG = im + static_cast<size_t>(n) * shape.imSize() +
+                static_cast<size_t>(g) * groupIm;
+            const T* outG = out + static_cast<size_t>(n) * shape.outSize() +
+                static_cast<size_t>(g) * groupOut * cols;
+            const T* colG = imG;
+            if (!pointwise) {
+                im2col(shape, imG, col);
+                colG = col;
+            }
+            gemm(gemmPool, BLAS_OP_T, BLAS_OP_N, rows, groupOut, cols,
+                    T(1), colG, cols, outG, cols,
+                    beta, dwAcc + g * groupW, rows);
+        }
+    };
+
+    if (shape.batch == 0) {
+        std::fill(dw, dw + dwSize, T(0));
+    } else if (useImageParallel(pool, shape) &&
+            workspaceSize >= convWorkspaceSize(pool, shape, true, true)) {
+        // Every thread accumulates its own images, partials are summed last
+        T* partials = workspace + colSize * pool.size();
+        pool.run([&](int tid) {
+            T* dwAcc = tid == 0 ? dw : partials + (tid - 1) * dwSize;
+            for (int n = tid; n < shape.batch; n += pool.size())
+                runImage(nullptr, n, workspace + tid * colSize, dwAcc,
+                        n == tid ? T(0) : T(1));
+        });
+        pool.parallelFor(dwSize, [&](size_t begin, size_t end) {
+            for (int t = 1; t < pool.size(); t++) {
+                const T* part = partials + (t - 1) * dwSize;
+                for (size_t i = begin; i < end; i++)
+                    dw[i] += part[i];
+            }
+        });
+    } else {
+        for (int n = 0; n < shape.batch; n++)
+            runImage(&pool, n, workspace, dw, n == 0 ? T(0) : T(1));
+    }
+}
+
+template<typename T>
+void HostFunc<T>::convForwardDirect(ThreadPool& pool,
+        const HostConvShape& shape, const T* im, const T* w, T* out,
+        const GemmEpilogue<T>* epilogue) {
+    int channels = shape.imChannels / shape.group;
+    int groupOut = shape.outChannels / shape.group;
+    size_t imPlane = static_cast<size_t>(shape.imH) * shape.imW;
+    size_t outPlane = static_cast<size_t>(shape.outH) * shape.outW;
+    int kernel = shape.kernelH * shape.kernelW;
+
+    pool.parallelFor(static_cast<size_t>(shape.batch) * shape.outChannels,
+            [&](size_t begin, size_t end) {
+        for (size_t plane = begin; plane < end; plane++) {
+            int n = plane / shape.outChannels;
+            int oc = plane % shape.outChannels;
+            int g = oc / groupOut;
+            T* dst = out + plane * outPlane;
+            std::fill(dst, dst + outPlane, T(0));
+            for (int c = 0; c < channels; c++) {
+                const T* src = im + (static_cast<size_t>(n) *
+                    shape.imChannels + g * channels + c) * imPlane;
+                const T* weights = w + (static_cast<size_t>(oc) *
+                    channels + c) * kernel;
+                for (int kh = 0; kh < shape.kernelH; kh++) {
+                    for (int kw = 0; kw < shape.kernelW; kw++) {
+                        T weight = weights[kh * shape.kernelW + kw];
+                        // Output columns that read inside the image
+                        int offW = kw * shape.dilationW - shape.padW;
+                        int owBegin = offW >= 0 ? 0 :
+                            (shape.strideW - 1 - offW) / shape.strideW;
+                        int owEnd = shape.imW - offW <= 0 ? 0 :
+                            std::min(shape.outW, (shape.imW - 1 - offW) /
+                            shape.strideW + 1);
+                        for (int oh = 0; oh < shape.outH; oh++) {
+                            int ih = oh * shape.strideH - shape.padH +
+                                kh * shape.dilationH;
+                            if (ih < 0 || ih >= shape.imH) continue;
+                            const T* srcRow = src + ih * shape.imW;
+                            T* dstRow = dst + oh * shape.outW;
+                            for (int ow = owBegin; ow < owEnd; ow++)
+                                dstRow[ow] += weight *
+                                    srcRow[ow * shape.strideW + offW];
+                        }
+                    }
+                }
+            }
+            if (epilogue) {
+                for (size_t i = 0; i < outPlane; i++)
+                    dst[i] = epilogue->apply(dst[i], i, oc);
+            }
+        }
+    });
+}
+
+template<typename T>
+bool HostFunc<T>::winogradApplies(const HostConvShape& shape) {
+    return shape.group == 1 && shape.kernelH == 3 && shape.kernelW == 3 &&
+        shape.strideH == 1 && shape.strideW == 1 &&
+        shape.dilationH == 1 && shape.dilationW == 1;
+}
+
+// 2x2 output tiles of one image
+static size_t winogradTiles(const HostConvShape& shape) {
+    return static_cast<size_t>((shape.outH + 1) / 2) * ((shape.outW + 1) / 2);
+}
+
+template<typename T>
+size_t HostFunc<T>::winogradWorkspaceSize(const HostConvShape& shape) {
+    size_t K = shape.outChannels, C = shape.imChannels;
+    size_t P = winogradTiles(shape);
+    return 16 * (K * C + C * P + K * P);
+}
+
+// U = G g G^T for the weights, V = B^T d B for the 4x4 input tiles, then
+// 16 GEMMs M = U V over the channels and Y = A^T M A for the outputs.
+// U, V and M are stored as 16 matrices, one per element of the 4x4 tile.
+template<typename T>
+void HostFunc<T>::convForwardWinograd(ThreadPool& pool,
+        const HostConvShape& shape, const T* im, const T* w, T* out,
+        T* workspace, const GemmEpilogue<T>* epilogue) {
+    CHECK_ARGS(winogradApplies(shape), "Winograd does not apply!");
+    size_t K = shape.outChannels, C = shape.imChannels;
+    size_t P = winogradTiles(shape);
+    int tilesW = (shape.outW + 1) / 2;
+    T* U = workspace;
+    T* V = U + 16 * K * C;
+    T* M = V + 16 * C * P;
+
+    pool.parallelFor(K * C, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const T* g = w + i * 9;
+            T gg[4][3];
+            for (int j = 0; j < 3; j++) {
+                gg[0][j] = g[j];
+                gg[1][j] = (g[j] + g[3 + j] + g[6 + j]) / 2;
+                gg[2][j] = (g[j] - g[3 + j] + g[6 + j]) / 2;
+                gg[3][j] = g[6 + j];
+            }
+            for (int r = 0; r < 4; r++) {
+                T* u = U + r * 4 * K * C + i;
+                u[0] = gg[r][0];
+                u[K * C] = (gg[r][0] + gg[r][1] + gg[r][2]) / 2;
+                u[2 * K * C] = (gg[r][0] - gg[r][1] + gg[r][2]) / 2;
+                u[3 * K * C] = gg[r][2];
+            }
+        }
+    });
+
+    for (int n = 0; n < shape.batch; n++) {
+        const T* imN = im + static_cast<size_t>(n) * shape.imSize();
+        T* outN = out + static_cast<size_t>(n) * shape.outSize();
+        pool.parallelFor(C * P, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const T* src = imN + (i / P) * shape.imH * shape.imW;
+                int th = (i % P) / tilesW, tw = (i % P) % tilesW;
+                T d[4][4];
+                for (int r = 0; r < 4; r++) {
+                    int ih = 2 * th - shape.padH + r;
+                    for (int s = 0; s < 4; s++) {
+                        int iw = 2 * tw - shape.padW + s;
+                        d[r][s] = ih < 0 || ih >= shape.imH || iw < 0 ||
+                            iw >= shape.imW ? T(0) : src[ih * shape.imW + iw];
+                    }
+                }
+                T bd[4][4];
+                for (int s = 0; s < 4; s++) {
+                    bd[0][s] = d[0][s] - d[2][s];
+                    bd[1][s] = d[1][s] + d[2][s];
+                    bd[2][s] = d[2][s] - d[1][s];
+                    bd[3][s] = d[1][s] - d[3][s];
+                }
+                for (int r = 0; r < 4; r++) {
+                    T* v = V + r * 4 * C * P + i;
+                    v[0] = bd[r][0] - bd[r][2];
+                    v[C * P] = bd[r][1] + bd[r][2];
+                    v[2 * C * P] = bd[r][2] - bd[r][1];
+                    v[3 * C * P] = bd[r][1] - bd[r][3];
+                }
+            }
+        });
+
+        // Row-major M (K x P) = U (K x C) V (C x P) for each element
+        gemmBatched(&pool, BLAS_OP_N, BLAS_OP_N, P, K, C,
+                T(1), V, P, C * P, U, C, K * C, T(0), M, P, K * P, 16);
+
+        pool.parallelFor(K * P, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                size_t k = i / P;
+                T* dst = outN + k * shape.outH * shape.outW;
+                int th = (i % P) / tilesW, tw = (i % P) % tilesW;
+                T m[4][4];
+                for (int e = 0; e < 16; e++)
+                    m[e / 4][e % 4] = M[e * K * P + i];
+                T am[2][4];
+                for (int s = 0; s < 4; s++) {
+                    am[0][s] = m[0][s] + m[1][s] + m[2][s];
+                    am[1][s] = m[1][s] - m[2][s] - m[3][s];
+                }
+                for (int r = 0; r < 2; r++) {
+                    int oh = 2 * th + r;
+                    if (oh >= shape.outH) continue;
+                    T y[2] = {am[r][0] + am[r][1] + am[r][2],
+                        am[r][1] - am[r][2] - am[r][3]};
+                    for (int s = 0; s < 2; s++) {
+                        int ow = 2 * tw + s;
+                        if (ow >= shape.outW) continue;
+                        dst[oh * shape.outW + ow] = epilogue ?
+                            epilogue->apply(y[s], 0, k) : y[s];
+                    }
+                }
+            }
+        });
+    }
+}
+
+template<typename T>
+void HostFunc<T>::channelEpilogue(ThreadPool& pool,
+        int batch, int channels, int spatial,
+        const GemmEpilogue<T>& epilogue, T* y) {
+    pool.parallelFor(static_cast<size_t>(batch) * channels,
+            [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            T* dst = y + i * spatial;
+            for (int s = 0; s < spatial; s++)
+                dst[s] = epilogue.apply(dst[s], s, i % channels);
+        }
+    });
+}
+
+template<typename T>
+void HostFunc<T>::reduceChannelBias(ThreadPool& pool,
+        int batch, int channels, int spatial, const T* dy, T* dbias) {
+    pool.parallelFor(channels, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            T sum = T(0);
+            for (int n = 0; n < batch; n++) {
+                const T* src = dy + (static_cast<size_t>(n) * channels + c)
+                    * spatial;
+                for (int s = 0; s < spatial; s++)
+                    sum += src[s];
+            }
+            dbias[c] = sum;
+        }
+    });
+}
+
+template class HostFunc<float>;
@@ -0,0 +1,386 @@
+#include "test_operators.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HOST_GEMM_X86
+#endif
+
+// Cache blocking of the host GEMM: a KC x NC panel of B stays in L3, an
+// MC x KC block of A in L2, and an MR x NR tile of C in registers. MC and
+// NC are rounded down to multiples of the kernel's MR and NR.
+constexpr size_t GEMM_MC = 192;
+constexpr size_t GEMM_KC = 384;
+constexpr size_t GEMM_NC = 3072;
+// Below this many multiply-adds a gemm runs on the calling thread
+constexpr size_t GEMM_PARALLEL_MIN = size_t(1) << 21;
+
+template<typename T>
+struct GemmKernel {
+    const char* name;
+    size_t mr, nr;
+    // C[mr x nr] = alpha * a * b + beta * C, C is not read if beta == 0
+    void (*run)(size_t kc, const T* a, const T* b, T alpha, T beta,
+            T* C, size_t ldc, size_t mr, size_t nr);
+};
+
+template<typename T>
+static void gemmStoreTile(const T* tile, size_t ldt, T alpha, T beta,
+        T* C, size_t ldc, size_t mr, size_t nr) {
+    for (size_t j = 0; j < nr; j++) {
+        T* c = C + j * ldc;
+        const T* t = tile + j * ldt;
+        for (size_t i = 0; i < mr; i++)
+            c[i] = beta == T(0) ? alpha * t[i] : alpha * t[i] + beta * c[i];
+    }
+}
+
+template<typename T, size_t MR, size_t NR>
+static void gemmKernelGeneric(size_t kc, const T* a, const T* b,
+        T alpha, T beta, T* C, size_t ldc, size_t mr, size_t nr) {
+    T acc[NR * MR] = {};
+    for (size_t p = 0; p < kc; p++) {
+        for (size_t j = 0; j < NR; j++) {
+            T bv = b[j];
+            for (size_t i = 0; i < MR; i++)
+                acc[j * MR + i] += a[i] * bv;
+        }
+        a += MR;
+        b += NR;
+    }
+    gemmStoreTile(acc, MR, alpha, beta, C, ldc, mr, nr);
+}
+
+#ifdef HOST_GEMM_X86
+// 16 x 6 tile: 12 ymm accumulators, 2 for A and 1 broadcast of B
+__attribute__((target("avx2,fma")))
+static void gemmKernelAvx2(size_t kc, const float* a, const float* b,
+        float alpha, float beta, float* C, size_t ldc, size_t mr, size_t nr) {
+    constexpr size_t MR = 16, NR = 6;
+    __m256 c0[NR], c1[NR];
+    for (size_t j = 0; j < NR; j++) {
+        c0[j] = _mm256_setzero_ps();
+        c1[j] = _mm256_setzero_ps();
+    }
+    for (size_t p = 0; p < kc; p++) {
+        __m256 a0 = _mm256_loadu_ps(a);
+        __m256 a1 = _mm256_loadu_ps(a + 8);
+        for (size_t j = 0; j < NR; j++) {
+            __m256 bv = _mm256_broadcast_ss(b + j);
+            c0[j] = _mm256_fmadd_ps(a0, bv, c0[j]);
+            c1[j] = _mm256_fmadd_ps(a1, bv, c1[j]);
+        }
+        a += MR;
+        b += NR;
+    }
+
+    __m256 va = _mm256_set1_ps(alpha);
+    if (mr == MR && nr == NR) {
+        __m256 vb = _mm256_set1_ps(beta);
+        for (size_t j = 0; j < NR; j++) {
+            float* c = C + j * ldc;
+            __m256 r0 = _mm256_mul_ps(va, c0[j]);
+            __m256 r1 = _mm256_mul_ps(va, c1[j]);
+            if (beta != 0.0f) {
+                r0 = _mm256_fmadd_ps(vb, _mm256_loadu_ps(c), r0);
+                r1 = _mm256_fmadd_ps(vb, _mm256_loadu_ps(c + 8), r1);
+            }
+            _mm256_storeu_ps(c, r0);
+            _mm256_storeu_ps(c + 8, r1);
+        }
+        return;
+    }
+    float tile[NR * MR];
+    for (size_t j = 0; j < NR; j++) {
+        _mm256_storeu_ps(tile + j * MR, c0[j]);
+        _mm256_storeu_ps(tile + j * MR + 8, c1[j]);
+    }
+    gemmStoreTile(tile, MR, alpha, beta, C, ldc, mr, nr);
+}
+
+// 32 x 12 tile: 24 zmm accumulators, 2 for A and 1 broadcast of B
+__attribute__((target("avx512f")))
+static void gemmKernelAvx512(size_t kc, const float* a, const float* b,
+        float alpha, float beta, float* C, size_t ldc, size_t mr, size_t nr) {
+    constexpr size_t MR = 32, NR = 12;
+    __m512 c0[NR], c1[NR];
+    for (size_t j = 0; j < NR; j++) {
+        c0[j] = _mm512_setzero_ps();
+        c1[j] = _mm512_setzero_ps();
+    }
+    for (size_t p = 0; p < kc; p++) {
+        __m512 a0 = _mm512_loadu_ps(a);
+        __m512 a1 = _mm512_loadu_ps(a + 16);
+        for (size_t j = 0; j < NR; j++) {
+            __m512 bv = _mm512_set1_ps(b[j]);
+            c0[j] = _mm512_fmadd_ps(a0, bv, c0[j]);
+            c1[j] = _mm512_fmadd_ps(a1, bv, c1[j]);
+        }
+        a += MR;
+        b += NR;
+    }
+
+    __m512 va = _mm512_set1_ps(alpha);
+    if (mr == MR && nr == NR) {
+        __m512 vb = _mm512_set1_ps(beta);
+        for (size_t j = 0; j < NR; j++) {
+            float* c = C + j * ldc;
+            __m512 r0 = _mm512_mul_ps(va, c0[j]);
+            __m512 r1 = _mm512_mul_ps(va, c1[j]);
+            if (beta != 0.0f) {
+                r0 = _mm512_fmadd_ps(vb, _mm512_loadu_ps(c), r0);
+                r1 = _mm512_fmadd_ps(vb, _mm512_loadu_ps(c + 16), r1);
+            }
+            _mm512_storeu_ps(c, r0);
+            _mm512_storeu_ps(c + 16, r1);
+        }
+        return;
+    }
+    float tile[NR * MR];
+    for (size_t j = 0; j < NR; j++) {
+        _mm512_storeu_ps(tile + j * MR, c0[j]);
+        _mm512_storeu_ps(tile + j * MR + 16, c1[j]);
+    }
+    gemmStoreTile(tile, MR, alpha, beta, C, ldc, mr, nr);
+}
+#endif
+
+template<typename T>
+static const GemmKernel<T>& gemmKernel() {
+    static const GemmKernel<T> kernel =
+        {"generic", 8, 4, gemmKernelGeneric<T, 8, 4>};
+    return kernel;
+}
+
+template<>
+const GemmKernel<float>& gemmKernel<float>() {
+    static const GemmKernel<float> kernel = [] {
+        const GemmKernel<float> generic =
+            {"generic", 8, 4, gemmKernelGeneric<float, 8, 4>};
+        const char* env = getenv("TEST_HOST_GEMM");
+        std::string name = env == nullptr ? "" : env;
+        CHECK_ARGS(name == "" || name == "avx512" || name == "avx2" ||
+                name == "generic",
+                "TEST_HOST_GEMM must be avx512, avx2 or generic!");
+#ifdef HOST_GEMM_X86
+        bool avx512 = __builtin_cpu_supports("avx512f");
+        bool avx2 = __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("fma");
+        CHECK_ARGS(name != "avx512" || avx512,
+                "CPU does not support avx512!");
+        CHECK_ARGS(name != "avx2" || avx2, "CPU does not support avx2!");
+        if (avx512 && (name == "" || name == "avx512"))
+            return GemmKernel<float>{"avx512", 32, 12, gemmKernelAvx512};
+        if (avx2 && (name == "" || name == "avx2"))
+            return GemmKernel<float>{"avx2", 16, 6, gemmKernelAvx2};
+#else
+        CHECK_ARGS(name == "" || name == "generic",
+                "SIMD gemm kernels need an x86 CPU!");
+#endif
+        return generic;
+    }();
+    return kernel;
+}
+
+// Copy rows [ic, ic + mc) x cols [pc, pc + kc) of op(A) into MR-row
+// panels, each stored column by column and zero padded to MR rows.
+template<typename T>
+static void gemmPackA(bool trans, const T* A, size_t lda, size_t mr,
+        size_t ic, size_t mc, size_t pc, size_t kc, T* buf) {
+    for (size_t ir = 0; ir < mc; ir += mr) {
+        T* panel = buf + ir * kc;
+        size_t rows = std::min(mr, mc - ir);
+        for (size_t p = 0; p < kc; p++) {
+            T* dst = panel + p * mr;
+            if (trans) {
+                const T* src = A + (pc + p) + (ic + ir) * lda;
+                for (size_t i = 0; i < rows; i++)
+                    dst[i] = src[i * lda];
+            } else {
+                const T* src = A + (ic + ir) + (pc + p) * lda;
+                for (size_t i = 0; i < rows; i++)
+                    dst[i] = src[i];
+            }
+            for (size_t i = rows; i < mr; i++)
+                dst[i] = T(0);
+        }
+    }
+}
+
+// Same for op(B) in NR-column panels stored row by row, only the panels
+// starting in [jrBegin, jrEnd) are packed.
+template<typename T>
+static void gemmPackB(bool trans, const T* B, size_t ldb, size_t nr,
+        size_t jc, size_t nc, size_t pc, size_t kc,
+        size_t jrBegin, size_t jrEnd, T* buf) {
+    for (size_t jr = jrBegin; jr < jrEnd; jr += nr) {
+        T* panel = buf + jr * kc;
+        size_t cols = std::min(nr, nc - jr);
+        for (size_t j = 0; j < cols; j++) {
+            if (trans) {
+                const T* src = B + (jc + jr + j) + pc * ldb;
+                for (size_t p = 0; p < kc; p++)
+                    panel[p * nr + j] = src[p * ldb];
+            } else {
+                const T* src = B + pc + (jc + jr + j) * ldb;
+                for (size_t p = 0; p < kc; p++)
+                    panel[p * nr + j] = src[p];
+            }
+        }
+        for (size_t j = cols; j < nr; j++)
+            for (size_t p = 0; p < kc; p++)
+                panel[p * nr + j] = T(0);
+    }
+}
+
+template<typename T>
+static T* gemmBuffer(std::vector<T>& buf, size_t size) {
+    if (buf.size() < size)
+        buf.resize(size);
+    return buf.data();
+}
+
+// Runs on a tile right after its last K block is stored, while it is
+// still in cache
+template<typename T>
+static void gemmEpilogueTile(const GemmEpilogue<T>& epilogue,
+        T* C, size_t ldc, size_t row, size_t col, size_t mr, size_t nr) {
+    for (size_t j = 0; j < nr; j++) {
+        T* c = C + j * ldc;
+        for (size_t i = 0; i < mr; i++)
+            c[i] = epilogue.apply(c[i], row + i, col + j);
+    }
+}
+
+template<typename T>
+void HostFunc<T>::gemm(ThreadPool* pool,
+        char transa, char transb, size_t m, size_t n, size_t k,
+        T alpha, const T* A, size_t lda, const T* B, size_t ldb,
+        T beta, T* C, size_t ldc, const GemmEpilogue<T>* epilogue) {
+    CHECK_ARGS((transa == BLAS_OP_T || transa == BLAS_OP_N) &&
+            (transb == BLAS_OP_T || transb == BLAS_OP_N),
+            "HOSTBLAS: Unsupported BLAS_OP");
+    if (m == 0 || n == 0) return;
+    if (pool && m * n * k < GEMM_PARALLEL_MIN) pool = nullptr;
+    auto forRange = [&](size_t count,
+            const std::function<void(size_t, size_t)>& body) {
+        if (pool) pool->parallelFor(count, body);
+        else body(0, count);
+    };
+
+    if (k == 0 || alpha == T(0)) {
+        if (beta == T(1) && !epilogue) return;
+        forRange(n, [&](size_t begin, size_t end) {
+            for (size_t j = begin; j < end; j++) {
+                T* c = C + j * ldc;
+                for (size_t i = 0; i < m; i++)
+                    c[i] = beta == T(0) ? T(0) : beta * c[i];
+                if (epilogue)
+                    gemmEpilogueTile(*epilogue, c, ldc, 0, j, m, 1);
+            }
+        });
+        return;
+    }
+
+    const GemmKernel<T>& kernel = gemmKernel<T>();
+    const size_t MR = kernel.mr, NR = kernel.nr;
+    const size_t MC = GEMM_MC / MR * MR, NC = GEMM_NC / NR * NR;
+    bool ta = transa == BLAS_OP_T, tb = transb == BLAS_OP_T;
+    size_t nthreads = pool ? static_cast<size_t>(pool->size()) : 1;
+    static thread_local std::vector<T> packedBBuf;
+    T* packedB = gemmBuffer(packedBBuf, std::min(GEMM_KC, k) *
+            ((std::min(NC, n) + NR - 1) / NR * NR));
+
+    for (size_t jc = 0; jc < n; jc += NC) {
+        size_t nc = std::min(NC, n - jc);
+        size_t nPanels = (nc + NR - 1) / NR;
+        for (size_t pc = 0; pc < k; pc += GEMM_KC) {
+            size_t kc = std::min(GEMM_KC, k - pc);
+            T betaK = pc == 0 ? beta : T(1);
+            const GemmEpilogue<T>* lastK = pc + kc == k ? epilogue : nullptr;
+            forRange(nPanels, [&](size_t begin, size_t end) {
+                gemmPackB(tb, B, ldb, NR, jc, nc, pc, kc,
+                        begin * NR, std::min(end * NR, nc), packedB);
+            });
+
+            // Work items are (MC block of rows, group of NR panels) so
+            // that skinny problems still spread over every thread.
+            size_t mBlocks = (m + MC - 1) / MC;
+            size_t nGroups = std::min(nPanels,
+                    (nthreads + mBlocks - 1) / mBlocks);
+            size_t panelsPerGroup = (nPanels + nGroups - 1) / nGroups;
+            forRange(mBlocks * nGroups, [&](size_t begin, size_t end) {
+                static thread_local std::vector<T> packedABuf;
+                T* packedA = gemmBuffer(packedABuf, MC * kc);
+                size_t packedBlock = mBlocks;
+                for (size_t item = begin; item < end; item++) {
+                    size_t mb = item / nGroups, ng = item % nGroups;
+                    size_t ic = mb * MC;
+                    size_t mc = std::min(MC, m - ic);
+                    if (packedBlock != mb) {
+                        gemmPackA(ta, A, lda, MR, ic, mc, pc, kc, packedA);
+                        packedBlock = mb;
+                    }
+                    size_t jrBegin = ng * panelsPerGroup * NR;
+                    size_t jrEnd = std::min(nc,
+                            (ng + 1) * panelsPerGroup * NR);
+                    for (size_t jr = jrBegin; jr < jrEnd; jr += NR) {
+                        size_t nr = std::min(NR, nc - jr);
+                        for (size_t ir = 0; ir < mc; ir += MR) {
+                            size_t mr = std::min(MR, mc - ir);
+                            T* tile = C + (ic + ir) + (jc + jr) * ldc;
+                            kernel.run(kc, packedA + ir * kc,
+                                    packedB + jr * kc, alpha, betaK,
+                                    tile, ldc, mr, nr);
+                            if (lastK)
+                                gemmEpilogueTile(*lastK, tile, ldc,
+                                        ic + ir, jc + jr, mr, nr);
+                        }
+                    }
+                }
+            });
+        }
+    }
+}
+
+template<typename T>
+void HostFunc<T>::gemmBatched(ThreadPool* pool,
+        char transa, char transb, size_t m, size_t n, size_t k,
+        T alpha, const T* A, size_t lda, size_t strideA,
+        const T* B, size_t ldb, size_t strideB,
+        T beta, T* C, size_t ldc, size_t strideC, size_t nbatch) {
+    // Whole gemms per thread once there is one for everybody, or when
+    // each of them is too small to be split
+    bool perBatch = pool && nbatch > 1 &&
+        (nbatch >= static_cast<size_t>(pool->size()) ||
+         m * n * k < GEMM_PARALLEL_MIN);
+    if (!perBatch) {
+        for (size_t i = 0; i < nbatch; i++) {
+            gemm(pool, transa, transb, m, n, k, alpha,
+                    A + i * strideA, lda, B + i * strideB, ldb,
+                    beta, C + i * strideC, ldc);
+        }
+        return;
+    }
+    pool->parallelFor(nbatch, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            gemm(nullptr, transa, transb, m, n, k, alpha,
+                    A + i * strideA, lda, B + i * strideB, ldb,
+                    beta, C + i * strideC, ldc);
+        }
+    });
+}
+
+template<typename T>
+const char* HostFunc<T>::gemmKernelName() {
+    return gemmKernel<T>().name;
+}
+
+template void HostFunc<float>::gemm(ThreadPool*, char, char,
+        size_t, size_t, size_t, float, const float*, size_t,
+        const float*, size_t, float, float*, size_t,
+        const GemmEpilogue<float>*);
+template void HostFunc<float>::gemmBatched(ThreadPool*, char, char,
+        size_t, size_t, size_t, float, const float*, size_t, size_t,
+        const float*, size_t, size_t, float, float*, size_t, size_t,
+        size_t);
+template const char* HostFunc<float>::gemmKernelName();
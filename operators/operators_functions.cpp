@@ -1,20 +1,14 @@
 #include "test_operators.hpp"
 
 template<typename T>
-void OperatorsFunc<T>::dotImpl(HipHandle& handle, size_t n,
+void OperatorsFunc<T>::dotImpl(ExecContext& handle, size_t n,
         const Tensor<T>& x, const Tensor<T>& y,
         Tensor<T>& result) {
-    CHECK_CALL_HIPBLAS(hipblasSetPointerMode(
-            handle.hipblasHandle(), HIPBLAS_POINTER_MODE_DEVICE));
-    CHECK_CALL_HIPBLAS(hipblasSdot(
-            handle.hipblasHandle(), n, x.data(), 1,
-            y.data(), 1, result.data()));
-    CHECK_CALL_HIPBLAS(hipblasSetPointerMode(
-            handle.hipblasHandle(), HIPBLAS_POINTER_MODE_HOST));
+    CHECK_ARGS(false, "Unsupported operation!");
 }
 
 template<typename T>
-void OperatorsFunc<T>::gemvImpl(HipHandle& handle,
+void OperatorsFunc<T>::gemvImpl(ExecContext& handle,
         char transa, size_t m, size_t n, T alpha,
         const Tensor<T>& A, const Tensor<T>& x,
         T beta, Tensor<T>& y) {
@@ -22,7 +16,7 @@ void OperatorsFunc<T>::gemvImpl(HipHandle& handle,
 }
 
 template<typename T>
-void OperatorsFunc<T>::gerImpl(HipHandle& handle,
+void OperatorsFunc<T>::gerImpl(ExecContext& handle,
         size_t m, size_t n, T alpha,
         const Tensor<T>& x, const Tensor<T>& y,
         Tensor<T>& A) {
@@ -30,7 +24,7 @@ void OperatorsFunc<T>::gerImpl(HipHandle& handle,
 }
 
 template<typename T> 
-void OperatorsFunc<T>::gemmImpl(HipHandle& handle,
+void OperatorsFunc<T>::gemmImpl(ExecContext& handle,
         char transa, char transb, size_t m, size_t n, size_t k,
         T alpha, const Tensor<T>& A, const Tensor<T>& B,
         T beta, Tensor<T>& C) {
@@ -38,7 +32,7 @@ void OperatorsFunc<T>::gemmImpl(HipHandle& handle,
 }
 
 template<typename T>
-void OperatorsFunc<T>::bgemmImpl(HipHandle& handle, \
+void OperatorsFunc<T>::bgemmImpl(ExecContext& handle, \
         char transa, char transb, size_t m, size_t n, size_t k,
         T alpha, const Tensor<T>& A, const Tensor<T>& B,
         T beta, Tensor<T>& C, size_t nbatch) {
@@ -46,113 +40,175 @@ void OperatorsFunc<T>::bgemmImpl(HipHandle& handle, \
 }
 
 template<>
-void OperatorsFunc<float>::dotImpl(HipHandle& handle, size_t n,
+void OperatorsFunc<float>::dotImpl(ExecContext& handle, size_t n,
         const Tensor<float>& x, const Tensor<float>& y,
         Tensor<float>& result) {
-    CHECK_CALL_HIPBLAS(hipblasSetPointerMode(
-        handle.hipblasHandle(),
-        HIPBLAS_POINTER_MODE_DEVICE));
-    // Use hipblasDdot for double
-    CHECK_CALL_HIPBLAS(hipblasSdot(
-        handle.hipblasHandle(),
-        n, x.data(), 1, y.data(), 1, result.data()));
-    CHECK_CALL_HIPBLAS(hipblasSetPointerMode(
-        handle.hipblasHandle(),
-        HIPBLAS_POINTER_MODE_HOST));
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, y);
+    CHECK_BACKEND(handle, result);
+    runOp(handle, [&handle, n, &x, &y, &result] {
+        if (handle.backend() == Backend::Host) {
+            float sum = 0;
+            for (size_t i = 0; i < n; i++)
+                sum += x.data()[i] * y.data()[i];
+            result.data()[0] = sum;
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+        CHECK_CALL_HIPBLAS(hipblasSetPointerMode(
+            hipHandle.hipblasHandle(),
+            HIPBLAS_POINTER_MODE_DEVICE));
+        // Use hipblasDdot for double
+        CHECK_CALL_HIPBLAS(hipblasSdot(
+            hipHandle.hipblasHandle(),
+            n, x.data(), 1, y.data(), 1, result.data()));
+        CHECK_CALL_HIPBLAS(hipblasSetPointerMode(
+            hipHandle.hipblasHandle(),
+            HIPBLAS_POINTER_MODE_HOST));
+#endif
+    }, &x, &y, &result);
 }
 
 template<>
-void OperatorsFunc<float>::gemvImpl(HipHandle& handle,
+void OperatorsFunc<float>::gemvImpl(ExecContext& handle,
         char transa, size_t m, size_t n, float alpha,
         const Tensor<float>& A, const Tensor<float>& x,
         float beta, Tensor<float>& y) {
     CHECK_ARGS(transa == BLAS_OP_T || transa == BLAS_OP_N, 
             "HIPBLAS: Unsupported BLAS_OP");
-    hipblasOperation_t hiptransa =
-        transa == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
-    // Use hipblasDdot for double
-    CHECK_CALL_HIPBLAS(hipblasSgemv(
-        handle.hipblasHandle(),
-        hiptransa, m, n, &alpha, A.data(), m,
-        x.data(), 1, &beta, y.data(), 1));
+    CHECK_BACKEND(handle, A);
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, y);
+    runOp(handle, [&handle, transa, m, n, alpha, &A, &x, beta, &y] {
+        if (handle.backend() == Backend::Host) {
+            HostHandle& hostHandle = static_cast<HostHandle&>(handle);
+            size_t rows = transa == BLAS_OP_T ? n : m;
+            size_t cols = transa == BLAS_OP_T ? m : n;
+            HostFunc<float>::gemm(&hostHandle.threadPool(), transa,
+                    BLAS_OP_N, rows, 1, cols, alpha, A.data(), m,
+                    x.data(), cols, beta, y.data(), rows);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+        hipblasOperation_t hiptransa =
+            transa == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
+        // Use hipblasDdot for double
+        CHECK_CALL_HIPBLAS(hipblasSgemv(
+            hipHandle.hipblasHandle(),
+            hiptransa, m, n, &alpha, A.data(), m,
+            x.data(), 1, &beta, y.data(), 1));
+#endif
+    }, &A, &x, &y);
 }
 
 template<>
-void OperatorsFunc<float>::gerImpl(HipHandle& handle,
+void OperatorsFunc<float>::gerImpl(ExecContext& handle,
         size_t m, size_t n, float alpha,
         const Tensor<float>& x, const Tensor<float>& y,
         Tensor<float>& A) {
-    // Use hipblasDdot for double
-    CHECK_CALL_HIPBLAS(hipblasSger(
-        handle.hipblasHandle(), m, n, &alpha, x.data(),
-        1, y.data(), 1, A.data(), m));
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, y);
+    CHECK_BACKEND(handle, A);
+    runOp(handle, [&handle, m, n, alpha, &x, &y, &A] {
+        if (handle.backend() == Backend::Host) {
+            HostHandle& hostHandle = static_cast<HostHandle&>(handle);
+            HostFunc<float>::gemm(&hostHandle.threadPool(),
+                    BLAS_OP_N, BLAS_OP_T, m, n, 1, alpha,
+                    x.data(), m, y.data(), n, 1.0f, A.data(), m);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+        // Use hipblasDdot for double
+        CHECK_CALL_HIPBLAS(hipblasSger(
+            hipHandle.hipblasHandle(), m, n, &alpha, x.data(),
+            1, y.data(), 1, A.data(), m));
+#endif
+    }, &x, &y, &A);
 }
 
 template<> 
-void OperatorsFunc<float>::gemmImpl(HipHandle& handle,
+void OperatorsFunc<float>::gemmImpl(ExecContext& handle,
         char transa, char transb, size_t m, size_t n, size_t k,
         float alpha, const Tensor<float>& A, const Tensor<float>& B,
         float beta, Tensor<float>& C) {
     CHECK_ARGS((transa == BLAS_OP_T || transa == BLAS_OP_N) &&
             (transb == BLAS_OP_T || transb == BLAS_OP_N),
             "HIPBLAS: Unsupported BLAS_OP");
+    CHECK_BACKEND(handle, A);
+    CHECK_BACKEND(handle, B);
+    CHECK_BACKEND(handle, C);
     int lda = (transa == BLAS_OP_T) ?
               static_cast<int>(k) : static_cast<int>(m);
     int ldb = (transb == BLAS_OP_T) ?
               static_cast<int>(n) : static_cast<int>(k);
-    hipblasOperation_t hiptransa =
-        transa == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
-    hipblasOperation_t hiptransb =
-        transb == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
-    // Use hipblasDdot for double
-    CHECK_CALL_HIPBLAS(hipblasSgemm(
-        handle.hipblasHandle(), hiptransa, hiptransb,
-        static_cast<int>(m), static_cast<int>(n), static_cast<int>(k),
-        &alpha, A.data(), lda, B.data(), ldb, &beta,
-        C.data(), static_cast<int>(m)));
+    runOp(handle, [&handle, transa, transb, m, n, k, alpha, &A, &B,
+            beta, &C, lda, ldb] {
+        if (handle.backend() == Backend::Host) {
+            HostHandle& hostHandle = static_cast<HostHandle&>(handle);
+            HostFunc<float>::gemm(&hostHandle.threadPool(), transa, transb,
+                    m, n, k, alpha, A.data(), lda, B.data(), ldb,
+                    beta, C.data(), m);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+        hipblasOperation_t hiptransa =
+            transa == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
+        hipblasOperation_t hiptransb =
+            transb == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
+        // Use hipblasDdot for double
+        CHECK_CALL_HIPBLAS(hipblasSgemm(
+            hipHandle.hipblasHandle(), hiptransa, hiptransb,
+            static_cast<int>(m), static_cast<int>(n), static_cast<int>(k),
+            &alpha, A.data(), lda, B.data(), ldb, &beta,
+            C.data(), static_cast<int>(m)));
+#endif
+    }, &A, &B, &C);
 }
 
 template<>
-void OperatorsFunc<float>::bgemmImpl(HipHandle& handle, \
+void OperatorsFunc<float>::bgemmImpl(ExecContext& handle, \
         char transa, char transb, size_t m, size_t n, size_t k,
         float alpha, const Tensor<float>& A, const Tensor<float>& B,
         float beta, Tensor<float>& C, size_t nbatch) {
-    std::vector<const float *> hbuf(3 * nbatch);
-    const float **hptra = hbuf.data();
-    const float **hptrb = hptra + nbatch;
-    const float **hptrc = hptrb + nbatch;
-    for (size_t i = 0; i < nbatch; i ++) {
-        hptra[i] = A.data() + i * m * k;
-        hptrb[i] = B.data() + i * k * n;
-        hptrc[i] = C.data() + i * m * n;
-    }
-    
-    std::vector<int> shape(1, 3 * nbatch);
-    Tensor<float> tmp(int(0), shape);
-    float **dptra = reinterpret_cast<float **>(tmp.data());
-    float **dptrb = dptra + nbatch;
-    float **dptrc = dptrb + nbatch;
-    
-    hipStream_t hipstream = handle.stream();
-    CHECK_CALL_HIP(hipMemcpyAsync(dptra, hptra,
-        3 * nbatch * sizeof(float *), hipMemcpyHostToDevice, hipstream));
-    
     CHECK_ARGS((transa == BLAS_OP_T || transa == BLAS_OP_N) &&
             (transb == BLAS_OP_T || transb == BLAS_OP_N),
             "HIPBLAS: Unsupported BLAS_OP");
-    hipblasOperation_t hiptransa =
-        transa == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
-    hipblasOperation_t hiptransb =
-        transb == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
-    size_t lda = hiptransa == HIPBLAS_OP_T ? k : m;
-    size_t ldb = hiptransb == HIPBLAS_OP_T ? n : k;
+    CHECK_BACKEND(handle, A);
+    CHECK_BACKEND(handle, B);
+    CHECK_BACKEND(handle, C);
+    size_t lda = transa == BLAS_OP_T ? k : m;
+    size_t ldb = transb == BLAS_OP_T ? n : k;
     size_t ldc = m;
-    
-    // Use hipblasDdot for double
-    CHECK_CALL_HIPBLAS(hipblasSgemmBatched(
-        handle.hipblasHandle(), hiptransa, hiptransb,
-        m, n, k, &alpha, (const float **)dptra, lda, (const float **)dptrb, ldb,
-        &beta, dptrc, ldc, nbatch));
+
+    runOp(handle, [&handle, transa, transb, m, n, k, alpha, &A, &B,
+            beta, &C, nbatch, lda, ldb, ldc] {
+        if (handle.backend() == Backend::Host) {
+            HostHandle& hostHandle = static_cast<HostHandle&>(handle);
+            HostFunc<float>::gemmBatched(&hostHandle.threadPool(),
+                    transa, transb, m, n, k, alpha, A.data(), lda, m * k,
+                    B.data(), ldb, k * n, beta, C.data(), ldc, m * n,
+                    nbatch);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        HipHandle& hipHandle = static_cast<HipHandle&>(handle);
+        hipblasOperation_t hiptransa =
+            transa == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
+        hipblasOperation_t hiptransb =
+            transb == BLAS_OP_T? HIPBLAS_OP_T : HIPBLAS_OP_N;
+
+        // The matrices are evenly spaced, so the strided variant needs no
+        // pointer arrays copied to the device before the launch
+        CHECK_CALL_HIPBLAS(hipblasSgemmStridedBatched(
+            hipHandle.hipblasHandle(), hiptransa, hiptransb,
+            m, n, k, &alpha, A.data(), lda, m * k, B.data(), ldb, k * n,
+            &beta, C.data(), ldc, m * n, nbatch));
+#endif
+    }, &A, &B, &C);
 }
 
 template class OperatorsFunc<float>;
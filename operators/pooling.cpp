@@ -1,102 +1,225 @@
 #include "test_operators.hpp"
 
 template<typename T>
-void PoolingOp<T>::PoolingForward(HipHandle& handle,
+PoolingPlan<T> PoolingOp<T>::Prepare(ExecContext& handle,
+        const PoolingDescriptor& poolSpec,
+        const std::vector<int>& xDims, const std::vector<int>& yDims,
+        bool keepIndices){
+    CHECK_ARGS(xDims.size() == 4 && yDims.size() == 4,
+            "Only 2d pooling is supported!");
+    PoolingPlan<T> plan(handle, poolSpec, xDims, yDims);
+    if (keepIndices && poolSpec.mode == "max")
+        plan.context_.reset(new PoolingContext);
+#ifndef USE_HOST_ONLY
+    if (handle.backend() == Backend::Hip)
+        PrepareHip(static_cast<HipHandle&>(handle), plan);
+#endif
+    return plan;
+}
+
+template<typename T>
+void PoolingPlan<T>::Forward(const Tensor<T>& x, Tensor<T>& y) const {
+    PoolingOp<T>::RunForward(*this, x, y, context_.get());
+}
+
+template<typename T>
+void PoolingPlan<T>::Backward(const Tensor<T>& x, const Tensor<T>& y,
+        const Tensor<T>& dy, Tensor<T>& dx) const {
+    PoolingOp<T>::RunBackward(*this, x, y, dy, dx, context_.get());
+}
+
+template<typename T>
+void PoolingOp<T>::PoolingForward(ExecContext& handle,
         PoolingDescriptor& poolSpec,
-        const Tensor<T>& x, Tensor<T>& y){
+        const Tensor<T>& x, Tensor<T>& y, PoolingContext* context){
+    RunForward(Prepare(handle, poolSpec, x.dims(), y.dims(), false),
+            x, y, context);
+}
 
-    std::vector<int> workSpaceDims = {0};
-    const T alpha = 1.0;
-    const T beta = 0.0;
-    
+template<typename T>
+void PoolingOp<T>::PoolingBackward(ExecContext& handle,
+        PoolingDescriptor& poolSpec,
+        const Tensor<T>& x, const Tensor<T>& y,
+        const Tensor<T>& dy, Tensor<T>& dx,
+        const PoolingContext* context){
+    RunBackward(Prepare(handle, poolSpec, x.dims(), y.dims(), false),
+            x, y, dy, dx, context);
+}
+
+#ifndef USE_HOST_ONLY
+static miopenIndexType_t poolingIndexType(int indexBytes) {
+    if (indexBytes == 1) return miopenIndexUint8;
+    if (indexBytes == 2) return miopenIndexUint16;
+    return miopenIndexUint32;
+}
+
+struct PoolingHipState : PlanState {
     miopenTensorDescriptor_t xDesc, yDesc;
     miopenPoolingDescriptor_t poolDesc;
-    size_t workSpaceSize;
-    
+    // Bytes of indices a forward that keeps them writes
+    size_t indexSize = 0;
+
+    PoolingHipState() {
+        CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&xDesc));
+        CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&yDesc));
+        CHECK_CALL_MIOPEN(miopenCreatePoolingDescriptor(&poolDesc));
+    }
+
+    ~PoolingHipState() {
+        CHECK_CALL_MIOPEN(miopenDestroyPoolingDescriptor(poolDesc));
+        CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(xDesc));
+        CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(yDesc));
+    }
+};
+
+template<typename T>
+void PoolingOp<T>::PrepareHip(HipHandle& handle, PoolingPlan<T>& plan){
+    PoolingDescriptor& poolSpec = plan.spec_;
+    const std::vector<int>& x = plan.xDims_;
+    const std::vector<int>& y = plan.yDims_;
+
     CHECK_CALL_HIP(hipSetDevice(handle.deviceId()));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&xDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&yDesc));
-    
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(xDesc, miopenFloat,
-            x.dim(0), x.dim(1), x.dim(2), x.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(yDesc, miopenFloat,
-            y.dim(0), y.dim(1), y.dim(2), y.dim(3)));
-    
-    CHECK_CALL_MIOPEN(miopenCreatePoolingDescriptor(&poolDesc));
-    CHECK_CALL_MIOPEN(miopenSet2dPoolingDescriptor(poolDesc, poolSpec.getMode(),
+    std::shared_ptr<PoolingHipState> state(new PoolingHipState);
+    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(state->xDesc, miopenFloat,
+            x[0], x[1], x[2], x[3]));
+    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(state->yDesc, miopenFloat,
+            y[0], y[1], y[2], y[3]));
+    CHECK_CALL_MIOPEN(miopenSet2dPoolingDescriptor(state->poolDesc,
+            poolSpec.getMode(),
             poolSpec.kernelshape[0], poolSpec.kernelshape[1],
             poolSpec.padding[0], poolSpec.padding[1],
             poolSpec.stride[0], poolSpec.stride[1]));
-    
-    CHECK_CALL_MIOPEN(miopenPoolingGetWorkSpaceSize(
-            yDesc, &workSpaceSize));
-    
-    workSpaceDims[0] = static_cast<int>(workSpaceSize / sizeof(T));
-    Tensor<T> workSpace(workSpaceDims);
-    
+    if (poolSpec.mode == "max") {
+        CHECK_CALL_MIOPEN(miopenSetPoolingIndexType(state->poolDesc,
+                poolingIndexType(PoolingContext::indexBytesFor(poolSpec))));
+        CHECK_CALL_MIOPEN(miopenPoolingGetWorkSpaceSizeV2(
+                state->poolDesc, state->yDesc, &state->indexSize));
+    }
+    plan.state_ = state;
+}
+
+template<typename T>
+void PoolingOp<T>::PoolingForwardHip(HipHandle& handle,
+        const PoolingHipState& state, const PoolingDescriptor& poolSpec,
+        const Tensor<T>& x, Tensor<T>& y, PoolingContext* context){
+
+    BackendGuard guard(Backend::Hip);
+    const T alpha = 1.0;
+    const T beta = 0.0;
+
+    CHECK_CALL_HIP(hipSetDevice(handle.deviceId()));
+    bool saveIndices = context != nullptr && poolSpec.mode == "max";
+    void* workSpace = nullptr;
+    size_t workSpaceSize = 0;
+    if (saveIndices) {
+        workSpaceSize = state.indexSize;
+        context->reserve(Backend::Hip, poolSpec, y.dims(), workSpaceSize);
+        workSpace = context->indices->data();
+    }
+
     CHECK_CALL_MIOPEN(miopenPoolingForward(handle.miopenHandle(),
-            poolDesc, &alpha, xDesc, x.data(),
-            &beta, yDesc, y.data(),
-            true, workSpace.data(), workSpaceSize));
-
-    CHECK_CALL_MIOPEN(miopenDestroyPoolingDescriptor(poolDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(xDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(yDesc));
-    handle.streamSynchronize();
+            state.poolDesc, &alpha, state.xDesc, x.data(),
+            &beta, state.yDesc, y.data(),
+            saveIndices, workSpace, workSpaceSize));
 }
 
 template<typename T>
-void PoolingOp<T>::PoolingBackward(HipHandle& handle,
-        PoolingDescriptor& poolSpec,
+void PoolingOp<T>::PoolingBackwardHip(HipHandle& handle,
+        const PoolingHipState& state, const PoolingDescriptor& poolSpec,
         const Tensor<T>& x, const Tensor<T>& y,
-        const Tensor<T>& dy, Tensor<T>& dx){
-    
-    std::vector<int> workSpaceDims = {0};
+        const Tensor<T>& dy, Tensor<T>& dx,
+        const PoolingContext* context){
+
+    BackendGuard guard(Backend::Hip);
     const T alpha = 1.0;
     const T beta = 0.0;
-    
-    miopenTensorDescriptor_t xDesc, yDesc, dxDesc, dyDesc;
-    miopenPoolingDescriptor_t poolDesc;
-    size_t workSpaceSize;
-    
+
     CHECK_CALL_HIP(hipSetDevice(handle.deviceId()));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&xDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&yDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&dxDesc));
-    CHECK_CALL_MIOPEN(miopenCreateTensorDescriptor(&dyDesc));
-    
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(xDesc, miopenFloat,
-            x.dim(0), x.dim(1), x.dim(2), x.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(yDesc, miopenFloat,
-            y.dim(0), y.dim(1), y.dim(2), y.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(dxDesc, miopenFloat,
-            dx.dim(0), dx.dim(1), dx.dim(2), dx.dim(3)));
-    CHECK_CALL_MIOPEN(miopenSet4dTensorDescriptor(dyDesc, miopenFloat,
-            dy.dim(0), dy.dim(1), dy.dim(2), dy.dim(3)));
-    
-    CHECK_CALL_MIOPEN(miopenCreatePoolingDescriptor(&poolDesc));
-    CHECK_CALL_MIOPEN(miopenSet2dPoolingDescriptor(poolDesc, poolSpec.getMode(),
-            poolSpec.kernelshape[0], poolSpec.kernelshape[1],
-            poolSpec.padding[0], poolSpec.padding[1],
-            poolSpec.stride[0], poolSpec.stride[1]));
-    
-    CHECK_CALL_MIOPEN(miopenPoolingGetWorkSpaceSize(
-            yDesc, &workSpaceSize));
-    
-    workSpaceDims[0] = static_cast<int>(workSpaceSize / sizeof(T));
-    Tensor<T> workSpace(workSpaceDims);
-    
+    bool maxMode = poolSpec.mode == "max";
+    void* workSpace = nullptr;
+    if (maxMode && context == nullptr) {
+        // No indices kept from the forward, run it again for them. The
+        // output and the indices go to the handle's workspace, which only
+        // this stream reuses, so they stay valid until the backward ran.
+        size_t yBytes = (y.size() * sizeof(T) + 255) / 256 * 256;
+        char* scratch = static_cast<char*>(
+                handle.workspace().borrow(yBytes + state.indexSize));
+        workSpace = scratch + yBytes;
+        CHECK_CALL_MIOPEN(miopenPoolingForward(handle.miopenHandle(),
+                state.poolDesc, &alpha, state.xDesc, x.data(),
+                &beta, state.yDesc, scratch,
+                true, workSpace, state.indexSize));
+    } else if (maxMode) {
+        workSpace = context->indices->data();
+    }
+
     CHECK_CALL_MIOPEN(miopenPoolingBackward(handle.miopenHandle(),
-            poolDesc, &alpha, yDesc, y.data(),
-            dyDesc, dy.data(), xDesc, x.data(),
-            &beta, dxDesc, dx.data(), workSpace.data()));
-
-    CHECK_CALL_MIOPEN(miopenDestroyPoolingDescriptor(poolDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(xDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(yDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(dxDesc));
-    CHECK_CALL_MIOPEN(miopenDestroyTensorDescriptor(dyDesc));
-    handle.streamSynchronize();
+            state.poolDesc, &alpha, state.yDesc, y.data(),
+            state.yDesc, dy.data(), state.xDesc, x.data(),
+            &beta, state.xDesc, dx.data(), workSpace));
+}
+#endif
+
+// The plan's own context is shared with the queued work, so it outlives
+// the plan like the state does
+template<typename T>
+void PoolingOp<T>::RunForward(const PoolingPlan<T>& plan,
+        const Tensor<T>& x, Tensor<T>& y, PoolingContext* context){
+    ExecContext& handle = *plan.handle_;
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, y);
+    CHECK_ARGS(x.dims() == plan.xDims_ && y.dims() == plan.yDims_,
+            "Tensor shapes do not match the plan!");
+    PoolingDescriptor spec = plan.spec_;
+    std::shared_ptr<PlanState> state = plan.state_;
+    std::shared_ptr<PoolingContext> owned = plan.context_;
+    runOp(handle, [&handle, spec, state, owned, &x, &y, context]() mutable {
+        if (handle.backend() == Backend::Host) {
+            PoolingForwardHost(static_cast<HostHandle&>(handle), spec,
+                    x, y, context);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        PoolingForwardHip(static_cast<HipHandle&>(handle),
+                static_cast<const PoolingHipState&>(*state), spec,
+                x, y, context);
+#endif
+    }, &x, &y);
+}
+
+template<typename T>
+void PoolingOp<T>::RunBackward(const PoolingPlan<T>& plan,
+        const Tensor<T>& x, const Tensor<T>& y,
+        const Tensor<T>& dy, Tensor<T>& dx,
+        const PoolingContext* context){
+    ExecContext& handle = *plan.handle_;
+    CHECK_BACKEND(handle, x);
+    CHECK_BACKEND(handle, y);
+    CHECK_BACKEND(handle, dy);
+    CHECK_BACKEND(handle, dx);
+    CHECK_ARGS(x.dims() == plan.xDims_ && dx.dims() == plan.xDims_ &&
+            y.dims() == plan.yDims_ && dy.dims() == plan.yDims_,
+            "Tensor shapes do not match the plan!");
+    PoolingDescriptor spec = plan.spec_;
+    std::shared_ptr<PlanState> state = plan.state_;
+    std::shared_ptr<PoolingContext> owned = plan.context_;
+    runOp(handle, [&handle, spec, state, owned, &x, &y, &dy, &dx,
+            context]() mutable {
+        CHECK_ARGS(context == nullptr || spec.mode != "max" ||
+                context->matches(handle.backend(), spec, dy.dims()),
+                "Pooling context was not filled by the matching forward!");
+        if (handle.backend() == Backend::Host) {
+            PoolingBackwardHost(static_cast<HostHandle&>(handle),
+                    spec, x, y, dy, dx, context);
+            return;
+        }
+#ifndef USE_HOST_ONLY
+        PoolingBackwardHip(static_cast<HipHandle&>(handle),
+                static_cast<const PoolingHipState&>(*state), spec,
+                x, y, dy, dx, context);
+#endif
+    }, &x, &y, &dy, &dx);
 }
 
+template class PoolingPlan<float>;
 template class PoolingOp<float>;
@@ -0,0 +1,209 @@
+#include "test_operators.hpp"
+
+// Window of output position o along one axis, clipped to the input.
+// Padding never counts as an element, as with miopenPoolingAverage.
+static inline void poolingWindow(int o, int kernel, int pad, int stride,
+        int size, int& begin, int& end) {
+    begin = o * stride - pad;
+    end = std::min(begin + kernel, size);
+    begin = std::max(begin, 0);
+}
+
+// Pools every plane of x into y. With indices max pooling also stores
+// the position of each maximum within its window, counted from the
+// window's unclipped corner like MIOpen's mask indices.
+template<typename T, typename I>
+static void poolingForwardPlanes(ThreadPool& pool,
+        const PoolingDescriptor& poolSpec,
+        const Tensor<T>& x, Tensor<T>& y, I* indices) {
+    bool maxMode = poolSpec.mode == "max";
+    int H = x.dim(2), W = x.dim(3);
+    int OH = y.dim(2), OW = y.dim(3);
+    int KW = poolSpec.kernelshape[1];
+
+    pool.parallelFor(static_cast<size_t>(y.dim(0)) * y.dim(1),
+            [&](size_t begin, size_t end) {
+        for (size_t plane = begin; plane < end; plane++) {
+            const T* src = x.data() + plane * H * W;
+            T* dst = y.data() + plane * OH * OW;
+            I* index = indices == nullptr ? nullptr :
+                indices + plane * OH * OW;
+            for (int oh = 0; oh < OH; oh++) {
+                int hBegin, hEnd;
+                poolingWindow(oh, poolSpec.kernelshape[0],
+                        poolSpec.padding[0], poolSpec.stride[0], H,
+                        hBegin, hEnd);
+                int hStart = oh * poolSpec.stride[0] - poolSpec.padding[0];
+                for (int ow = 0; ow < OW; ow++) {
+                    int wBegin, wEnd;
+                    poolingWindow(ow, KW, poolSpec.padding[1],
+                            poolSpec.stride[1], W, wBegin, wEnd);
+                    int wStart = ow * poolSpec.stride[1] -
+                        poolSpec.padding[1];
+                    T result = T(0);
+                    int count = 0, argmax = 0;
+                    for (int ih = hBegin; ih < hEnd; ih++) {
+                        for (int iw = wBegin; iw < wEnd; iw++) {
+                            T value = src[ih * W + iw];
+                            if (!maxMode) {
+                                result += value;
+                            } else if (count == 0 || value > result) {
+                                result = value;
+                                argmax = (ih - hStart) * KW + iw - wStart;
+                            }
+                            count++;
+                        }
+                    }
+                    if (!maxMode && count > 0)
+                        result /= static_cast<T>(count);
+                    dst[oh * OW + ow] = result;
+                    if (index != nullptr)
+                        index[oh * OW + ow] = static_cast<I>(argmax);
+                }
+            }
+        }
+    });
+}
+
+// Max pooling backward from the indices a forward left behind
+template<typename T, typename I>
+static void maxPoolingBackwardIndexed(ThreadPool& pool,
+        const PoolingDescriptor& poolSpec,
+        const Tensor<T>& dy, Tensor<T>& dx, const I* indices) {
+    int H = dx.dim(2), W = dx.dim(3);
+    int OH = dy.dim(2), OW = dy.dim(3);
+    int KW = poolSpec.kernelshape[1];
+
+    pool.parallelFor(static_cast<size_t>(dy.dim(0)) * dy.dim(1),
+            [&](size_t begin, size_t end) {
+        for (size_t plane = begin; plane < end; plane++) {
+            const T* grad = dy.data() + plane * OH * OW;
+            const I* index = indices + plane * OH * OW;
+            T* dst = dx.data() + plane * H * W;
+            std::fill(dst, dst + H * W, T(0));
+            for (int oh = 0; oh < OH; oh++) {
+                int hBegin, hEnd;
+                poolingWindow(oh, poolSpec.kernelshape[0],
+                        poolSpec.padding[0], poolSpec.stride[0], H,
+                        hBegin, hEnd);
+                int hStart = oh * poolSpec.stride[0] - poolSpec.padding[0];
+                for (int ow = 0; ow < OW; ow++) {
+                    int wBegin, wEnd;
+                    poolingWindow(ow, KW, poolSpec.padding[1],
+                            poolSpec.stride[1], W, wBegin, wEnd);
+                    if (hEnd <= hBegin || wEnd <= wBegin) continue;
+                    int wStart = ow * poolSpec.stride[1] -
+                        poolSpec.padding[1];
+                    int argmax = index[oh * OW + ow];
+                    dst[(hStart + argmax / KW) * W + wStart + argmax % KW] +=
+                        grad[oh * OW + ow];
+                }
+            }
+        }
+    });
+}
+
+template<typename T>
+void PoolingOp<T>::PoolingForwardHost(HostHandle& handle,
+        PoolingDescriptor& poolSpec,
+        const Tensor<T>& x, Tensor<T>& y, PoolingContext* context){
+    CHECK_ARGS(poolSpec.mode == "max" || poolSpec.mode == "avg",
+            "Unknown pooling mode!");
+    CHECK_ARGS(x.dim(0) == y.dim(0) && x.dim(1) == y.dim(1),
+            "Tensor shapes do not match the pooling!");
+
+    int indexBytes = 0;
+    uint8_t* indices = nullptr;
+    if (context != nullptr && poolSpec.mode == "max") {
+        indexBytes = PoolingContext::indexBytesFor(poolSpec);
+        context->reserve(Backend::Host, poolSpec, y.dims(),
+                static_cast<size_t>(y.size()) * indexBytes);
+        indices = context->indices->data();
+    }
+
+    ThreadPool& pool = handle.threadPool();
+    if (indexBytes == 2)
+        poolingForwardPlanes(pool, poolSpec, x, y,
+                reinterpret_cast<uint16_t*>(indices));
+    else if (indexBytes == 4)
+        poolingForwardPlanes(pool, poolSpec, x, y,
+                reinterpret_cast<uint32_t*>(indices));
+    else
+        poolingForwardPlanes(pool, poolSpec, x, y, indices);
+}
+
+template<typename T>
+void PoolingOp<T>::PoolingBackwardHost(HostHandle& handle,
+        PoolingDescriptor& poolSpec,
+        const Tensor<T>& x, const Tensor<T>& y,
+        const Tensor<T>& dy, Tensor<T>& dx,
+        const PoolingContext* context){
+    CHECK_ARGS(poolSpec.mode == "max" || poolSpec.mode == "avg",
+            "Unknown pooling mode!");
+    bool maxMode = poolSpec.mode == "max";
+    int H = x.dim(2), W = x.dim(3);
+    int OH = dy.dim(2), OW = dy.dim(3);
+    CHECK_ARGS(x.size() == dx.size() && y.size() == dy.size(),
+            "Tensor shapes do not match the pooling!");
+
+    if (maxMode && context != nullptr) {
+        ThreadPool& pool = handle.threadPool();
+        const uint8_t* indices = context->indices->data();
+        if (context->indexBytes == 2)
+            maxPoolingBackwardIndexed(pool, poolSpec, dy, dx,
+                    reinterpret_cast<const uint16_t*>(indices));
+        else if (context->indexBytes == 4)
+            maxPoolingBackwardIndexed(pool, poolSpec, dy, dx,
+                    reinterpret_cast<const uint32_t*>(indices));
+        else
+            maxPoolingBackwardIndexed(pool, poolSpec, dy, dx, indices);
+        return;
+    }
+
+    handle.threadPool().parallelFor(static_cast<size_t>(dy.dim(0)) * dy.dim(1),
+            [&](size_t begin, size_t end) {
+        for (size_t plane = begin; plane < end; plane++) {
+            const T* src = x.data() + plane * H * W;
+            const T* grad = dy.data() + plane * OH * OW;
+            T* dst = dx.data() + plane * H * W;
+            std::fill(dst, dst + H * W, T(0));
+            for (int oh = 0; oh < OH; oh++) {
+                int hBegin, hEnd;
+                poolingWindow(oh, poolSpec.kernelshape[0],
+                        poolSpec.padding[0], poolSpec.stride[0], H,
+                        hBegin, hEnd);
+                for (int ow = 0; ow < OW; ow++) {
+                    int wBegin, wEnd;
+                    poolingWindow(ow, poolSpec.kernelshape[1],
+                            poolSpec.padding[1], poolSpec.stride[1], W,
+                            wBegin, wEnd);
+                    int count = (hEnd - hBegin) * (wEnd - wBegin);
+                    if (count <= 0) continue;
+                    T g = grad[oh * OW + ow];
+                    if (!maxMode) {
+                        g /= static_cast<T>(count);
+                        for (int ih = hBegin; ih < hEnd; ih++)
+                            for (int iw = wBegin; iw < wEnd; iw++)
+                                dst[ih * W + iw] += g;
+                        continue;
+                    }
+                    // No indices from the forward: the gradient goes to
+                    // the first maximum of the window
+                    int argmax = hBegin * W + wBegin;
+                    for (int ih = hBegin; ih < hEnd; ih++)
+                        for (int iw = wBegin; iw < wEnd; iw++)
+                            if (src[ih * W + iw] > src[argmax])
+                                argmax = ih * W + iw;
+                    dst[argmax] += g;
+                }
+            }
+        }
+    });
+}
+
+template void PoolingOp<float>::PoolingForwardHost(HostHandle&,
+        PoolingDescriptor&, const Tensor<float>&, Tensor<float>&,
+        PoolingContext*);
+template void PoolingOp<float>::PoolingBackwardHost(HostHandle&,
+        PoolingDescriptor&, const Tensor<float>&, const Tensor<float>&,
+        const Tensor<float>&, Tensor<float>&, const PoolingContext*);
@@ -0,0 +1,966 @@
+#include "test_helper.hpp"
+#include "test_operators.hpp"
+
+// Runs on the process default backend, pick one with TEST_BACKEND=hip|host
+void testGemm(ExecContext& handle) {
+    // Odd sizes so every kernel hits its edge tiles, integer data is exact
+    const size_t m = 37, n = 14, k = 19;
+    std::vector<float> a_std(m * k), b_std(k * n);
+    for (size_t i = 0; i < a_std.size(); i++)
+        a_std[i] = float(int(i % 7) - 3);
+    for (size_t i = 0; i < b_std.size(); i++)
+        b_std[i] = float(int(i % 5) - 2);
+
+    Tensor<float> A(a_std, std::vector<int>{int(m * k)});
+    Tensor<float> B(b_std, std::vector<int>{int(k * n)});
+    Tensor<float> C(std::vector<int>{int(m * n)});
+    for (char transa : {BLAS_OP_N, BLAS_OP_T}) {
+        for (char transb : {BLAS_OP_N, BLAS_OP_T}) {
+            std::vector<float> c_std(m * n, 0);
+            for (size_t j = 0; j < n; j++) {
+                for (size_t i = 0; i < m; i++) {
+                    for (size_t p = 0; p < k; p++) {
+                        float a = transa == BLAS_OP_T ?
+                            a_std[p + i * k] : a_std[i + p * m];
+                        float b = transb == BLAS_OP_T ?
+                            b_std[j + p * n] : b_std[p + j * k];
+                        c_std[i + j * m] += 2 * a * b;
+                    }
+                }
+            }
+            OperatorsFunc<float>::gemmImpl(handle, transa, transb,
+                    m, n, k, 2, A, B, 0, C);
+            handle.streamSynchronize();
+            testSame(C, c_std, std::string("Gemm ") + transa + transb +
+                    " output-CData");
+        }
+    }
+}
+
+void testConvolution(ExecContext& handle) {
+    std::vector<int> x_shape {1, 1, 3, 3};
+    std::vector<int> w_shape {1, 1, 2, 2};
+    std::vector<int> b_shape {1, 1, 1, 1};
+    std::vector<int> y_shape {1, 1, 2, 2};
+    std::vector<float> x_std {
+        1, 2, 3,
+        4, 5, 6,
+        7, 8, 9
+    };
+    std::vector<float> y_std {12.5, 16.5, 24.5, 28.5};
+    std::vector<float> dw_std {12, 16, 24, 28};
+    std::vector<float> db_std {4};
+    std::vector<float> dx_std {
+        1, 2, 1,
+        2, 4, 2,
+        1, 2, 1
+    };
+
+    ConvDescriptor convSpec("conv", 0, 0, 1, 1, 1, 1);
+    Tensor<float> x(x_std, x_shape);
+    Tensor<float> w(1, w_shape);
+    Tensor<float> b(0.5, b_shape);
+    Tensor<float> y(y_shape);
+    Tensor<float> dy(1, y_shape);
+    Tensor<float> dw(w_shape);
+    Tensor<float> db(b_shape);
+    Tensor<float> dx(x_shape);
+
+    ConvolutionOp<float>::ConvForward(handle, convSpec, x, w, &b, y);
+    testSame(y, y_std, std::string("Conv forward output-yData"));
+    ConvolutionOp<float>::ConvBackwardWeight(handle, convSpec,
+            dy, x, dw, &db);
+    testSame(dw, dw_std, std::string("Conv backward delta_weight-dwData"));
+    testSame(db, db_std, std::string("Conv backward delta_bias-dbData"));
+    ConvolutionOp<float>::ConvBackwardData(handle, convSpec, dy, w, dx);
+    testSame(dx, dx_std, std::string("Conv backward delta_input-dxData"));
+
+    ConvDescriptor deconvSpec("deconv", 0, 0, 1, 1, 1, 1);
+    Tensor<float> deconv_y(x_shape);
+    DeconvolutionOp<float>::DeconvForward(handle, deconvSpec,
+            dy, w, nullptr, deconv_y);
+    testSame(deconv_y, dx_std, std::string("Deconv forward output-yData"));
+}
+
+void testPooling(ExecContext& handle) {
+    std::vector<int> x_shape {1, 1, 4, 4};
+    std::vector<int> y_shape {1, 1, 2, 2};
+    std::vector<int> y_shape_pad {1, 1, 3, 3};
+    std::vector<float> x_std {
+        2, 2, 2, 2,
+        2, 1, 1, 2,
+        2, 1, 1, 2,
+        2, 2, 2, 3
+    };
+    std::vector<float> y_std_avg_notincludepad {
+        2, 2, 2,
+        2, 1, 2,
+        2, 2, 3
+    };
+    std::vector<float> y_std_avg_nopad {1.75, 1.75, 1.75, 2};
+    std::vector<float> y_std_max_nopad {2, 2, 2, 3};
+    std::vector<float> dx_std_avg_nopad {
+        0.25, 0.25, 0.25, 0.25,
+        0.25, 0.25, 0.25, 0.25,
+        0.25, 0.25, 0.25, 0.25,
+        0.25, 0.25, 0.25, 0.25
+    };
+    std::vector<float> dx_std_max_nopad {
+        1, 0, 1, 0,
+        0, 0, 0, 0,
+        1, 0, 0, 0,
+        0, 0, 0, 1
+    };
+
+    PoolingDescriptor avgPoolDescPadding("avg", 2, 2, 1, 1, 2, 2);
+    PoolingDescriptor avgPoolDescNoPadding("avg", 2, 2, 0, 0, 2, 2);
+    PoolingDescriptor maxPoolDescNoPadding("max", 2, 2, 0, 0, 2, 2);
+    Tensor<float> x(x_std, x_shape);
+    Tensor<float> y(y_shape);
+    Tensor<float> y_pad(y_shape_pad);
+    Tensor<float> dy(1, y_shape);
+    Tensor<float> dx(x_shape);
+
+    PoolingOp<float>::PoolingForward(handle, avgPoolDescPadding, x, y_pad);
+    testSame(y_pad, y_std_avg_notincludepad,
+            std::string("Avgpool forward with padding-yData"));
+    PoolingOp<float>::PoolingForward(handle, avgPoolDescNoPadding, x, y);
+    testSame(y, y_std_avg_nopad,
+            std::string("Avgpool forward without padding-yData"));
+    PoolingOp<float>::PoolingBackward(handle, avgPoolDescNoPadding,
+            x, y, dy, dx);
+    testSame(dx, dx_std_avg_nopad,
+            std::string("Avgpool backward without padding-dxData"));
+
+    PoolingOp<float>::PoolingForward(handle, maxPoolDescNoPadding, x, y);
+    testSame(y, y_std_max_nopad,
+            std::string("Maxpool forward without padding-yData"));
+    PoolingOp<float>::PoolingBackward(handle, maxPoolDescNoPadding,
+            x, y, dy, dx);
+    testSame(dx, dx_std_max_nopad,
+            std::string("Maxpool backward without padding-dxData"));
+
+    // Indices kept in a context give the same gradient as searching again
+    PoolingContext context;
+    PoolingOp<float>::PoolingForward(handle, maxPoolDescNoPadding,
+            x, y, &context);
+    PoolingOp<float>::PoolingBackward(handle, maxPoolDescNoPadding,
+            x, y, dy, dx, &context);
+    testSame(dx, dx_std_max_nopad,
+            std::string("Maxpool backward with context-dxData"));
+
+    // Overlapping, padded windows
+    PoolingDescriptor maxPoolDescOverlap("max", 3, 3, 1, 1, 1, 1);
+    std::vector<float> dy_std(16);
+    for (size_t i = 0; i < dy_std.size(); i++)
+        dy_std[i] = float(i % 3 + 1);
+    Tensor<float> y_overlap(x_shape);
+    Tensor<float> dy_overlap(dy_std, x_shape);
+    Tensor<float> dx_overlap(x_shape);
+    Tensor<float> dx_context(x_shape);
+    PoolingOp<float>::PoolingForward(handle, maxPoolDescOverlap,
+            x, y_overlap);
+    PoolingOp<float>::PoolingBackward(handle, maxPoolDescOverlap,
+            x, y_overlap, dy_overlap, dx_overlap);
+    PoolingOp<float>::PoolingForward(handle, maxPoolDescOverlap,
+            x, y_overlap, &context);
+    PoolingOp<float>::PoolingBackward(handle, maxPoolDescOverlap,
+            x, y_overlap, dy_overlap, dx_context, &context);
+    testSame(dx_context, dx_overlap,
+            std::string("Maxpool overlapping windows with context-dxData"));
+
+    // Windows over 256 elements need 16-bit indices
+    PoolingDescriptor maxPoolDescLarge("max", 17, 17, 0, 0, 3, 3);
+    std::vector<int> x_shape_large {1, 2, 20, 20};
+    std::vector<int> y_shape_large {1, 2, 2, 2};
+    std::vector<float> x_std_large(2 * 20 * 20);
+    for (size_t i = 0; i < x_std_large.size(); i++)
+        x_std_large[i] = float((i * 37) % 101);
+    Tensor<float> x_large(x_std_large, x_shape_large);
+    Tensor<float> y_large(y_shape_large);
+    Tensor<float> dy_large(1, y_shape_large);
+    Tensor<float> dx_large(x_shape_large);
+    Tensor<float> dx_large_context(x_shape_large);
+    PoolingOp<float>::PoolingBackward(handle, maxPoolDescLarge,
+            x_large, y_large, dy_large, dx_large);
+    PoolingOp<float>::PoolingForward(handle, maxPoolDescLarge,
+            x_large, y_large, &context);
+    PoolingOp<float>::PoolingBackward(handle, maxPoolDescLarge,
+            x_large, y_large, dy_large, dx_large_context, &context);
+    testSame(dx_large_context, dx_large,
+            std::string("Maxpool 16-bit indices with context-dxData"));
+}
+
+void testFullyConnect(ExecContext& handle) {
+    std::vector<int> x_shape {2, 3, 1, 1};
+    std::vector<int> w_shape {2, 3, 1, 1};
+    std::vector<int> b_shape {2, 1, 1, 1};
+    std::vector<int> y_shape {2, 2, 1, 1};
+    std::vector<float> x_std {1, 2, 3, 4, 5, 6};
+    std::vector<float> w_std {1, 0, 1, 0, 1, 0};
+    std::vector<float> b_std {1, 2};
+    std::vector<float> dy_std {1, 0, 0, 1};
+    std::vector<float> y_std {5, 4, 11, 7};
+    std::vector<float> dw_std {1, 2, 3, 4, 5, 6};
+    std::vector<float> db_std {1, 1};
+    std::vector<float> dx_std {1, 0, 1, 0, 1, 0};
+
+    Tensor<float> x(x_std, x_shape);
+    Tensor<float> w(w_std, w_shape);
+    Tensor<float> b(b_std, b_shape);
+    Tensor<float> y(y_shape);
+    Tensor<float> dy(dy_std, y_shape);
+    Tensor<float> dw(w_shape);
+    Tensor<float> db(b_shape);
+    Tensor<float> dx(x_shape);
+
+    FullyConnectOp<float>::FullyConnectForward(handle, x, w, &b, y);
+    testSame(y, y_std, std::string("FC forward output-yData"));
+    FullyConnectOp<float>::FullyConnectBackwardWeight(handle,
+            dy, x, dw, &db);
+    testSame(dw, dw_std, std::string("FC backward delta_weight-dwData"));
+    testSame(db, db_std, std::string("FC backward delta_bias-dbData"));
+    FullyConnectOp<float>::FullyConnectBackwardData(handle, dy, w, dx);
+    testSame(dx, dx_std, std::string("FC backward delta_input-dxData"));
+
+    // Enough rows for the two level dbias reduction
+    int batch = 1500, outputs = 40;
+    std::vector<int> big_w_shape {outputs, 3};
+    std::vector<int> big_b_shape {outputs};
+    std::vector<int> big_y_shape {batch, outputs};
+    std::vector<float> big_dy_std(batch * outputs);
+    std::vector<float> big_db_std(outputs, 0.0f);
+    for (size_t i = 0; i < big_dy_std.size(); i++) {
+        big_dy_std[i] = float((i * 7) % 5) - 2;
+        big_db_std[i % outputs] += big_dy_std[i];
+    }
+    Tensor<float> big_x(1, {batch, 3}), big_dw(big_w_shape);
+    Tensor<float> big_db(big_b_shape);
+    Tensor<float> big_dy(big_dy_std, big_y_shape);
+    FullyConnectOp<float>::FullyConnectBackwardWeight(handle,
+            big_dy, big_x, big_dw, &big_db);
+    testSame(big_db, big_db_std, std::string("FC backward large batch dbias"));
+}
+
+void testTensorViews(ExecContext& handle) {
+    // FC on a reshape of a 3d tensor
+    std::vector<float> x_std(24);
+    for (size_t i = 0; i < x_std.size(); i++)
+        x_std[i] = float(i % 5) - 2;
+    std::vector<int> x_shape {2, 3, 4};
+    Tensor<float> x(x_std, x_shape);
+    Tensor<float> w(1, {2, 4});
+    Tensor<float> y({6, 2});
+    Tensor<float> y_rows({2, 2});
+    // Temporary views straight into async operators: the queued bodies
+    // still read them after the statement
+    bool async = handle.async();
+    handle.setAsync(true);
+    FullyConnectOp<float>::FullyConnectForward(handle, x.reshape({6, 4}),
+            w, nullptr, y);
+    FullyConnectOp<float>::FullyConnectForward(handle,
+            x.reshape({6, 4}).slice(0, 2, 4), w, nullptr, y_rows);
+    handle.setAsync(async);
+    std::vector<float> y_std(12);
+    for (int i = 0; i < 6; i++) {
+        float sum = 0;
+        for (int j = 0; j < 4; j++)
+            sum += x_std[i * 4 + j];
+        y_std[i * 2] = y_std[i * 2 + 1] = sum;
+    }
+    testSame(y, y_std, std::string("View reshape into FC forward"));
+    testSame(y_rows, std::vector<float>(y_std.begin() + 4, y_std.begin() + 8),
+            std::string("View slice into FC forward"));
+
+    // Writes through a slice land in the parent
+    Tensor<float> second = x.slice(0, 1, 2);
+    second.reset(7.0f);
+    for (size_t i = 12; i < x_std.size(); i++)
+        x_std[i] = 7.0f;
+    testSame(x, x_std, std::string("View slice write-through"));
+
+    Tensor<float> column = x.slice(2, 1, 2);
+    Tensor<uint8_t> bytes = x.view<uint8_t>();
+    // Dropping a view does not wait for the work queued on the storage
+    Tensor<float> copy = x.clone(handle);
+    { Tensor<float> flat = x.reshape({24}); }
+    bool passed = (!handle.async() || x.pending() != nullptr) &&
+        !column.contiguous() && column.size() == 6 &&
+        column.data() == x.data() + 1 && column.strides() == x.strides() &&
+        second.contiguous() && second.data() == x.data() + 12 &&
+        bytes.dim(2) == 16 && bytes.size() == 96 &&
+        static_cast<void*>(bytes.data()) == static_cast<void*>(x.data());
+    std::cerr << "View strides and types"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+void testTensorMove(ExecContext& handle) {
+    std::vector<float> a_std(1000);
+    for (size_t i = 0; i < a_std.size(); i++)
+        a_std[i] = float(i % 9) - 4;
+    std::vector<int> shape {10, 100};
+
+    // Moves keep the storage, the vector never copies a tensor
+    std::vector<Tensor<float>> tensors;
+    for (int i = 0; i < 4; i++)
+        tensors.emplace_back(a_std, shape);
+    Tensor<float> a(std::move(tensors[0]));
+    float* storage = a.data();
+    tensors[0] = std::move(a);
+    bool passed = tensors[0].data() == storage && a.data() == nullptr &&
+        a.size() == 0 && tensors[3].dims() == shape &&
+        std::is_nothrow_move_constructible<Tensor<float>>::value;
+
+    // The clone does not alias, later writes to the source stay out
+    Tensor<float> b = tensors[1].clone(handle);
+    passed = b.data() != tensors[1].data() && b.dims() == shape && passed;
+    tensors[1].reset(0.0f);
+    std::cerr << "Tensor move"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+    testSame(b, a_std, std::string("Tensor clone"));
+}
+
+void testHostTransfer(ExecContext& handle) {
+    std::vector<float> a_std(4096), b_std(4096);
+    for (size_t i = 0; i < a_std.size(); i++) {
+        a_std[i] = float(i % 13) - 6;
+        b_std[i] = a_std[i] * 2;
+    }
+    std::vector<int> shape {64, 64};
+    Tensor<float> a(shape);
+    HostTransfer upload = a.copyFromHostAsync(handle, a_std.data());
+    a *= 2;
+    upload.wait();
+    testSame(a, b_std, std::string("Host transfer upload"));
+
+    // The download is ordered after the op writing the tensor
+    Tensor<float> b(a_std, shape);
+    OperatorsFunc<float>::gemmImpl(handle, BLAS_OP_N, BLAS_OP_N,
+            64, 64, 64, 0, a, a, 2, b);
+    std::vector<float> host(4096, 0.0f);
+    HostTransfer download = b.copyToHostAsync(handle, host.data());
+    download.wait();
+    std::ostringstream msg;
+    bool passed = download.ready() && a.equal(host, msg, false);
+    std::cerr << "Host transfer download"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+void testCrossEntropy(ExecContext& handle) {
+    // Large logits in the second sample check the max shift
+    int batch = 3, classes = 5;
+    std::vector<int> x_shape {batch, classes, 1, 1};
+    std::vector<int> loss_shape {1};
+    std::vector<float> x_std {1, 2, 3, 4, 5,
+        1000, 1001, 999, 1000, 998,
+        -1, 0.5f, 0, 2, -3};
+    std::vector<int> label_std {4, 1, 0};
+    std::vector<float> loss_std(1, 0.0f), dx_std(batch * classes);
+    for (int n = 0; n < batch; n++) {
+        const float* row = x_std.data() + n * classes;
+        float rowMax = *std::max_element(row, row + classes);
+        double sum = 0;
+        for (int i = 0; i < classes; i++)
+            sum += std::exp(row[i] - rowMax);
+        loss_std[0] += (rowMax + std::log(sum) - row[label_std[n]]) / batch;
+        for (int i = 0; i < classes; i++)
+            dx_std[n * classes + i] = 2.0f / batch *
+                (std::exp(row[i] - rowMax) / sum - (i == label_std[n]));
+    }
+
+    Tensor<float> x(x_std, x_shape), loss(loss_shape), dloss(2, loss_shape);
+    Tensor<float> dx(x_shape);
+    Tensor<int> labels(label_std, {batch});
+    CrossEntropyOp<float>::CrossEntropyForward(handle, x, labels, loss);
+    CrossEntropyOp<float>::CrossEntropyBackward(handle, x, labels, dloss, dx);
+    testSame(loss, loss_std, std::string("Cross entropy forward"));
+    testSame(dx, dx_std, std::string("Cross entropy backward"));
+}
+
+void testPlans(ExecContext& handle) {
+    std::vector<int> x_shape {2, 3, 6, 6};
+    std::vector<int> w_shape {4, 3, 3, 3};
+    std::vector<int> b_shape {4};
+    std::vector<int> y_shape {2, 4, 6, 6};
+    std::vector<int> p_shape {2, 4, 3, 3};
+    std::vector<int> fw_shape {5, 36};
+    std::vector<int> f_shape {2, 5};
+    std::vector<float> x_std(2 * 3 * 6 * 6), w_std(4 * 3 * 3 * 3);
+    for (size_t i = 0; i < x_std.size(); i++)
+        x_std[i] = float((i * 7) % 11) - 5;
+    for (size_t i = 0; i < w_std.size(); i++)
+        w_std[i] = float((i * 3) % 5) - 2;
+    std::vector<float> fw_std(5 * 36);
+    for (size_t i = 0; i < fw_std.size(); i++)
+        fw_std[i] = float((i * 3) % 5) - 2;
+    ConvDescriptor convSpec("conv", 1, 1, 1, 1, 1, 1);
+    PoolingDescriptor poolSpec("max", 2, 2, 0, 0, 2, 2);
+    Tensor<float> x(x_std, x_shape), w(w_std, w_shape), b(1, b_shape);
+    Tensor<float> fw(fw_std, fw_shape);
+    Tensor<float> y(y_shape), p(p_shape), f(f_shape);
+    Tensor<float> dp(1, p_shape), dy(y_shape), dx(x_shape), dw(w_shape);
+    Tensor<float> y_ref(y_shape), p_ref(p_shape), f_ref(f_shape);
+    Tensor<float> dy_ref(y_shape), dx_ref(x_shape), dw_ref(w_shape);
+
+    ConvPlan<float> conv = ConvolutionOp<float>::Prepare(handle, convSpec,
+            x_shape, w_shape, y_shape);
+    PoolingPlan<float> pool = PoolingOp<float>::Prepare(handle, poolSpec,
+            y_shape, p_shape);
+    FullyConnectPlan<float> fc = FullyConnectOp<float>::Prepare(handle,
+            p_shape, fw_shape, f_shape);
+    // Run twice, the second time on what the first one set up
+    for (int i = 0; i < 2; i++) {
+        conv.Forward(x, w, &b, y);
+        pool.Forward(y, p);
+        fc.Forward(p, fw, nullptr, f);
+        pool.Backward(y, p, dp, dy);
+        conv.BackwardData(dy, w, dx);
+        conv.BackwardWeight(dy, x, dw, nullptr);
+    }
+
+    ConvolutionOp<float>::ConvForward(handle, convSpec, x, w, &b, y_ref);
+    PoolingOp<float>::PoolingForward(handle, poolSpec, y_ref, p_ref);
+    FullyConnectOp<float>::FullyConnectForward(handle, p_ref, fw, nullptr,
+            f_ref);
+    PoolingOp<float>::PoolingBackward(handle, poolSpec, y_ref, p_ref,
+            dp, dy_ref);
+    ConvolutionOp<float>::ConvBackwardData(handle, convSpec, dy_ref, w,
+            dx_ref);
+    ConvolutionOp<float>::ConvBackwardWeight(handle, convSpec, dy_ref, x,
+            dw_ref, nullptr);
+    testSame(y, y_ref, std::string("Plan conv forward"));
+    testSame(p, p_ref, std::string("Plan pooling forward"));
+    testSame(f, f_ref, std::string("Plan FC forward"));
+    // The activation goes into the same GEMM as the bias
+    ActivationDescriptor leaky("leakyrelu", 0.1f);
+    Tensor<float> fb(-0.5f, {f_shape[1]}), f_act(f_shape), f_bias(f_shape);
+    fc.Forward(p, fw, &fb, leaky, f_act);
+    FullyConnectOp<float>::FullyConnectForward(handle, p_ref, fw, &fb,
+            f_bias);
+    Tensor<float> f_act_ref(maximum(f_bias, 0.0f) +
+            0.1f * minimum(f_bias, 0.0f));
+    testSame(f_act, f_act_ref, std::string("Plan FC forward bias leaky relu"));
+    testSame(dy, dy_ref, std::string("Plan pooling backward"));
+    testSame(dx, dx_ref, std::string("Plan conv backward data"));
+    testSame(dw, dw_ref, std::string("Plan conv backward weight"));
+}
+
+void testConvBiasActivation(ExecContext& handle) {
+    std::vector<int> x_shape {2, 4, 6, 6};
+    std::vector<int> w_shape {4, 3, 3, 3};
+    std::vector<int> c_shape {2, 3, 6, 6};
+    std::vector<float> x_std(2 * 4 * 6 * 6), w_std(4 * 3 * 3 * 3);
+    for (size_t i = 0; i < x_std.size(); i++)
+        x_std[i] = float((i * 7) % 11) - 5;
+    for (size_t i = 0; i < w_std.size(); i++)
+        w_std[i] = float((i * 3) % 5) - 2;
+    Tensor<float> x(x_std, x_shape), w(w_std, w_shape);
+    ActivationDescriptor relu("relu");
+    ActivationDescriptor leaky("leakyrelu", 0.1f);
+    ActivationDescriptor clipped("clippedrelu", 6.0f);
+
+    // x of conv and y of deconv are the 3 channel tensors
+    for (std::string mode : {"conv", "deconv"}) {
+        bool deconv = mode == "deconv";
+        ConvDescriptor convSpec(mode, 1, 1, 1, 1, 1, 1);
+        const std::vector<int>& in_shape = deconv ? x_shape : c_shape;
+        const std::vector<int>& out_shape = deconv ? c_shape : x_shape;
+        std::vector<int> b_shape {out_shape[1]};
+        std::vector<float> b_std(out_shape[1]);
+        for (size_t i = 0; i < b_std.size(); i++)
+            b_std[i] = float(i) - 1.5f;
+        Tensor<float> in(std::vector<float>(x_std.begin(), x_std.begin() +
+                in_shape[0] * in_shape[1] * in_shape[2] * in_shape[3]),
+                in_shape);
+        Tensor<float> b(b_std, b_shape), y(out_shape), y_ref(out_shape);
+        ConvolutionOp<float>::ConvForward(handle, convSpec, in, w, &b, y_ref);
+
+        ConvolutionOp<float>::ConvBiasActivationForward(handle, convSpec,
+                relu, in, w, &b, y);
+        Tensor<float> relu_ref(maximum(y_ref, 0.0f));
+        testSame(y, relu_ref, "Fused " + mode + " bias relu");
+        ConvolutionOp<float>::ConvBiasActivationForward(handle, convSpec,
+                leaky, in, w, &b, y);
+        Tensor<float> leaky_ref(maximum(y_ref, 0.0f) +
+                0.1f * minimum(y_ref, 0.0f));
+        testSame(y, leaky_ref, "Fused " + mode + " bias leaky relu");
+        ConvolutionOp<float>::ConvBiasActivationForward(handle, convSpec,
+                clipped, in, w, &b, y);
+        Tensor<float> clipped_ref(minimum(maximum(y_ref, 0.0f), 6.0f));
+        testSame(y, clipped_ref, "Fused " + mode + " bias clipped relu");
+    }
+}
+
+void testConvAlgoPolicy() {
+    std::vector<ConvAlgoEntry> candidates(3);
+    float times[] = {1.0f, 1.05f, 3.0f};
+    size_t sizes[] = {1000, 100, 0};
+    for (int i = 0; i < 3; i++) {
+        candidates[i].algo = i;
+        candidates[i].time = times[i];
+        candidates[i].workSpaceSize = sizes[i];
+    }
+    size_t unlimited = WorkspaceArena::UNLIMITED;
+    ConvAlgoPolicy fastest = ConvAlgoPolicy::parse("fastest");
+    ConvAlgoPolicy smallest = ConvAlgoPolicy::parse("smallest");
+    ConvAlgoPolicy within10 = ConvAlgoPolicy::parse("within:10");
+    ConvAlgoPolicy within1 = ConvAlgoPolicy::parse("within:1");
+    bool passed = selectConvAlgo(candidates, unlimited, fastest) == 0 &&
+        selectConvAlgo(candidates, unlimited, smallest) == 2 &&
+        selectConvAlgo(candidates, unlimited, within10) == 1 &&
+        selectConvAlgo(candidates, unlimited, within1) == 0 &&
+        selectConvAlgo(candidates, 500, fastest) == 1 &&
+        selectConvAlgo(candidates, 0, within10) == 2;
+    candidates.pop_back();
+    passed = selectConvAlgo(candidates, 50, fastest) == -1 && passed;
+    std::cerr << "Conv algo policy"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+void testHostConvAlgos(HostHandle& handle) {
+    // Odd output sizes leave partial Winograd tiles
+    HostConvShape shape;
+    shape.batch = 2;
+    shape.imChannels = 3;
+    shape.imH = 7;
+    shape.imW = 5;
+    shape.outChannels = 4;
+    shape.outH = 7;
+    shape.outW = 5;
+    shape.kernelH = shape.kernelW = 3;
+    shape.padH = shape.padW = 1;
+    // Grouped, strided and dilated, only direct and im2col apply
+    HostConvShape strided = shape;
+    strided.group = 2;
+    strided.imChannels = 4;
+    strided.imH = strided.imW = 9;
+    strided.strideH = strided.strideW = 2;
+    strided.dilationH = strided.dilationW = 2;
+    strided.padH = 2;
+    strided.padW = 1;
+    strided.outH = 5;
+    strided.outW = 4;
+
+    ThreadPool& pool = handle.threadPool();
+    bool passed = true;
+    for (const HostConvShape& s : {shape, strided}) {
+        size_t wSize = static_cast<size_t>(s.outChannels) * s.colRows();
+        std::vector<float> im(s.batch * s.imSize()), w(wSize);
+        for (size_t i = 0; i < im.size(); i++)
+            im[i] = float((i * 7) % 13) - 6;
+        for (size_t i = 0; i < w.size(); i++)
+            w[i] = float((i * 5) % 7) - 3;
+        size_t outSize = static_cast<size_t>(s.batch) * s.outSize();
+        std::vector<float> ref(outSize), out(outSize);
+        std::vector<float> col(HostFunc<float>::convWorkspaceSize(pool, s,
+                false, false));
+        std::vector<float> bias(s.outChannels);
+        for (size_t i = 0; i < bias.size(); i++)
+            bias[i] = float(i) - 2;
+        GemmEpilogue<float> epilogue;
+        epilogue.bias = bias.data();
+        epilogue.activation = HostActivation::ClippedRelu;
+        epilogue.alpha = 20;
+        HostFunc<float>::convForward(pool, s, im.data(), w.data(),
+                ref.data(), col.data(), col.size(), &epilogue);
+        HostFunc<float>::convForwardDirect(pool, s, im.data(), w.data(),
+                out.data(), &epilogue);
+        for (size_t i = 0; i < outSize; i++)
+            passed = passed && std::abs(out[i] - ref[i]) < FLOATERR;
+        if (!HostFunc<float>::winogradApplies(s)) continue;
+        std::vector<float> scratch(HostFunc<float>::winogradWorkspaceSize(s));
+        HostFunc<float>::convForwardWinograd(pool, s, im.data(), w.data(),
+                out.data(), scratch.data(), &epilogue);
+        for (size_t i = 0; i < outSize; i++)
+            passed = passed && std::abs(out[i] - ref[i]) < FLOATERR;
+    }
+    passed = !HostFunc<float>::winogradApplies(strided) && passed;
+
+    // Without workspace only the direct convolution is left
+    std::vector<int> x_shape {2, 3, 7, 5}, w_shape {4, 3, 3, 3};
+    std::vector<int> y_shape {2, 4, 7, 5};
+    ConvDescriptor convSpec("conv", 1, 1, 1, 1, 1, 1);
+    ConvDescriptor noWorkspace = convSpec;
+    noWorkspace.workspaceLimit = 0;
+    Tensor<float> x(1, x_shape), w(1, w_shape), y(y_shape), y_ref(y_shape);
+    ConvolutionOp<float>::ConvForward(handle, convSpec, x, w, nullptr, y_ref);
+    ConvolutionOp<float>::ConvForward(handle, noWorkspace, x, w, nullptr, y);
+    // The search runs with the queued forward
+    y.wait();
+    ConvAlgoEntry entry;
+    std::ostringstream msg;
+    std::string key = makeConvSearchKey(makeConvProblemKey<float>(
+            ConvDirection::Forward, convSpec, x_shape, w_shape, y_shape),
+            0, handle.workspace().policy());
+    passed = ConvAlgoCache::instance().find(handle.deviceId(), key, entry) &&
+        entry.algo == static_cast<int>(HostConvAlgo::Direct) &&
+        y.equal(y_ref, msg, false) && passed;
+    std::cerr << "Host conv algorithms"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+void testConvAlgoCache() {
+    ConvAlgoCache& cache = ConvAlgoCache::instance();
+    ConvDescriptor convSpec("conv", 1, 1, 1, 1);
+    std::vector<int> x_shape {32, 3, 224, 224};
+    std::vector<int> w_shape {64, 3, 3, 3};
+    std::vector<int> y_shape {32, 64, 224, 224};
+    std::string fwd = makeConvProblemKey<float>(ConvDirection::Forward,
+            convSpec, x_shape, w_shape, y_shape);
+    std::string bwd = makeConvProblemKey<float>(ConvDirection::BackwardData,
+            convSpec, x_shape, w_shape, y_shape);
+    CHECK_ARGS(fwd == "fwd-conv-f32-x32x3x224x224-w64x3x3x3-"
+            "y32x64x224x224-g1-p1x1-s1x1-l1x1", "Unexpected problem key!");
+
+    cache.clear();
+    ConvAlgoEntry entry;
+    bool passed = !cache.find(0, fwd, entry);
+    entry.algo = 3;
+    entry.workSpaceSize = 1024;
+    cache.insert(0, fwd, entry);
+    entry = ConvAlgoEntry();
+    for (int i = 0; i < 4; i++)
+        passed = cache.find(0, fwd, entry) && passed;
+    passed = !cache.find(0, bwd, entry) && !cache.find(1, fwd, entry) &&
+        passed;
+    passed = passed && entry.algo == 3 && entry.workSpaceSize == 1024 &&
+        cache.hits() == 4 && cache.misses() == 3;
+    std::cerr << "Conv algo cache hits " << cache.hits() << " misses "
+            << cache.misses() << (passed ? " Test Passed!" : " Test Failed!")
+            << std::endl;
+    cache.clear();
+}
+
+void testTuningDb() {
+    char dir[] = "/tmp/test_tuning_XXXXXX";
+    CHECK_ARGS(mkdtemp(dir) != nullptr, "Cannot create temp dir!");
+    std::string rank0 = std::string(dir) + "/rank0.db";
+    std::string rank1 = std::string(dir) + "/rank1.db";
+    std::string merged = std::string(dir) + "/merged.db";
+
+    ConvAlgoEntry slow, fast;
+    slow.algo = 1;
+    slow.time = 2.0;
+    fast.algo = 2;
+    fast.time = 1.0;
+    fast.workSpaceSize = 4096;
+    TuningDb::append(rank0, "gfx906", "fwd-a", slow);
+    TuningDb::append(rank0, "host", "fwd-a", slow);
+    TuningDb::append(rank1, "gfx906", "fwd-a", fast);
+    TuningDb::append(rank1, "gfx906", "bwd-b", slow);
+    bool passed = TuningDb::merge({rank0, rank1}, merged);
+
+    // The host handle attached device -1 as "host" and only sees those
+    ConvAlgoCache& cache = ConvAlgoCache::instance();
+    std::string savedPath = cache.tuningDbPath();
+    cache.setTuningDbPath(merged);
+    ConvAlgoEntry entry;
+    passed = cache.find(-1, "fwd-a", entry) && entry.algo == 1 &&
+        !cache.find(-1, "bwd-b", entry) && passed;
+
+    // Results of new searches are appended and survive a reload
+    cache.insert(-1, "wrw-c", fast);
+    cache.setTuningDbPath(merged);
+    passed = cache.find(-1, "wrw-c", entry) && entry.algo == 2 &&
+        entry.workSpaceSize == 4096 && passed;
+
+    size_t gfx906 = 0;
+    TuningDb::load(merged, [&](const std::string& arch,
+            const std::string& key, const ConvAlgoEntry& record) {
+        if (arch != "gfx906") return;
+        gfx906++;
+        if (key == "fwd-a") passed = record.algo == 2 && passed;
+    });
+    passed = gfx906 == 2 && passed;
+    std::cerr << "Tuning db merge and reload"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+
+    // Repeated results are not appended, replaced ones go on compaction
+    auto records = [](const std::string& path) {
+        size_t count = 0;
+        TuningDb::load(path, [&count](const std::string&,
+                const std::string&, const ConvAlgoEntry&) { count++; });
+        return count;
+    };
+    TuningDb::append(rank0, "host", "fwd-a", slow);
+    passed = records(rank0) == 2;
+    TuningDb::append(rank0, "host", "fwd-a", fast);
+    TuningDb::append(rank0, "host", "fwd-a", slow);
+    passed = records(rank0) == 4 && TuningDb::compact(rank0) &&
+        records(rank0) == 2 && passed;
+    TuningDb::load(rank0, [&](const std::string& arch,
+            const std::string& key, const ConvAlgoEntry& record) {
+        if (arch == "host") passed = key == "fwd-a" && record.algo == 1 &&
+            passed;
+    });
+    std::cerr << "Tuning db dedupe and compaction"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+
+    cache.setTuningDbPath(savedPath);
+    cache.clear();
+    for (const std::string& file : {rank0, rank1, merged})
+        unlink(file.c_str());
+    rmdir(dir);
+}
+
+void testMemoryPool() {
+    // A private device id keeps the tensors of the other tests out
+    MemoryPool& pool = MemoryPool::get(Backend::Host, 1000);
+    int stream = 0;
+    bool passed = true;
+
+    // Three small blocks are split from one segment and coalesce back
+    void* a = pool.allocate(1000);
+    void* b = pool.allocate(3000);
+    void* c = pool.allocate(100);
+    passed = pool.stats().backendAllocations == 1 &&
+        pool.stats().inUse == 1024 + 3072 + 512 && passed;
+    pool.release(b);
+    pool.release(a);
+    pool.release(c);
+    MemoryPoolStats stats = pool.stats();
+    passed = stats.inUse == 0 &&
+        stats.largestFree == MemoryPool::SMALL_SEGMENT &&
+        stats.fragmentation() == 0 && passed;
+
+    // Cached blocks are reused, but only on the stream that freed them
+    for (int i = 0; i < 10; i++)
+        pool.release(pool.allocate(5 << 20));
+    passed = pool.stats().backendAllocations == 2 && passed;
+    void* other = pool.allocate(5 << 20, &stream);
+    passed = pool.stats().backendAllocations == 3 && passed;
+    pool.release(other);
+
+    // A block released after queued work stays in use until it is done
+    std::shared_ptr<HostEvent> event = std::make_shared<HostEvent>(nullptr);
+    void* held = pool.allocate(5 << 20);
+    pool.release(held, event);
+    void* next = pool.allocate(5 << 20);
+    passed = next != held && pool.stats().inUse == (10 << 20) && passed;
+    event->complete();
+    passed = pool.stats().inUse == (5 << 20) && passed;
+    pool.release(next);
+    passed = pool.stats().backendAllocations == 3 && passed;
+
+    // Over the release threshold whole free segments go back, largest
+    // first, so both 20 MB segments are freed and the small one stays
+    pool.setMaxCached(MemoryPool::LARGE_SEGMENT);
+    stats = pool.stats();
+    passed = stats.reserved == MemoryPool::SMALL_SEGMENT &&
+        stats.backendFrees == 2 && passed;
+    pool.emptyCache();
+    stats = pool.stats();
+    passed = stats.reserved == 0 && stats.peakInUse == (10 << 20) && passed;
+    std::cerr << "Memory pool " << stats
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+void testWorkspaceArena() {
+    // Enough images for every thread to take its own im2col buffer
+    HostHandle handle(4);
+    WorkspaceArena& arena = handle.workspace();
+    std::vector<int> x_shape {8, 2, 6, 6};
+    std::vector<int> w_shape {3, 2, 3, 3};
+    std::vector<int> y_shape {8, 3, 6, 6};
+    std::vector<float> x_std(8 * 2 * 6 * 6), w_std(3 * 2 * 3 * 3);
+    for (size_t i = 0; i < x_std.size(); i++)
+        x_std[i] = float(int(i % 5) - 2);
+    for (size_t i = 0; i < w_std.size(); i++)
+        w_std[i] = float(int(i % 3) - 1);
+
+    ConvDescriptor convSpec("conv", 1, 1, 1, 1, 1, 1);
+    Tensor<float> x(x_std, x_shape);
+    Tensor<float> w(w_std, w_shape);
+    Tensor<float> y(y_shape), dw(w_shape);
+    Tensor<float> y_capped(y_shape), dw_capped(w_shape);
+    ConvolutionOp<float>::ConvForward(handle, convSpec, x, w, nullptr, y);
+    ConvolutionOp<float>::ConvBackwardWeight(handle, convSpec,
+            y, x, dw, nullptr);
+    // The arena is used by queued ops in async mode
+    handle.streamSynchronize();
+    size_t grows = arena.grows();
+    ConvolutionOp<float>::ConvForward(handle, convSpec, x, w, nullptr, y);
+    ConvolutionOp<float>::ConvBackwardWeight(handle, convSpec,
+            y, x, dw, nullptr);
+    handle.streamSynchronize();
+    // Both directions run on the one plan the first call prepared
+    bool passed = arena.grows() == grows && grows > 0 &&
+        handle.planCache().size() == 1;
+
+    // Capped at one column buffer the images run one after another
+    size_t serial = 2 * 3 * 3 * 6 * 6 * sizeof(float);
+    arena.setLimit(serial);
+    passed = arena.capacity() == 0 && passed;
+    ConvolutionOp<float>::ConvForward(handle, convSpec, x, w, nullptr,
+            y_capped);
+    ConvolutionOp<float>::ConvBackwardWeight(handle, convSpec,
+            y_capped, x, dw_capped, nullptr);
+    handle.streamSynchronize();
+    passed = arena.capacity() == serial && passed;
+    std::ostringstream msg;
+    passed = y.equal(y_capped, msg, false) &&
+        dw.equal(dw_capped, msg, false) && passed;
+    std::cerr << "Workspace arena high water " << arena.highWater()
+            << " B, " << arena.grows() << " grows"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+void testMemoryPlanner() {
+    // a and c are never alive together, b overlaps both, d is kept
+    MemoryPlanner planner;
+    int a = planner.buffer("a", 1000);
+    int b = planner.buffer("b", 300);
+    int c = planner.buffer("c", 600);
+    int d = planner.buffer("d", 100);
+    planner.layer({a, d});
+    planner.layer({a, b});
+    planner.layer({b, c});
+    planner.layer({c});
+    planner.keep(d);
+    planner.plan();
+    bool passed = planner.offset(a) == planner.offset(c) &&
+        planner.offset(b) >= 1024 && planner.offset(d) >= 1024 &&
+        planner.offset(b) != planner.offset(d) &&
+        planner.peak() == 1024 + 512 + 256 &&
+        planner.naive() == 1024 + 512 + 768 + 256;
+
+    // Tensors placed on the block keep it alive
+    std::vector<int> shape {4, 8};
+    std::unique_ptr<Tensor<float>> x;
+    {
+        std::shared_ptr<void> block = planner.allocate(Backend::Host);
+        x.reset(new Tensor<float>(block, planner.offset(b), shape));
+    }
+    x->reset(3.0f);
+    std::ostringstream msg;
+    passed = x->equal(std::vector<float>(32, 3.0f), msg, false) && passed;
+    std::cerr << "Memory planner"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+void testAsync() {
+    // Two async handles, the second consumes what the first produces
+    HostHandle producer(2), consumer(2), reference(1);
+    producer.setAsync(true);
+    consumer.setAsync(true);
+    reference.setAsync(false);
+    const int n = 64;
+    std::vector<float> a_std(n * n);
+    for (size_t i = 0; i < a_std.size(); i++)
+        a_std[i] = float(int(i % 5) - 2);
+    std::vector<int> shape {n * n};
+    Tensor<float> A(a_std, shape);
+    Tensor<float> B(a_std, shape);
+    Tensor<float> C(shape), D(shape), C_sync(shape), D_sync(shape);
+
+    OperatorsFunc<float>::gemmImpl(producer, BLAS_OP_N, BLAS_OP_N,
+            n, n, n, 1, A, B, 0, C);
+    bool passed = C.pending() != nullptr &&
+        C.pending()->owner() == &producer;
+    OperatorsFunc<float>::gemmImpl(consumer, BLAS_OP_N, BLAS_OP_T,
+            n, n, n, 1, C, B, 0, D);
+    passed = D.pending() != nullptr && D.pending()->owner() == &consumer &&
+        passed;
+
+    OperatorsFunc<float>::gemmImpl(reference, BLAS_OP_N, BLAS_OP_N,
+            n, n, n, 1, A, B, 0, C_sync);
+    OperatorsFunc<float>::gemmImpl(reference, BLAS_OP_N, BLAS_OP_T,
+            n, n, n, 1, C_sync, B, 0, D_sync);
+    passed = C_sync.pending() == nullptr && passed;
+    D.wait();
+    passed = D.ready() && passed;
+    std::ostringstream msg;
+    passed = D.equal(D_sync, msg, false) && passed;
+    std::cerr << "Async ops across handles"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+void testExpression(ExecContext& handle) {
+    const int n = 1000;
+    std::vector<float> a_std(n), b_std(n);
+    for (int i = 0; i < n; i++) {
+        a_std[i] = float(i % 7) + 1;
+        b_std[i] = float(i % 3) - 1;
+    }
+    std::vector<int> shape {n};
+    Tensor<float> a(a_std, shape), b(b_std, shape);
+
+    Tensor<float> c(a * 2 + b / 4 - 1);
+    a += b;
+    a *= 3;
+    Tensor<float> d(maximum(-b, 0) + sqrt(abs(a)) * exp(b - b));
+    std::vector<float> c_std(n), a3_std(n), d_std(n);
+    for (int i = 0; i < n; i++) {
+        c_std[i] = a_std[i] * 2 + b_std[i] / 4 - 1;
+        a3_std[i] = (a_std[i] + b_std[i]) * 3;
+        d_std[i] = std::max(-b_std[i], 0.0f) + std::sqrt(std::abs(a3_std[i]));
+    }
+    testSame(c, c_std, std::string("Expression scalar chain"));
+    testSame(a, a3_std, std::string("Expression compound assignment"));
+    testSame(d, d_std, std::string("Expression unary functions"));
+
+    // Compound assignment keeps converting the scalar to the tensor type
+    std::vector<int> i_std(n, 7);
+    Tensor<int> i_tensor(i_std, shape);
+    i_tensor /= 2.5;
+    i_tensor = i_tensor * i_tensor + 1;
+    testSame(i_tensor, std::vector<int>(n, 10), std::string(
+            "Expression integer tensor"));
+
+    // On a handle the expression is ordered after the queued clone and
+    // tags its operands instead of waiting for them
+    bool async = handle.async();
+    handle.setAsync(true);
+    Tensor<float> e = a.clone(handle);
+    Tensor<float> f(handle, e * 2 + b);
+    bool passed = f.pending() != nullptr && e.pending() == f.pending() &&
+        b.pending() == f.pending();
+    f.assign(handle, f - e);
+    handle.setAsync(async);
+    std::vector<float> f_std(n);
+    for (int i = 0; i < n; i++)
+        f_std[i] = a3_std[i] + b_std[i];
+    testSame(f, f_std, std::string("Expression on a handle"));
+    std::cerr << "Expression operands tagged"
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+}
+
+int main() {
+    // Searches of the tests go to a scratch tuning db, not to $HOME
+    char dbDir[] = "/tmp/test_backend_XXXXXX";
+    CHECK_ARGS(mkdtemp(dbDir) != nullptr, "Cannot create temp dir!");
+    std::string dbPath = std::string(dbDir) + "/tuning.db";
+    setenv("TEST_TUNING_DB", dbPath.c_str(), 1);
+    std::unique_ptr<ExecContext> handle = createExecContext();
+    std::cout << "Start operator tests on the "
+            << backendName(handle->backend()) << " backend" << std::endl;
+    if (handle->backend() == Backend::Host)
+        std::cout << "Host gemm kernel: "
+                << HostFunc<float>::gemmKernelName() << std::endl;
+
+    testGemm(*handle);
+    testConvolution(*handle);
+    testPooling(*handle);
+    testFullyConnect(*handle);
+    testCrossEntropy(*handle);
+    testTensorViews(*handle);
+    testTensorMove(*handle);
+    testHostTransfer(*handle);
+    testPlans(*handle);
+    testConvBiasActivation(*handle);
+    testConvAlgoCache();
+    testConvAlgoPolicy();
+    testExpression(*handle);
+    if (handle->backend() == Backend::Host) {
+        testHostConvAlgos(static_cast<HostHandle&>(*handle));
+        testTuningDb();
+        testMemoryPool();
+        testWorkspaceArena();
+        testMemoryPlanner();
+        testAsync();
+    }
+    handle.reset();
+    unlink(dbPath.c_str());
+    rmdir(dbDir);
+    return 0;
+}
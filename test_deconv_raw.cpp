@@ -1,4 +1,5 @@
 #include "test_helper.hpp"
+#include "test_operators.hpp"
     
 struct DeconvDescriptor {
     int deconvdim = 2;
@@ -104,6 +105,23 @@ void testDeconvForward(HipHandle& handle,
     handle.streamSynchronize();
     
     testSame(yData, y, std::string("Forward output-yData"));
+
+    // Host backend as reference
+    BackendGuard guard(Backend::Host);
+    HostHandle hostHandle;
+    ConvDescriptor convSpec("deconv",
+            deconvSpec.padding[0], deconvSpec.padding[1],
+            deconvSpec.stride[0], deconvSpec.stride[1],
+            deconvSpec.dilation[0], deconvSpec.dilation[1]);
+    std::unique_ptr<Tensor<T>> bHost;
+    if (-1 != bSpec[0])
+        bHost.reset(new Tensor<T>(b, bSpec));
+    Tensor<T> xHost(x, xSpec);
+    Tensor<T> wHost(w, wSpec);
+    Tensor<T> yHost(ySpec);
+    ConvolutionOp<T>::ConvForward(hostHandle, convSpec,
+            xHost, wHost, bHost.get(), yHost);
+    testSame(yHost, y, std::string("Host forward output-yData"));
 }
 
 template<typename T>
@@ -238,6 +256,27 @@ void testDeconvBackward(HipHandle& handle,
     
     testSame(dwData, dw, std::string("Backward delta_weight-dwData"));
     testSame(dxData, dx, std::string("Backward delta_input-dxData"));
+
+    // Host backend as reference
+    BackendGuard guard(Backend::Host);
+    HostHandle hostHandle;
+    ConvDescriptor convSpec("deconv",
+            deconvSpec.padding[0], deconvSpec.padding[1],
+            deconvSpec.stride[0], deconvSpec.stride[1],
+            deconvSpec.dilation[0], deconvSpec.dilation[1]);
+    Tensor<T> dyHost(T(1), dySpec);
+    Tensor<T> xHost(x, xSpec);
+    Tensor<T> wHost(w, wSpec);
+    Tensor<T> dwHost(dwSpec);
+    Tensor<T> dbHost(dbSpec);
+    Tensor<T> dxHost(dxSpec);
+    ConvolutionOp<T>::ConvBackwardWeight(hostHandle, convSpec,
+            dyHost, xHost, dwHost, &dbHost);
+    ConvolutionOp<T>::ConvBackwardData(hostHandle, convSpec,
+            dyHost, wHost, dxHost);
+    testSame(dwHost, dw, std::string("Host backward delta_weight-dwData"));
+    testSame(dbHost, db, std::string("Host backward delta_bias-dbData"));
+    testSame(dxHost, dx, std::string("Host backward delta_input-dxData"));
 }
 
 int main(int argc, char** argv) {
@@ -2,8 +2,12 @@
 #include "test_mpi.hpp"
 #include "test_operators.hpp"
 
-void RunSimpleVGG(HipHandle& handle){
-    const int batch_size = 32;
+// Activations, gradients and the loss of the training step share one
+// block laid out by a MemoryPlanner from the layer sequence below.
+// Parameters, the input and the labels are allocated on their own, the
+// parameter gradients live in GradientBuckets reduced over the ranks.
+void RunSimpleVGG(ExecContext& handle, Communicator& comm, int batch_size,
+        bool report){
     std::vector<int> input_shape = {batch_size, 3, 224, 224};
     std::vector<int> conv_weight_shape = {64, 3, 3, 3};
     std::vector<int> conv_bias_shape = {64, 1, 1, 1};
@@ -17,91 +21,257 @@ void RunSimpleVGG(HipHandle& handle){
     std::vector<int> fc_bias_shape = {1000, 1, 1, 1};
     std::vector<int> output_shape = {batch_size, 1000, 1, 1};
     std::vector<int> loss_shape = {1, 1, 1, 1};
+    std::vector<int> label_shape = {batch_size};
 
     ConvDescriptor convSpec("conv", 1, 1, 1, 1);
     PoolingDescriptor poolSpec("max", 2, 2, 0, 0, 2, 2);
-    
-    Tensor<float> input(1, input_shape);
+
+    // The batch comes from host memory, its upload is queued like an op
+    std::vector<float> host_input(batch_size * 3 * 224 * 224, 1.0f);
+    Tensor<float> input(input_shape);
+    HostTransfer upload = input.copyFromHostAsync(handle, host_input.data());
     Tensor<float> conv_weight(1, conv_weight_shape);
     Tensor<float> conv_bias(1, conv_bias_shape);
-    Tensor<float> conv_output(conv_output_shape);
-    Tensor<float> maxpool0_output(maxpool0_output_shape);
-    Tensor<float> maxpool1_output(maxpool1_output_shape);
-    Tensor<float> maxpool2_output(maxpool2_output_shape);
-    Tensor<float> maxpool3_output(maxpool3_output_shape);
-    Tensor<float> maxpool4_output(maxpool4_output_shape);
     Tensor<float> fc_weight(1, fc_weight_shape);
     Tensor<float> fc_bias(1, fc_bias_shape);
-    Tensor<float> output(output_shape);
-    Tensor<float> loss(loss_shape);
-
-    Tensor<float> input_grad(input_shape);
-    Tensor<float> conv_weight_grad(conv_weight_shape);
-    Tensor<float> conv_bias_grad(conv_bias_shape);
-    Tensor<float> conv_output_grad(conv_output_shape);
-    Tensor<float> maxpool0_output_grad(maxpool0_output_shape);
-    Tensor<float> maxpool1_output_grad(maxpool1_output_shape);
-    Tensor<float> maxpool2_output_grad(maxpool2_output_shape);
-    Tensor<float> maxpool3_output_grad(maxpool3_output_shape);
-    Tensor<float> maxpool4_output_grad(maxpool4_output_shape);
-    Tensor<float> fc_weight_grad(fc_weight_shape);
-    Tensor<float> fc_bias_grad(fc_bias_shape);
-    Tensor<float> output_grad(1, output_shape);
-    Tensor<float> loss_grad(loss_shape);
+    Tensor<float> loss_grad(1, loss_shape);
+    std::vector<int> label_std(batch_size);
+    for (int i = 0; i < batch_size; i++)
+        label_std[i] = i % 1000;
+    Tensor<int> label(label_std, label_shape);
+
+    MemoryPlanner planner;
+    auto planned = [&planner](const char* name,
+            const std::vector<int>& shape) {
+        return planner.buffer(name, sizeof(float) * std::accumulate(
+                shape.begin(), shape.end(), 1, std::multiplies<int>()));
+    };
+    int conv_output_id = planned("conv_output", conv_output_shape);
+    int maxpool0_output_id = planned("maxpool0_output", maxpool0_output_shape);
+    int maxpool1_output_id = planned("maxpool1_output", maxpool1_output_shape);
+    int maxpool2_output_id = planned("maxpool2_output", maxpool2_output_shape);
+    int maxpool3_output_id = planned("maxpool3_output", maxpool3_output_shape);
+    int maxpool4_output_id = planned("maxpool4_output", maxpool4_output_shape);
+    int output_id = planned("output", output_shape);
+    int loss_id = planned("loss", loss_shape);
+    int input_grad_id = planned("input_grad", input_shape);
+    int conv_output_grad_id = planned("conv_output_grad", conv_output_shape);
+    int maxpool0_output_grad_id = planned("maxpool0_output_grad",
+            maxpool0_output_shape);
+    int maxpool1_output_grad_id = planned("maxpool1_output_grad",
+            maxpool1_output_shape);
+    int maxpool2_output_grad_id = planned("maxpool2_output_grad",
+            maxpool2_output_shape);
+    int maxpool3_output_grad_id = planned("maxpool3_output_grad",
+            maxpool3_output_shape);
+    int maxpool4_output_grad_id = planned("maxpool4_output_grad",
+            maxpool4_output_shape);
+    int output_grad_id = planned("output_grad", output_shape);
+
+    // The same order as the calls below
+    planner.layer({conv_output_id});
+    planner.layer({conv_output_id, maxpool0_output_id});
+    planner.layer({maxpool0_output_id, maxpool1_output_id});
+    planner.layer({maxpool1_output_id, maxpool2_output_id});
+    planner.layer({maxpool2_output_id, maxpool3_output_id});
+    planner.layer({maxpool3_output_id, maxpool4_output_id});
+    planner.layer({maxpool4_output_id, output_id});
+    planner.layer({output_id, loss_id});
+    planner.layer({output_id, output_grad_id});
+    planner.layer({output_grad_id, maxpool4_output_grad_id});
+    planner.layer({output_grad_id, maxpool4_output_id});
+    planner.layer({maxpool3_output_id, maxpool4_output_id,
+            maxpool4_output_grad_id, maxpool3_output_grad_id});
+    planner.layer({maxpool2_output_id, maxpool3_output_id,
+            maxpool3_output_grad_id, maxpool2_output_grad_id});
+    planner.layer({maxpool1_output_id, maxpool2_output_id,
+            maxpool2_output_grad_id, maxpool1_output_grad_id});
+    planner.layer({maxpool0_output_id, maxpool1_output_id,
+            maxpool1_output_grad_id, maxpool0_output_grad_id});
+    planner.layer({conv_output_id, maxpool0_output_id,
+            maxpool0_output_grad_id, conv_output_grad_id});
+    planner.layer({conv_output_grad_id});
+    planner.layer({conv_output_grad_id, input_grad_id});
+    // What an optimizer would read after the step
+    planner.keep(loss_id);
+    planner.keep(input_grad_id);
+    planner.plan();
+    if (report)
+        std::cout << "Pid-" << getpid() << ": Memory plan "
+                << planner.report() << std::endl;
+
+    std::shared_ptr<void> block = planner.allocate(handle.backend());
+    auto tensor = [&planner, &block](int id, const std::vector<int>& shape) {
+        return Tensor<float>(block, planner.offset(id), shape);
+    };
+    auto conv_output = tensor(conv_output_id, conv_output_shape);
+    auto maxpool0_output = tensor(maxpool0_output_id, maxpool0_output_shape);
+    auto maxpool1_output = tensor(maxpool1_output_id, maxpool1_output_shape);
+    auto maxpool2_output = tensor(maxpool2_output_id, maxpool2_output_shape);
+    auto maxpool3_output = tensor(maxpool3_output_id, maxpool3_output_shape);
+    auto maxpool4_output = tensor(maxpool4_output_id, maxpool4_output_shape);
+    auto output = tensor(output_id, output_shape);
+    auto loss = tensor(loss_id, loss_shape);
+
+    auto input_grad = tensor(input_grad_id, input_shape);
+    auto conv_output_grad = tensor(conv_output_grad_id, conv_output_shape);
+    auto maxpool0_output_grad = tensor(maxpool0_output_grad_id,
+            maxpool0_output_shape);
+    auto maxpool1_output_grad = tensor(maxpool1_output_grad_id,
+            maxpool1_output_shape);
+    auto maxpool2_output_grad = tensor(maxpool2_output_grad_id,
+            maxpool2_output_shape);
+    auto maxpool3_output_grad = tensor(maxpool3_output_grad_id,
+            maxpool3_output_shape);
+    auto maxpool4_output_grad = tensor(maxpool4_output_grad_id,
+            maxpool4_output_shape);
+    auto output_grad = tensor(output_grad_id, output_shape);
+    PoolingContext maxpool_context[5];
+
+    // Added in the order the backward produces them, the FC bucket is
+    // reduced while the pooling and conv backward run
+    GradientBuckets<float> buckets(comm, handle);
+    int fc_bias_grad_id = buckets.add(fc_bias_shape);
+    int fc_weight_grad_id = buckets.add(fc_weight_shape);
+    int conv_bias_grad_id = buckets.add(conv_bias_shape);
+    int conv_weight_grad_id = buckets.add(conv_weight_shape);
+    buckets.build();
+    Tensor<float>& fc_bias_grad = buckets.grad(fc_bias_grad_id);
+    Tensor<float>& fc_weight_grad = buckets.grad(fc_weight_grad_id);
+    Tensor<float>& conv_bias_grad = buckets.grad(conv_bias_grad_id);
+    Tensor<float>& conv_weight_grad = buckets.grad(conv_weight_grad_id);
 
     ConvolutionOp<float>::ConvForward(handle, convSpec,
             input, conv_weight, &conv_bias, conv_output);
     PoolingOp<float>::PoolingForward(handle, poolSpec,
-            conv_output, maxpool0_output);
+            conv_output, maxpool0_output, &maxpool_context[0]);
     PoolingOp<float>::PoolingForward(handle, poolSpec,
-            maxpool0_output, maxpool1_output);
+            maxpool0_output, maxpool1_output, &maxpool_context[1]);
     PoolingOp<float>::PoolingForward(handle, poolSpec,
-            maxpool1_output, maxpool2_output);
+            maxpool1_output, maxpool2_output, &maxpool_context[2]);
     PoolingOp<float>::PoolingForward(handle, poolSpec,
-            maxpool2_output, maxpool3_output);
+            maxpool2_output, maxpool3_output, &maxpool_context[3]);
     PoolingOp<float>::PoolingForward(handle, poolSpec,
-            maxpool3_output, maxpool4_output);
+            maxpool3_output, maxpool4_output, &maxpool_context[4]);
     FullyConnectOp<float>::FullyConnectForward(handle,
             maxpool4_output, fc_weight, &fc_bias, output);
-    // CrossEntropyOp<float>::CrossEntropyForward();
+    CrossEntropyOp<float>::CrossEntropyForward(handle,
+            output, label, loss);
 
-    // CrossEntropyOp<float>::CrossEntropyBackward();
+    CrossEntropyOp<float>::CrossEntropyBackward(handle,
+            output, label, loss_grad, output_grad);
     FullyConnectOp<float>::FullyConnectBackwardData(handle,
             output_grad, fc_weight, maxpool4_output_grad);
     FullyConnectOp<float>::FullyConnectBackwardWeight(handle,
             output_grad, maxpool4_output, fc_weight_grad, &fc_bias_grad);
+    buckets.ready(fc_bias_grad_id);
+    buckets.ready(fc_weight_grad_id);
     PoolingOp<float>::PoolingBackward(handle, poolSpec,
             maxpool3_output, maxpool4_output,
-            maxpool4_output_grad, maxpool3_output_grad);
+            maxpool4_output_grad, maxpool3_output_grad,
+            &maxpool_context[4]);
     PoolingOp<float>::PoolingBackward(handle, poolSpec,
             maxpool2_output, maxpool3_output,
-            maxpool3_output_grad, maxpool2_output_grad);
+            maxpool3_output_grad, maxpool2_output_grad,
+            &maxpool_context[3]);
     PoolingOp<float>::PoolingBackward(handle, poolSpec,
             maxpool1_output, maxpool2_output,
-            maxpool2_output_grad, maxpool1_output_grad);
+            maxpool2_output_grad, maxpool1_output_grad,
+            &maxpool_context[2]);
     PoolingOp<float>::PoolingBackward(handle, poolSpec,
             maxpool0_output, maxpool1_output,
-            maxpool1_output_grad, maxpool0_output_grad);
+            maxpool1_output_grad, maxpool0_output_grad,
+            &maxpool_context[1]);
     PoolingOp<float>::PoolingBackward(handle, poolSpec,
             conv_output, maxpool0_output,
-            maxpool0_output_grad, conv_output_grad);
+            maxpool0_output_grad, conv_output_grad,
+            &maxpool_context[0]);
     ConvolutionOp<float>::ConvBackwardWeight(handle, convSpec,
             conv_output_grad, input,
             conv_weight_grad, &conv_bias_grad);
+    buckets.ready(conv_bias_grad_id);
+    buckets.ready(conv_weight_grad_id);
     ConvolutionOp<float>::ConvBackwardData(handle, convSpec,
             conv_output_grad, conv_weight, input_grad);
+    // The optimizer step would follow
+    buckets.wait();
+}
+
+// Forward only, for serving: no gradients, no pooling indices (MIOpen
+// runs with do_backward = false) and two activation buffers used in
+// turn, allocated up front, instead of one buffer per layer.
+void RunSimpleVGGInference(ExecContext& handle, int batch_size){
+    std::vector<int> input_shape = {batch_size, 3, 224, 224};
+    std::vector<int> conv_weight_shape = {64, 3, 3, 3};
+    std::vector<int> conv_bias_shape = {64, 1, 1, 1};
+    std::vector<int> conv_output_shape = {batch_size, 64, 224, 224};
+    std::vector<int> fc_weight_shape = {1000, 64 * 7 * 7, 1, 1};
+    std::vector<int> fc_bias_shape = {1000, 1, 1, 1};
+    std::vector<int> output_shape = {batch_size, 1000, 1, 1};
+
+    ConvDescriptor convSpec("conv", 1, 1, 1, 1);
+    PoolingDescriptor poolSpec("max", 2, 2, 0, 0, 2, 2);
+
+    Tensor<float> conv_weight(1, conv_weight_shape);
+    Tensor<float> conv_bias(1, conv_bias_shape);
+    Tensor<float> fc_weight(1, fc_weight_shape);
+    Tensor<float> fc_bias(1, fc_bias_shape);
+
+    // Activations take turns in two buffers of the largest one. The
+    // views live until the end, so no layer waits for the one before.
+    std::vector<std::vector<int>> shapes {conv_output_shape};
+    for (int size = 112; size >= 7; size /= 2)
+        shapes.push_back({batch_size, 64, size, size});
+    shapes.push_back(output_shape);
+    int largest = batch_size * 64 * 224 * 224;
+    Tensor<float> buffers[2] = {Tensor<float>({largest}),
+        Tensor<float>({largest})};
+    std::vector<Tensor<float>> acts;
+    acts.reserve(shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++) {
+        int size = std::accumulate(shapes[i].begin(), shapes[i].end(), 1,
+                std::multiplies<int>());
+        acts.push_back(buffers[i % 2].slice(0, 0, size).reshape(shapes[i]));
+    }
+
+    Tensor<float> x(1, input_shape);
+    ConvolutionOp<float>::ConvForward(handle, convSpec,
+            x, conv_weight, &conv_bias, acts[0]);
+    for (size_t i = 1; i + 1 < acts.size(); i++)
+        PoolingOp<float>::PoolingForward(handle, poolSpec,
+                acts[i - 1], acts[i]);
+    FullyConnectOp<float>::FullyConnectForward(handle,
+            acts[acts.size() - 2], fc_weight, &fc_bias, acts.back());
+    acts.back().wait();
 }
 
 int main(int argc, char** argv){
     Communicator comm(argc, argv);
-    HipHandle handle(comm.getRank());
-    CHECK_CALL_HIP(hipSetDevice(comm.getRank()));
+    std::unique_ptr<ExecContext> handle = createExecContext(comm.getRank());
+
+    // TEST_INFERENCE=1 runs the forward only runner, TEST_BATCH_SIZE
+    // overrides the batch of either
+    const char* inference = getenv("TEST_INFERENCE");
+    bool inferenceOnly = inference != nullptr && std::string(inference) == "1";
+    const char* batch = getenv("TEST_BATCH_SIZE");
+    int batchSize = batch == nullptr ? 32 : atoi(batch);
+    CHECK_ARGS(batchSize > 0, "Invalid TEST_BATCH_SIZE!");
 
     int testIters = 500;
     for(int i = 0; i < testIters; i++){
         std::cout << "Pid-" << getpid() << ": Running Iter " << i << std::endl;
-        RunSimpleVGG(handle);
+        if (inferenceOnly)
+            RunSimpleVGGInference(*handle, batchSize);
+        else
+            RunSimpleVGG(*handle, comm, batchSize, i == 0);
     }
+    std::cout << "Pid-" << getpid() << ": Conv algo cache hits "
+            << ConvAlgoCache::instance().hits() << " misses "
+            << ConvAlgoCache::instance().misses() << std::endl;
+    std::cout << "Pid-" << getpid() << ": Memory pool "
+            << MemoryPool::current(handle->backend()).stats() << std::endl;
+    std::cout << "Pid-" << getpid() << ": Workspace high water "
+            << handle->workspace().highWater() << " B" << std::endl;
 
     return 0;
 }
@@ -5,33 +5,35 @@ template<typename T>
 void doAllreduce(Tensor<T>* send, Tensor<T>* recv, MPI_Op opType,
         MPI_Comm& mpiWorld){
     int count = recv->size();
+    // MPI reads the buffers directly, queued operators have to finish
+    if (send != nullptr) send->wait();
+    recv->wait();
     const void* pSend = (send == nullptr)
         ? MPI_IN_PLACE : send->data();
 #ifdef USE_COPY
     void* pRecv = malloc(count * sizeof(T));
-    CHECK_CALL_HIP(hipMemcpy(pRecv, recv->data(),
-            count * sizeof(T), hipMemcpyDeviceToHost));
+    BackendMemory::copyToHost(recv->backend(), pRecv, recv->data(),
+            count * sizeof(T));
 #else
     void* pRecv = recv->data();
 #endif
-    T sample;
     MPI_Request req;
     std::vector<MPI_Request> reqList;
     CHECK_CALLMPI(MPI_Iallreduce(pSend, pRecv, count, 
-            toMpiDataType(sample), opType, mpiWorld, &req));
+            toMpiDataType<T>(), opType, mpiWorld, &req));
     reqList.push_back(req);
     CHECK_CALLMPI(MPI_Waitall(reqList.size(),
             reqList.data(), MPI_STATUSES_IGNORE));
 #ifdef USE_COPY
-    CHECK_CALL_HIP(hipMemcpy(recv->data(), pRecv,
-            count * sizeof(T), hipMemcpyHostToDevice));
+    BackendMemory::copyFromHost(recv->backend(), recv->data(), pRecv,
+            count * sizeof(T));
     free(pRecv);
 #endif
 }
 
 int main(int argc, char** argv){
     Communicator comm(argc, argv);
-    HipHandle hipHandle(comm.getRank());
+    std::unique_ptr<ExecContext> handle = createExecContext(comm.getRank());
 
     TimeLogger timeLogger;
     uint32_t timeGap = 0;
@@ -63,5 +65,113 @@ int main(int argc, char** argv){
     test_name += std::string(pid);
     testSame(send, real, test_name);
     std::cout << test_name << " time: "<< timeGap << " us" << std::endl;
+
+    // Small chunks so the staged path runs through several of them
+    std::vector<float> staged_std(testSize), staged_sum(testSize, 0.0f);
+    for (size_t i = 0; i < testSize; i++) {
+        staged_std[i] = float((i + comm.getRank()) % 7);
+        for (int r = 0; r < comm.getWorldSize(); r++)
+            staged_sum[i] += float((i + r) % 7);
+    }
+    Tensor<float> staged(staged_std, shape);
+    comm.setChunkBytes(4096);
+    timeLogger.record();
+    comm.allreduceStaged(*handle, staged, MPI_SUM);
+    timeGap = timeLogger.getGapNow();
+    test_name = "MPI_test_allreduce_staged-" + std::string(pid);
+    testSame(staged, staged_sum, test_name);
+    std::cout << test_name << " time: "<< timeGap << " us" << std::endl;
+
+    // Three 1.5 KB gradients in 2 KB buckets: the first two share one
+    GradientBuckets<float> buckets(comm, *handle, 2048);
+    std::vector<int> grad_shape {4, 96};
+    int grads[3];
+    for (int& grad : grads)
+        grad = buckets.add(grad_shape);
+    buckets.build();
+    bool passed = buckets.buckets() == 2;
+    for (int step = 1; step <= 2; step++) {
+        for (int grad : grads) {
+            buckets.grad(grad).reset(float(step * (grad + comm.getRank())));
+            buckets.ready(grad);
+        }
+        buckets.wait();
+        for (int grad : grads) {
+            float sum = 0;
+            for (int r = 0; r < comm.getWorldSize(); r++)
+                sum += float(step * (grad + r));
+            std::ostringstream msg;
+            passed = buckets.grad(grad).equal(std::vector<float>(4 * 96, sum),
+                    msg, false) && passed;
+        }
+    }
+    std::cerr << "MPI_test_gradient_buckets-" << pid
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+
+    // Counts below, at and above the number of ranks
+    passed = true;
+    for (AllreduceAlgo algo : {AllreduceAlgo::Mpi, AllreduceAlgo::Ring,
+            AllreduceAlgo::Halving}) {
+        for (int count : {1, comm.getWorldSize(), 1001}) {
+            std::vector<int> data(count), sum(count, 0);
+            for (int i = 0; i < count; i++) {
+                data[i] = i * 10 + comm.getRank();
+                for (int r = 0; r < comm.getWorldSize(); r++)
+                    sum[i] += i * 10 + r;
+            }
+            comm.allreduceHost(data.data(), count, MPI_SUM, algo);
+            passed = data == sum && passed;
+        }
+    }
+    // Only sums are handed to a fixed native algorithm
+    comm.setAllreduceAlgo(AllreduceAlgo::Ring);
+    std::vector<int> ranks(3, comm.getRank());
+    comm.allreduceHost(ranks.data(), 3, MPI_MAX, AllreduceAlgo::Auto);
+    passed = ranks == std::vector<int>(3, comm.getWorldSize() - 1) && passed;
+    std::cerr << "MPI_test_allreduce_algos-" << pid
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+
+    Tensor<float> selected(staged_std, shape);
+    comm.setAllreduceAlgo(AllreduceAlgo::Auto);
+    comm.allreduce(*handle, selected, MPI_SUM);
+    test_name = "MPI_test_allreduce_selected-" + std::string(pid);
+    testSame(selected, staged_sum, test_name);
+
+    // Small integers are exact in both 16-bit formats, top-k of all the
+    // elements is the plain sum and a sparse one keeps the rest in the
+    // residuals
+    passed = floatToHalf(1.0f) == 0x3c00 && floatToHalf(-2.0f) == 0xc000 &&
+        halfToFloat(0x7bff) == 65504.0f && floatToBf16(1.0f) == 0x3f80 &&
+        bf16ToFloat(floatToBf16(-3.0f)) == -3.0f;
+    for (CompressionMode mode : {CompressionMode::Fp16,
+            CompressionMode::Bf16, CompressionMode::TopK}) {
+        Tensor<float> compressed(staged_std, shape);
+        Compression compression(mode, 1.0f);
+        comm.allreduceCompressed(*handle, compressed, compression);
+        std::ostringstream msg;
+        passed = compressed.equal(staged_sum, msg, false) && passed;
+    }
+    Tensor<float> sparse(staged_std, shape);
+    Compression topk(CompressionMode::TopK, 0.1f);
+    comm.allreduceCompressed(*handle, sparse, topk);
+    if (comm.getWorldSize() > 1) {
+        std::vector<float> residual = topk.residual;
+        comm.allreduceHost(residual.data(), testSize, MPI_SUM,
+                AllreduceAlgo::Mpi);
+        std::vector<float> dense(testSize);
+        sparse.copyToHostAsync(*handle, dense.data()).wait();
+        for (size_t i = 0; i < testSize; i++)
+            passed = dense[i] + residual[i] == staged_sum[i] && passed;
+    }
+    std::cerr << "MPI_test_allreduce_compressed-" << pid
+            << (passed ? " Test Passed!" : " Test Failed!") << std::endl;
+
+    if (comm.getRank() == 0) {
+        std::cout << "Allreduce algorithms " << comm.allreduceReport();
+        if (comm.isHierarchical())
+            std::cout << ", hierarchical with " << comm.getNodeSize()
+                    << " ranks on node 0";
+        std::cout << std::endl;
+    }
     return 0;
 }
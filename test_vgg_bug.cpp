@@ -162,6 +162,8 @@ int main(int argc, char** argv){
                 w_grad_std_shape, b_grad_std_shape,
                 x_grad_std_shape);
     }
+    std::cout << "Pid-" << getpid() << ": Memory pool "
+            << MemoryPool::current(Backend::Hip).stats() << std::endl;
 
     return 0;
 }
@@ -0,0 +1,21 @@
+#include "test_helper.hpp"
+
+// Merge the tuning dbs written by many ranks into one file, e.g.
+//   tuning_db_merge merged.db rank0.db rank1.db ...
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0]
+                << " <output.db> <input.db> [<input.db> ...]" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> inputs(argv + 2, argv + argc);
+    CHECK_ARGS(TuningDb::merge(inputs, argv[1]),
+            "Failed to merge tuning dbs!");
+
+    size_t records = 0;
+    TuningDb::load(argv[1], [&](const std::string&, const std::string&,
+            const ConvAlgoEntry&) { records++; });
+    std::cout << "Merged " << inputs.size() << " tuning dbs into "
+            << argv[1] << ": " << records << " records" << std::endl;
+    return 0;
+}